@@ -0,0 +1,230 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "core.h"
+#include "entry.h"
+#include "progress_bar.h"
+#include "stats.h"
+#include "verify.h"
+
+void batch_init(batch_t *batch, size_t threshold)
+{
+	*batch = (batch_t){
+		.threshold = threshold,
+	};
+}
+
+void destroy_batch(batch_t *batch)
+{
+	free(batch->buf);
+	*batch = (batch_t){ 0 };
+}
+
+bool is_batched(const batch_t *batch, const entry_t *entry)
+{
+	return entry->type == et_reg && (size_t)entry->size < batch->threshold;
+}
+
+static int batch_reserve(batch_t *batch, size_t size)
+{
+	if (size <= batch->cap)
+		return 0;
+
+	void *new_mem = realloc(batch->buf, size);
+	if (new_mem == NULL) {
+		PERROR("realloc");
+		return -1;
+	}
+	batch->buf = new_mem;
+	batch->cap = size;
+
+	return 0;
+}
+
+static int read_whole(const entry_t *entry, char *buf)
+{
+	const int fd = open_entry(entry, op_read);
+	if (fd < 0)
+		return -1;
+
+	int ret = 0;
+	for (off_t done = 0; done < entry->size;) {
+		const ssize_t r = read(fd, buf + done, entry->size - done);
+		stats_syscall();
+		if (r <= 0) {
+			if (r < 0)
+				PERROR("read");
+			else
+				fprintf(stderr, "`%s` shrank while sending\n",
+					entry->rel_path);
+			ret = -1;
+			break;
+		}
+		done += r;
+	}
+
+	close(fd);
+
+	return ret;
+}
+
+static int send_frame(int soc, const entry_t *first, stream_iter_t it,
+		      batch_t *batch)
+{
+	batch_header_t header = { 0 };
+	const entry_t *entry = first;
+
+	do {
+		if (entry->type == et_dir)
+			continue;
+		if (!is_batched(batch, entry))
+			break;
+		if (header.files > 0 &&
+		    (header.size + entry->size > BATCH_FRAME_SIZE ||
+		     header.files == BATCH_MAX_FILES))
+			break;
+
+		if (batch_reserve(batch, header.size + entry->size) < 0)
+			return -1;
+		if (read_whole(entry, batch->buf + header.size) < 0)
+			return -1;
+
+		header.files++;
+		header.size += entry->size;
+	} while ((entry = stream_iter_next(&it)));
+
+	struct iovec iov[2] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = batch->buf, .iov_len = header.size },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+	};
+
+	/* writes are only short on huge frames, finish them the slow way */
+	ssize_t sent = sendmsg(soc, &msg, 0);
+	if (sent < 0) {
+		PERROR("sendmsg");
+		return -1;
+	}
+	if (sent < (ssize_t)sizeof(header)) {
+		if (perf_soc_op(soc, op_write, (char *)&header + sent,
+				sizeof(header) - sent, NULL) < 0)
+			return -1;
+		sent = sizeof(header);
+	}
+	sent -= sizeof(header);
+	if (perf_soc_op(soc, op_write, batch->buf + sent, header.size - sent,
+			NULL) < 0)
+		return -1;
+
+	batch->left = header.files;
+	batch->pos = 0;
+
+	return 0;
+}
+
+int send_batched_entry(int soc, const entry_t *entry, stream_iter_t it,
+		       batch_t *batch)
+{
+	assert(is_batched(batch, entry));
+
+	if (batch->left == 0 && send_frame(soc, entry, it, batch) < 0)
+		return -1;
+
+	batch->left--;
+	verify_feed(0, batch->buf + batch->pos, entry->size);
+	batch->pos += entry->size;
+	progress_add(entry->size, 1);
+
+	return 0;
+}
+
+int batch_frame_begin(batch_t *batch, const batch_header_t *header)
+{
+	if (header->files == 0 || header->files > BATCH_MAX_FILES ||
+	    header->size > BATCH_FRAME_SIZE + batch->threshold) {
+		fprintf(stderr, "invalid batch frame of %u files, %u bytes\n",
+			header->files, header->size);
+		return -1;
+	}
+
+	if (batch_reserve(batch, header->size) < 0)
+		return -1;
+
+	batch->left = header->files;
+	batch->size = header->size;
+	batch->pos = 0;
+
+	return 0;
+}
+
+static int recv_frame(int soc, batch_t *batch)
+{
+	batch_header_t header;
+	if (perf_soc_op(soc, op_read, &header, sizeof(header), NULL) < 0)
+		return -1;
+
+	if (batch_frame_begin(batch, &header) < 0)
+		return -1;
+
+	if (perf_soc_op(soc, op_read, batch->buf, header.size, NULL) < 0)
+		return -1;
+
+	return 0;
+}
+
+int batch_write_entry(const entry_t *entry, batch_t *batch)
+{
+	assert(is_batched(batch, entry) && batch->left > 0);
+
+	batch->left--;
+
+	if (batch->pos + entry->size > batch->size) {
+		fprintf(stderr, "batch frame does not match the entries\n");
+		return -1;
+	}
+
+	const int fd = open_entry(entry, op_write);
+	if (fd < 0)
+		return -1;
+
+	int ret = 0;
+	for (off_t done = 0; done < entry->size;) {
+		const ssize_t w = write(fd, batch->buf + batch->pos + done,
+					entry->size - done);
+		stats_syscall();
+		if (w < 0) {
+			PERROR("write");
+			ret = -1;
+			break;
+		}
+		done += w;
+	}
+
+	if (ret == 0)
+		verify_feed(0, batch->buf + batch->pos, entry->size);
+	batch->pos += entry->size;
+	close(fd);
+	if (ret == 0)
+		progress_add(entry->size, 1);
+
+	return ret;
+}
+
+int recv_batched_entry(int soc, const entry_t *entry, batch_t *batch)
+{
+	assert(is_batched(batch, entry));
+
+	if (batch->left == 0 && recv_frame(soc, batch) < 0)
+		return -1;
+
+	return batch_write_entry(entry, batch);
+}
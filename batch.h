@@ -0,0 +1,53 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "entry.h"
+#include "stream.h"
+
+#define DEFAULT_BATCH_THRESHOLD (64 * 1024)
+/* frames stop growing once they reach this size */
+#define BATCH_FRAME_SIZE (1 << 20)
+#define BATCH_MAX_FILES 4096
+
+/*
+ * runs of consecutive small files (directories in between do not break a
+ * run) are sent back to back as a single frame, so the receiver gets them
+ * with one recv and writes each one out with open/write/close
+ */
+typedef struct batch_header {
+	uint32_t files;
+	uint32_t size;
+} batch_header_t;
+
+typedef struct batch {
+	size_t threshold;
+
+	char *buf;
+	size_t cap;
+	size_t size;
+	/* where the next file starts in the frame, on both ends */
+	size_t pos;
+	/* files of the current frame that have not been consumed yet */
+	uint32_t left;
+} batch_t;
+
+void batch_init(batch_t *batch, size_t threshold);
+void destroy_batch(batch_t *batch);
+
+bool is_batched(const batch_t *batch, const entry_t *entry);
+
+/*
+ * chdir to entries_t.parent_path before running
+ * it has to point just past entry, which must be batched
+ */
+int send_batched_entry(int soc, const entry_t *entry, stream_iter_t it,
+		       batch_t *batch);
+int recv_batched_entry(int soc, const entry_t *entry, batch_t *batch);
+
+/* for receivers that read the frames themselves */
+/* checks the header and makes room for the frame in batch.buf */
+int batch_frame_begin(batch_t *batch, const batch_header_t *header);
+/* writes out the next file of the frame that has been read into batch.buf */
+int batch_write_entry(const entry_t *entry, batch_t *batch);
@@ -0,0 +1,256 @@
+#!/bin/bash
+#
+# Loopback benchmark of whole transfers. Every dataset is sent with every
+# mode by a client and a server on 127.0.0.1, and the results are printed
+# as one json document on stdout (and kept in $BENCH_OUT). Both ends run
+# with --stats, so every result also has the time and throughput of each
+# phase (scan, handshake, metadata, data, verify) as each end saw it.
+#
+# Knobs, all through the environment:
+#   BENCH_DIR       where the datasets and the received copies live
+#   BENCH_OUT       file the json is also written to
+#   BENCH_PORT      port of the server
+#   BENCH_DATASETS  datasets to run: huge tiny mixed deep
+#   BENCH_MODES     "name:client args:server args" entries, separated by ;
+#   BENCH_HUGE_MB   size of the single file of the huge dataset
+#   BENCH_TINY      number of 1KiB files in the one directory of tiny
+#   BENCH_DEPTH     depth of the deep tree
+#   BENCH_VERIFY    0 skips comparing the received tree with the source
+#   BENCH_TIMEOUT   seconds a single run may take
+
+set -u
+
+cd "$(dirname "$0")/.."
+
+BENCH_DIR=${BENCH_DIR:-/tmp/file_sharer-bench}
+BENCH_OUT=${BENCH_OUT:-bench.json}
+BENCH_PORT=${BENCH_PORT:-2237}
+BENCH_DATASETS=${BENCH_DATASETS:-huge tiny mixed deep}
+BENCH_MODES=${BENCH_MODES:-"default::;batch:-b:;streams:-s 4:"}
+BENCH_HUGE_MB=${BENCH_HUGE_MB:-1024}
+BENCH_TINY=${BENCH_TINY:-20000}
+BENCH_DEPTH=${BENCH_DEPTH:-32}
+BENCH_VERIFY=${BENCH_VERIFY:-1}
+BENCH_TIMEOUT=${BENCH_TIMEOUT:-600}
+
+RUNSTAT=bench/runstat
+GENTREE=bench/gentree
+DATA=$BENCH_DIR/data
+RECV=$BENCH_DIR/recv
+LOGS=$BENCH_DIR/logs
+
+log()
+{
+	echo "bench: $*" >&2
+}
+
+die()
+{
+	log "$*"
+	exit 1
+}
+
+for bin in ./server ./client $RUNSTAT $GENTREE; do
+	[ -x $bin ] || die "$bin is missing, run make bench"
+done
+
+# numbers of a sanitized build say little about the real thing
+sanitized=false
+if grep -qa __asan_init ./client; then
+	sanitized=true
+	log "warning: the binaries are a debug build, run make clean first"
+	export ASAN_OPTIONS=${ASAN_OPTIONS:-detect_leaks=0}
+fi
+
+# the bench/gentree options of a dataset, the same options make the same tree
+dataset_spec()
+{
+	case $1 in
+	huge) echo "-d 0 -n 1 -s fixed:${BENCH_HUGE_MB}M" ;;
+	tiny) echo "-d 0 -n $BENCH_TINY -s fixed:1K" ;;
+	# roughly what a source tree with some assets in it looks like
+	mixed) echo "-f 4 -d 2 -n 48 -s log:0:4M" ;;
+	deep) echo "-f 1 -d $BENCH_DEPTH -n 16 -s fixed:8K" ;;
+	*) die "unknown dataset $1" ;;
+	esac
+}
+
+prepare_dataset()
+{
+	local root=$DATA/$1 spec
+	spec=$(dataset_spec $1)
+
+	if [ "$(cat "$root.spec" 2> /dev/null)" = "$spec" ]; then
+		return
+	fi
+
+	log "generating dataset $1"
+	rm -rf "$root" "$root.spec"
+	$GENTREE $spec "$root" > /dev/null ||
+		die "could not generate dataset $1"
+	echo "$spec" > "$root.spec"
+}
+
+# $1 log, $2 pattern, $3 count, $4 seconds
+wait_for_lines()
+{
+	local deadline=$((SECONDS + $4))
+	while (($(grep -ac "$2" "$1") < $3)); do
+		((SECONDS < deadline)) || return 1
+		sleep 0.01
+	done
+}
+
+# the --stats summaries in log $1 as json, the sessions of the stripes of a
+# transfer overlap so a phase took as long as the slowest of them
+# the rates are the whole dataset over the time of the phase
+# $2 bytes, $3 files
+phases()
+{
+	grep -ao '"phases": {[^}]*}' "$1" | awk -v bytes=$2 -v files=$3 '
+	{
+		sub(/.*\{/, "")
+		sub(/\}.*/, "")
+		n = split($0, kv, ", ")
+		for (i = 1; i <= n; ++i) {
+			split(kv[i], p, ": ")
+			name = p[1]
+			gsub(/"/, "", name)
+			sub(/_s$/, "", name)
+			if (!(name in secs))
+				order[++len] = name
+			if (!(name in secs) || p[2] + 0 > secs[name])
+				secs[name] = p[2] + 0
+		}
+	}
+	END {
+		if (!len) {
+			printf "null"
+			exit
+		}
+		printf "{"
+		for (i = 1; i <= len; ++i) {
+			s = secs[order[i]]
+			printf "%s\"%s\": {\"s\": %.6f", (i > 1 ? ", " : ""),
+				order[i], s
+			# a few small messages, there is nothing to divide
+			if (order[i] == "handshake")
+				printf "}"
+			else if (s > 0)
+				printf ", \"mib_s\": %.2f, \"files_s\": %.1f}",
+					bytes / s / 1048576, files / s
+			else
+				printf ", \"mib_s\": null, \"files_s\": null}"
+		}
+		printf "}"
+	}'
+}
+
+# $1 dataset, $2 mode name, $3 client args, $4 server args
+run_one()
+{
+	local dataset=$1 mode=$2 client_args=$3 server_args=$4
+	local src=$DATA/$dataset dst=$RECV/$dataset-$mode
+	local tag=$dataset-$mode streams=1
+
+	# every stripe is a connection of its own that the server reports
+	if [[ $client_args =~ (-s|--streams)[=\ ]*([0-9]+) ]]; then
+		streams=${BASH_REMATCH[2]}
+	fi
+
+	rm -rf "$dst"
+	mkdir -p "$dst"
+	sync
+
+	local srv_log=$LOGS/$tag.server.log
+	$RUNSTAT "$LOGS/$tag.server.json" stdbuf -oL \
+		./server -y --stats $server_args $BENCH_PORT "$dst" \
+		> "$srv_log" 2>&1 &
+	local srv=$!
+
+	# both the threads and the event loops (-l) say so once they listen
+	if ! wait_for_lines "$srv_log" "Waiting for" 1 10; then
+		kill $srv 2> /dev/null
+		wait $srv
+		die "server did not start, see $srv_log"
+	fi
+
+	# the transfer is over when the server is done, not the client
+	local start=$EPOCHREALTIME
+	timeout $BENCH_TIMEOUT $RUNSTAT "$LOGS/$tag.client.json" \
+		./client --stats $client_args -p $BENCH_PORT 127.0.0.1 "$src" \
+		> "$LOGS/$tag.client.log" 2>&1
+	local client_status=$?
+
+	local ok=true
+	if ((client_status != 0)) ||
+		! wait_for_lines "$srv_log" "Disconnected" $streams \
+			$BENCH_TIMEOUT; then
+		ok=false
+	fi
+	local end=$EPOCHREALTIME
+
+	kill $srv 2> /dev/null
+	wait $srv
+
+	if $ok && ((BENCH_VERIFY)) &&
+		! diff -rq "$src" "$dst/$dataset" > "$LOGS/$tag.diff" 2>&1; then
+		ok=false
+	fi
+	$ok || log "$tag failed, see $LOGS/$tag.*"
+
+	local files bytes usec rates
+	files=$(cat "$DATA/$dataset.files")
+	bytes=$(cat "$DATA/$dataset.bytes")
+	usec=$((${end/./} - ${start/./}))
+
+	rates=$(awk -v files=$files -v bytes=$bytes -v usec=$usec 'BEGIN {
+		wall = usec / 1e6
+		printf "\"bytes\": %d, \"files\": %d, ", bytes, files
+		printf "\"wall_s\": %.6f, ", wall
+		printf "\"throughput_mib_s\": %.2f, ", bytes / wall / 1048576
+		printf "\"files_s\": %.1f", files / wall
+	}')
+
+	printf '    {"dataset": "%s", "mode": "%s", ' "$dataset" "$mode"
+	printf '"client_args": "%s", "server_args": "%s", ' \
+		"$client_args" "$server_args"
+	printf '"ok": %s, %s,\n' $ok "$rates"
+	printf '     "phases": {"client": %s,\n' \
+		"$(phases "$LOGS/$tag.client.log" $bytes $files)"
+	printf '                "server": %s},\n' \
+		"$(phases "$srv_log" $bytes $files)"
+	printf '     "client": %s,\n' "$(cat "$LOGS/$tag.client.json")"
+	printf '     "server": %s}' "$(cat "$LOGS/$tag.server.json")"
+}
+
+mkdir -p "$DATA" "$RECV" "$LOGS"
+
+for dataset in $BENCH_DATASETS; do
+	prepare_dataset $dataset
+	find "$DATA/$dataset" -type f | wc -l > "$DATA/$dataset.files"
+	find "$DATA/$dataset" -type f -printf '%s\n' |
+		awk '{ s += $1 } END { print s + 0 }' > "$DATA/$dataset.bytes"
+done
+
+IFS=';' read -ra modes <<< "$BENCH_MODES"
+
+{
+	printf '{"date": "%s", "commit": "%s", "cpus": %d, "sanitized": %s,\n' \
+		"$(date -u +%FT%TZ)" \
+		"$(git rev-parse --short HEAD 2> /dev/null || echo unknown)" \
+		"$(nproc)" $sanitized
+	printf ' "results": [\n'
+	sep=
+	for dataset in $BENCH_DATASETS; do
+		for spec in "${modes[@]}"; do
+			IFS=':' read -r mode client_args server_args <<< "$spec"
+			log "$dataset with $mode"
+			printf '%s' "$sep"
+			run_one $dataset $mode "$client_args" "$server_args"
+			sep=$',\n'
+			rm -rf "$RECV/$dataset-$mode"
+		done
+	done
+	printf '\n ]}\n'
+} | tee "$BENCH_OUT"
@@ -0,0 +1,91 @@
+#include <argp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tree.h"
+
+typedef struct args {
+	const char *path;
+	tree_spec_t spec;
+} args;
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+	args *a = state->input;
+	switch (key) {
+	case 'f':
+		a->spec.fanout = atoi(arg);
+		break;
+	case 'd':
+		a->spec.depth = atoi(arg);
+		break;
+	case 'n':
+		a->spec.files = atoi(arg);
+		break;
+	case 's':
+		if (parse_size_dist(arg, &a->spec) < 0) {
+			fprintf(stderr, "invalid size distribution %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'S':
+		a->spec.seed = strtoull(arg, NULL, 0);
+		break;
+	case ARGP_KEY_ARG:
+		if (a->path)
+			argp_usage(state);
+		a->path = arg;
+		break;
+	case ARGP_KEY_END:
+		if (!a->path)
+			argp_usage(state);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct argp_option options[] = {
+		{ "fanout", 'f', "N", 0,
+		  "subdirectories of every directory (default: 4)" },
+		{ "depth", 'd', "N", 0,
+		  "levels of subdirectories below the root (default: 2)" },
+		{ "files", 'n', "N", 0, "files in every directory (default: 8)" },
+		{ "sizes", 's', "DIST", 0,
+		  "fixed:SIZE, uniform:MIN:MAX or log:MIN:MAX, "
+		  "sizes take K, M and G (default: log:0:1M)" },
+		{ "seed", 'S', "SEED", 0, "seed of the sizes and the data" },
+		{ 0 }
+	};
+	const struct argp argp = {
+		.options = options,
+		.args_doc = "PATH",
+		.doc = "Generates the same directory tree for the same options",
+		.parser = parse_opt,
+	};
+
+	args a = {
+		.spec = {
+			.fanout = 4,
+			.depth = 2,
+			.files = 8,
+			.dist = sd_log,
+			.max_size = 1 << 20,
+		},
+	};
+	if (argp_parse(&argp, argc, argv, 0, NULL, &a) < 0)
+		return EXIT_FAILURE;
+
+	tree_stats_t stats;
+	if (generate_tree(a.path, &a.spec, &stats) < 0)
+		return EXIT_FAILURE;
+
+	printf("{\"dirs\": %zu, \"files\": %zu, \"bytes\": %jd}\n", stats.dirs,
+	       stats.files, (intmax_t)stats.bytes);
+
+	return EXIT_SUCCESS;
+}
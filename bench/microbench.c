@@ -0,0 +1,381 @@
+#define _GNU_SOURCE
+#include <argp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../compact.h"
+#include "../core.h"
+#include "../entry.h"
+#include "../stream.h"
+#include "tree.h"
+
+/*
+ * the scan and metadata paths without a network, on a generated tree or on
+ * DIR, every benchmark prints its best run as a line of json
+ *
+ * allocations are counted through -Wl,--wrap, so only the calls made from
+ * the objects of this repo are seen, not the ones inside libc
+ */
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static atomic_size_t allocs;
+static atomic_size_t alloc_bytes;
+
+static void count_alloc(size_t size)
+{
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&alloc_bytes, size, memory_order_relaxed);
+}
+
+void *__wrap_malloc(size_t size)
+{
+	count_alloc(size);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	count_alloc(n * size);
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	count_alloc(size);
+	return __real_realloc(ptr, size);
+}
+
+typedef struct args {
+	const char *path;
+	tree_spec_t spec;
+	unsigned reps;
+	unsigned threads;
+} args;
+
+typedef struct result {
+	const char *name;
+	size_t entries;
+	double ns;
+	size_t allocs;
+	size_t alloc_bytes;
+} result_t;
+
+typedef struct bench_ctx {
+	const args *a;
+	/* the scanned tree every other benchmark works on */
+	entries_t scanned;
+	stream_t copy;
+} bench_ctx_t;
+
+/* runs once per repetition and returns the entries it handled or -1 */
+typedef ssize_t (*bench_fn)(bench_ctx_t *ctx);
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1.0e9 + ts.tv_nsec;
+}
+
+static int run(bench_ctx_t *ctx, const char *name, bench_fn fn,
+	       bench_fn cleanup)
+{
+	result_t best = { .name = name, .ns = -1 };
+
+	for (unsigned i = 0; i < ctx->a->reps; ++i) {
+		const size_t allocs_before = atomic_load(&allocs);
+		const size_t bytes_before = atomic_load(&alloc_bytes);
+		const double start = now_ns();
+
+		const ssize_t entries = fn(ctx);
+		if (entries < 0) {
+			fprintf(stderr, "%s failed\n", name);
+			return -1;
+		}
+
+		const double ns = (now_ns() - start) / (entries ? entries : 1);
+		if (best.ns < 0 || ns < best.ns) {
+			best.entries = entries;
+			best.ns = ns;
+			best.allocs = atomic_load(&allocs) - allocs_before;
+			best.alloc_bytes =
+				atomic_load(&alloc_bytes) - bytes_before;
+		}
+
+		if (cleanup)
+			cleanup(ctx);
+	}
+
+	printf("{\"bench\": \"%s\", \"entries\": %zu, \"ns_per_entry\": %.1f, "
+	       "\"allocs\": %zu, \"allocs_per_entry\": %.3f, "
+	       "\"alloc_bytes\": %zu}\n",
+	       best.name, best.entries, best.ns, best.allocs,
+	       best.entries ? (double)best.allocs / best.entries : 0.0,
+	       best.alloc_bytes);
+	fflush(stdout);
+
+	return 0;
+}
+
+static ssize_t bench_create_entries(bench_ctx_t *ctx)
+{
+	entries_t e;
+	if (create_entries(ctx->a->path, &e) < 0)
+		return -1;
+
+	const size_t len = e.entries.metadata.len;
+	destroy_entries(&e);
+	return len;
+}
+
+static ssize_t bench_create_entries_parallel(bench_ctx_t *ctx)
+{
+	entries_t e;
+	if (create_entries_parallel(ctx->a->path, &e, ctx->a->threads) < 0)
+		return -1;
+
+	const size_t len = e.entries.metadata.len;
+	destroy_entries(&e);
+	return len;
+}
+
+static ssize_t bench_stream_add_item(bench_ctx_t *ctx)
+{
+	stream_iter_t it;
+	stream_iter_init(&it, &ctx->scanned.entries);
+
+	const entry_t *entry;
+	while ((entry = stream_iter_next(&it))) {
+		if (!add_entry(&ctx->copy, entry->type, entry->permissions,
+			       entry->size, entry->mtime, entry->rel_path,
+			       strlen(entry->rel_path)))
+			return -1;
+	}
+
+	return ctx->copy.metadata.len;
+}
+
+static ssize_t destroy_copy(bench_ctx_t *ctx)
+{
+	destroy_stream(&ctx->copy);
+	ctx->copy = (stream_t){ 0 };
+	return 0;
+}
+
+static ssize_t bench_stream_iter_next(bench_ctx_t *ctx)
+{
+	stream_iter_t it;
+	stream_iter_init(&it, &ctx->scanned.entries);
+
+	/* volatile, so the walk is not optimised away */
+	volatile off_t total = 0;
+	size_t len = 0;
+	const entry_t *entry;
+	while ((entry = stream_iter_next(&it))) {
+		total += entry->size;
+		len++;
+	}
+
+	return len;
+}
+
+typedef struct sender {
+	int soc;
+	const stream_t *stream;
+	int (*send)(int soc, const stream_t *stream);
+	int ret;
+} sender_t;
+
+static void *send_thread(void *arg)
+{
+	sender_t *s = arg;
+	s->ret = s->send(s->soc, s->stream);
+	return NULL;
+}
+
+static int send_raw(int soc, const stream_t *stream)
+{
+	return send_stream(soc, (stream_t *)stream);
+}
+
+static int recv_raw(int soc, stream_t *stream)
+{
+	return recv_stream(soc, stream, sizeof(entry_t));
+}
+
+/* sends the scanned entries over a socketpair and reads them into copy */
+static ssize_t over_socketpair(bench_ctx_t *ctx,
+			       int (*send)(int soc, const stream_t *stream),
+			       int (*recv)(int soc, stream_t *stream))
+{
+	int socs[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, socs) < 0) {
+		PERROR("socketpair");
+		return -1;
+	}
+
+	sender_t s = {
+		.soc = socs[0],
+		.stream = &ctx->scanned.entries,
+		.send = send,
+	};
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, send_thread, &s)) {
+		PERROR("pthread_create");
+		close(socs[0]);
+		close(socs[1]);
+		return -1;
+	}
+
+	const int ret = recv(socs[1], &ctx->copy);
+	/* the sender blocks in a full socket unless this side goes away */
+	close(socs[1]);
+	pthread_join(tid, NULL);
+	close(socs[0]);
+
+	if (ret < 0 || s.ret < 0)
+		return -1;
+	return ctx->copy.metadata.len;
+}
+
+static ssize_t bench_send_recv_stream(bench_ctx_t *ctx)
+{
+	return over_socketpair(ctx, send_raw, recv_raw);
+}
+
+static ssize_t bench_send_recv_compact(bench_ctx_t *ctx)
+{
+	return over_socketpair(ctx, send_compact_entries,
+			       recv_compact_entries);
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+	args *a = state->input;
+	switch (key) {
+	case 'f':
+		a->spec.fanout = atoi(arg);
+		break;
+	case 'd':
+		a->spec.depth = atoi(arg);
+		break;
+	case 'n':
+		a->spec.files = atoi(arg);
+		break;
+	case 'r':
+		a->reps = atoi(arg);
+		if (a->reps < 1)
+			argp_usage(state);
+		break;
+	case 'j':
+		a->threads = atoi(arg);
+		break;
+	case ARGP_KEY_ARG:
+		if (a->path)
+			argp_usage(state);
+		a->path = arg;
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct argp_option options[] = {
+		{ "fanout", 'f', "N", 0,
+		  "subdirectories of every generated directory (default: 8)" },
+		{ "depth", 'd', "N", 0,
+		  "levels of generated subdirectories (default: 3)" },
+		{ "files", 'n', "N", 0,
+		  "files in every generated directory (default: 32)" },
+		{ "reps", 'r', "N", 0,
+		  "runs of every benchmark, the best one is reported "
+		  "(default: 5)" },
+		{ "threads", 'j', "N", 0,
+		  "threads of create_entries_parallel (default: one per cpu)" },
+		{ 0 }
+	};
+	const struct argp argp = {
+		.options = options,
+		.args_doc = "[DIR]",
+		.doc = "Microbenchmarks of scanning a tree and of sending its "
+		       "entries, on DIR or on a generated tree of empty files",
+		.parser = parse_opt,
+	};
+
+	args a = {
+		.spec = {
+			.fanout = 8,
+			.depth = 3,
+			.files = 32,
+			.dist = sd_fixed,
+		},
+		.reps = 5,
+	};
+	if (argp_parse(&argp, argc, argv, 0, NULL, &a) < 0)
+		return EXIT_FAILURE;
+	if (a.threads == 0)
+		a.threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	int ret = EXIT_FAILURE;
+	char tmp[] = "/tmp/microbench-XXXXXX";
+	char generated[sizeof(tmp) + 8];
+	const bool generate = a.path == NULL;
+	bench_ctx_t ctx = { .a = &a };
+
+	if (generate) {
+		if (!mkdtemp(tmp))
+			ERR_EXIT("mkdtemp");
+		snprintf(generated, sizeof(generated), "%s/tree", tmp);
+		a.path = generated;
+
+		tree_stats_t stats;
+		if (generate_tree(generated, &a.spec, &stats) < 0)
+			goto remove;
+	}
+
+	/* create_entries cleans up after itself when it fails */
+	if (create_entries(a.path, &ctx.scanned) < 0)
+		goto remove;
+
+	if (run(&ctx, "create_entries", bench_create_entries, NULL) < 0)
+		goto cleanup;
+	if (a.threads > 1 &&
+	    run(&ctx, "create_entries_parallel", bench_create_entries_parallel,
+		NULL) < 0)
+		goto cleanup;
+	if (run(&ctx, "stream_add_item", bench_stream_add_item,
+		destroy_copy) < 0)
+		goto cleanup;
+	if (run(&ctx, "stream_iter_next", bench_stream_iter_next, NULL) < 0)
+		goto cleanup;
+	if (run(&ctx, "send_recv_stream", bench_send_recv_stream,
+		destroy_copy) < 0)
+		goto cleanup;
+	if (run(&ctx, "send_recv_compact", bench_send_recv_compact,
+		destroy_copy) < 0)
+		goto cleanup;
+
+	ret = EXIT_SUCCESS;
+
+cleanup:
+	destroy_entries(&ctx.scanned);
+	destroy_stream(&ctx.copy);
+remove:
+	if (generate)
+		remove_tree(tmp);
+
+	return ret;
+}
@@ -0,0 +1,87 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * runstat OUT COMMAND [ARGS...]
+ *
+ * Runs COMMAND and writes its wall time, cpu time and peak rss to OUT as
+ * a json object. SIGINT and SIGTERM are passed on to COMMAND, so the
+ * numbers of a server that is stopped from outside are still reported.
+ */
+
+static pid_t child = -1;
+
+static void forward(int sig)
+{
+	if (child > 0)
+		kill(child, sig);
+}
+
+static double tv_seconds(struct timeval tv)
+{
+	return tv.tv_sec + tv.tv_usec * 1.0e-6;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s OUT COMMAND [ARGS...]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct sigaction sa = { .sa_handler = forward };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	switch (child = fork()) {
+	case -1:
+		perror("fork");
+		return EXIT_FAILURE;
+	case 0:
+		execvp(argv[2], argv + 2);
+		perror("execvp");
+		_exit(127);
+	}
+
+	int status;
+	struct rusage usage;
+	while (wait4(child, &status, 0, &usage) < 0) {
+		if (errno != EINTR) {
+			perror("wait4");
+			return EXIT_FAILURE;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	FILE *out = fopen(argv[1], "w");
+	if (!out) {
+		perror("fopen");
+		return EXIT_FAILURE;
+	}
+
+	const int code = WIFEXITED(status) ? WEXITSTATUS(status) :
+					     128 + WTERMSIG(status);
+	fprintf(out,
+		"{\"wall_s\": %.6f, \"user_s\": %.6f, \"sys_s\": %.6f, "
+		"\"max_rss_kb\": %ld, \"voluntary_cs\": %ld, "
+		"\"involuntary_cs\": %ld, \"status\": %d}\n",
+		end.tv_sec - start.tv_sec +
+			(end.tv_nsec - start.tv_nsec) * 1.0e-9,
+		tv_seconds(usage.ru_utime), tv_seconds(usage.ru_stime),
+		usage.ru_maxrss, usage.ru_nvcsw, usage.ru_nivcsw, code);
+	fclose(out);
+
+	return code;
+}
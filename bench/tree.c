@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../core.h"
+#include "tree.h"
+
+#define WRITE_BUF_SIZE (64 << 10)
+/* the mtimes count up from here, one second per entry */
+#define BASE_MTIME (1600000000)
+
+typedef struct generator {
+	const tree_spec_t *spec;
+	tree_stats_t *stats;
+	/* entries made so far, the seed of the next one */
+	uint64_t n;
+	uint64_t buf[WRITE_BUF_SIZE / sizeof(uint64_t)];
+} generator_t;
+
+static uint64_t splitmix64(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+static off_t parse_size(const char *arg, char **end)
+{
+	off_t size = strtoll(arg, end, 10);
+	switch (**end) {
+	case 'G':
+		size <<= 10;
+		/* fallthrough */
+	case 'M':
+		size <<= 10;
+		/* fallthrough */
+	case 'K':
+		size <<= 10;
+		++*end;
+	}
+	return size;
+}
+
+int parse_size_dist(const char *arg, tree_spec_t *spec)
+{
+	const struct {
+		const char *name;
+		size_dist dist;
+		unsigned bounds;
+	} dists[] = {
+		{ "fixed:", sd_fixed, 1 },
+		{ "uniform:", sd_uniform, 2 },
+		{ "log:", sd_log, 2 },
+	};
+
+	for (size_t i = 0; i < sizeof(dists) / sizeof(dists[0]); ++i) {
+		const size_t len = strlen(dists[i].name);
+		if (strncmp(arg, dists[i].name, len) != 0)
+			continue;
+
+		char *end;
+		spec->dist = dists[i].dist;
+		spec->min_size = spec->max_size = parse_size(arg + len, &end);
+		if (dists[i].bounds == 2) {
+			if (*end != ':')
+				return -1;
+			spec->max_size = parse_size(end + 1, &end);
+		}
+
+		if (*end != '\0' || spec->min_size < 0 ||
+		    spec->max_size < spec->min_size)
+			return -1;
+		return 0;
+	}
+
+	return -1;
+}
+
+static off_t pick_size(const tree_spec_t *spec, uint64_t *state)
+{
+	const uint64_t r = splitmix64(state);
+	const uint64_t lo = spec->min_size, hi = spec->max_size;
+
+	switch (spec->dist) {
+	case sd_fixed:
+		return lo;
+	case sd_uniform:
+		return lo + r % (hi - lo + 1);
+	case sd_log: {
+		/* a bit length first, then a size of that length */
+		const unsigned lo_bits = lo ? 64 - __builtin_clzll(lo) : 0;
+		const unsigned hi_bits = hi ? 64 - __builtin_clzll(hi) : 0;
+		const unsigned bits = lo_bits + r % (hi_bits - lo_bits + 1);
+		if (bits == 0)
+			return 0;
+
+		uint64_t from = 1ull << (bits - 1), to = (from << 1) - 1;
+		from = from < lo ? lo : from;
+		to = to > hi ? hi : to;
+		return from + splitmix64(state) % (to - from + 1);
+	}
+	}
+
+	return lo;
+}
+
+static int set_mtime(int dir_fd, const char *name, generator_t *g)
+{
+	const struct timespec times[2] = {
+		{ .tv_sec = BASE_MTIME + g->n },
+		{ .tv_sec = BASE_MTIME + g->n },
+	};
+
+	if (utimensat(dir_fd, name, times, AT_SYMLINK_NOFOLLOW) < 0) {
+		PERROR("utimensat");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int make_file(int dir_fd, const char *name, generator_t *g)
+{
+	uint64_t state = g->spec->seed ^ (g->n * 0xd1b54a32d192ed03ull);
+	off_t left = pick_size(g->spec, &state);
+	const off_t size = left;
+
+	const int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		PERROR("openat");
+		return -1;
+	}
+
+	while (left > 0) {
+		const size_t len = left < (off_t)sizeof(g->buf) ?
+					   (size_t)left :
+					   sizeof(g->buf);
+		for (size_t i = 0; i < (len + 7) / 8; ++i)
+			g->buf[i] = splitmix64(&state);
+
+		if (write(fd, g->buf, len) != (ssize_t)len) {
+			PERROR("write");
+			close(fd);
+			return -1;
+		}
+		left -= len;
+	}
+	close(fd);
+
+	g->stats->files++;
+	g->stats->bytes += size;
+
+	const int ret = set_mtime(dir_fd, name, g);
+	g->n++;
+	return ret;
+}
+
+static int make_dir(int dir_fd, const char *name, unsigned depth,
+		    generator_t *g)
+{
+	int ret = -1;
+
+	if (mkdirat(dir_fd, name, 0755) < 0) {
+		PERROR("mkdirat");
+		return -1;
+	}
+	g->stats->dirs++;
+
+	const int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		PERROR("openat");
+		return -1;
+	}
+
+	char child[32];
+	for (unsigned i = 0; i < g->spec->files; ++i) {
+		snprintf(child, sizeof(child), "f%05u", i);
+		if (make_file(fd, child, g) < 0)
+			goto cleanup;
+	}
+
+	if (depth < g->spec->depth) {
+		for (unsigned i = 0; i < g->spec->fanout; ++i) {
+			snprintf(child, sizeof(child), "d%03u", i);
+			if (make_dir(fd, child, depth + 1, g) < 0)
+				goto cleanup;
+		}
+	}
+
+	/* last, the entries made in it changed its mtime */
+	ret = set_mtime(dir_fd, name, g);
+	g->n++;
+
+cleanup:
+	close(fd);
+	return ret;
+}
+
+int generate_tree(const char *path, const tree_spec_t *spec,
+		  tree_stats_t *stats)
+{
+	generator_t *g = malloc(sizeof(generator_t));
+	if (g == NULL) {
+		PERROR("malloc");
+		return -1;
+	}
+
+	*stats = (tree_stats_t){ 0 };
+	g->spec = spec;
+	g->stats = stats;
+	g->n = 0;
+
+	const int ret = make_dir(AT_FDCWD, path, 0, g);
+
+	free(g);
+	return ret;
+}
+
+static int remove_fn(const char *path, const struct stat *s, int flags,
+		     struct FTW *f)
+{
+	if (remove(path) < 0) {
+		PERROR("remove");
+		return -1;
+	}
+	return 0;
+}
+
+int remove_tree(const char *path)
+{
+	return nftw(path, remove_fn, 64, FTW_DEPTH | FTW_PHYS);
+}
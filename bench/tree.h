@@ -0,0 +1,45 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef enum size_dist {
+	/* every file is min_size */
+	sd_fixed,
+	/* uniform over [min_size, max_size] */
+	sd_uniform,
+	/* every power of two between the bounds is as likely, like real trees */
+	sd_log,
+} size_dist;
+
+/*
+ * every directory gets files files, every directory above depth also gets
+ * fanout subdirectories, so depth 0 is just the root with its files
+ * the same spec always makes the same tree, names, sizes, data and mtimes
+ */
+typedef struct tree_spec {
+	unsigned fanout;
+	unsigned depth;
+	unsigned files;
+
+	size_dist dist;
+	off_t min_size;
+	off_t max_size;
+
+	uint64_t seed;
+} tree_spec_t;
+
+typedef struct tree_stats {
+	size_t dirs;
+	size_t files;
+	off_t bytes;
+} tree_stats_t;
+
+/* parses fixed:SIZE, uniform:MIN:MAX or log:MIN:MAX, sizes take K, M, G */
+int parse_size_dist(const char *arg, tree_spec_t *spec);
+
+/* path is created and must not exist yet */
+int generate_tree(const char *path, const tree_spec_t *spec,
+		  tree_stats_t *stats);
+/* removes a whole tree, like rm -rf */
+int remove_tree(const char *path);
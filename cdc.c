@@ -0,0 +1,104 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cdc.h"
+#include "core.h"
+#include "hash.h"
+
+/*
+ * the gear hash shifts left, so the high bits see the most bytes, a stricter
+ * mask before the average size and a looser one after it keeps the chunk
+ * sizes close to the average
+ */
+#define CDC_MASK_S (~0ull << (64 - 18))
+#define CDC_MASK_L (~0ull << (64 - 14))
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void gear_setup(void)
+{
+	/* splitmix64, the table only has to be the same everywhere */
+	uint64_t x = 0x6765617274616231ull;
+	for (int i = 0; i < 256; ++i) {
+		uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+/* returns the length of the chunk at the start of data */
+static size_t cdc_next(const uint8_t *data, size_t len)
+{
+	if (len <= CDC_MIN_CHUNK)
+		return len;
+	if (len > CDC_MAX_CHUNK)
+		len = CDC_MAX_CHUNK;
+
+	const size_t normal = len < CDC_AVG_CHUNK ? len : CDC_AVG_CHUNK;
+	uint64_t fp = 0;
+	size_t i = CDC_MIN_CHUNK;
+
+	for (; i < normal; ++i) {
+		fp = (fp << 1) + gear[data[i]];
+		if (!(fp & CDC_MASK_S))
+			return i + 1;
+	}
+	for (; i < len; ++i) {
+		fp = (fp << 1) + gear[data[i]];
+		if (!(fp & CDC_MASK_L))
+			return i + 1;
+	}
+
+	return len;
+}
+
+chunk_id_t get_chunk_id(const void *data, size_t len)
+{
+	digest_t digest;
+	digest_init(&digest);
+	digest_update(&digest, data, len);
+
+	return (chunk_id_t){
+		.h = { digest_final(&digest), hash64(data, len, len) },
+	};
+}
+
+int cdc_split(const uint8_t *data, size_t len, chunk_list_t *list)
+{
+	pthread_once(&gear_once, gear_setup);
+
+	size_t cap = len / CDC_AVG_CHUNK + 1;
+	*list = (chunk_list_t){ .refs = malloc(cap * sizeof(chunk_ref_t)) };
+	if (!list->refs) {
+		PERROR("malloc");
+		return -1;
+	}
+
+	for (size_t off = 0; off < len;) {
+		const size_t n = cdc_next(data + off, len - off);
+
+		if (list->len == cap) {
+			cap *= 2;
+			chunk_ref_t *new_mem =
+				realloc(list->refs, cap * sizeof(chunk_ref_t));
+			if (!new_mem) {
+				PERROR("realloc");
+				free(list->refs);
+				*list = (chunk_list_t){ 0 };
+				return -1;
+			}
+			list->refs = new_mem;
+		}
+
+		list->refs[list->len++] = (chunk_ref_t){
+			.id = get_chunk_id(data + off, n),
+			.len = n,
+		};
+		off += n;
+	}
+
+	return 0;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* FastCDC with normalised chunking, cut points only depend on the content */
+#define CDC_MIN_CHUNK (16 * 1024)
+#define CDC_AVG_CHUNK (64 * 1024)
+#define CDC_MAX_CHUNK (256 * 1024)
+
+/*
+ * names a chunk by its content, two independent 64 bit hashes
+ * not cryptographic, the store trusts the clients it accepts transfers from
+ */
+typedef struct chunk_id {
+	uint64_t h[2];
+} chunk_id_t;
+
+/*
+ * tf_dedup: after the metadata ack the sender sends a mt_chunk_list for every
+ * regular entry, in order, the receiver answers every list with a mt_missing
+ * bitmap once it has read all of them, and the sender then sends the data of
+ * the chunks marked missing, entry by entry, chunk after chunk
+ */
+typedef struct chunk_ref {
+	chunk_id_t id;
+	uint32_t len;
+} chunk_ref_t;
+
+chunk_id_t get_chunk_id(const void *data, size_t len);
+
+typedef struct chunk_list {
+	size_t len;
+	chunk_ref_t *refs;
+} chunk_list_t;
+
+/* splits a whole buffer, list->refs has to be freed */
+int cdc_split(const uint8_t *data, size_t len, chunk_list_t *list);
+
+static inline bool chunk_id_eq(const chunk_id_t *a, const chunk_id_t *b)
+{
+	return a->h[0] == b->h[0] && a->h[1] == b->h[1];
+}
@@ -4,6 +4,9 @@
 #include <fcntl.h>
 #include <linux/limits.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,10 +16,24 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "cdc.h"
+#include "compact.h"
+#include "compress.h"
 #include "core.h"
+#include "delta.h"
 #include "entry.h"
 #include "message.h"
+#include "batch.h"
 #include "progress_bar.h"
+#include "sparse.h"
+#include "stats.h"
+#include "stripe.h"
+#include "transfer.h"
+#include "verify.h"
+
+#define DEFAULT_RETRIES 5
+/* upper bound on the entries sent per chunk when pipelining */
+#define PIPELINE_CHUNK 4096
 
 #define CLEANUP(label)              \
 	do {                        \
@@ -29,8 +46,35 @@ typedef struct args {
 	in_port_t port;
 	struct in_addr addr;
 	char *path;
+	transfer_engine engine;
+	unsigned streams;
+	/* 0 disables batching */
+	size_t batch_threshold;
+	/* how often to retry when the server is busy */
+	unsigned retries;
+	unsigned scan_threads;
+	/* send chunks of entries while the tree is still being walked */
+	bool pipeline;
+	/* continue an earlier attempt where the receiver left off */
+	bool resume;
+	/* only send what differs from the receiver's copy */
+	bool delta;
+	/* compare digests of every file with the receiver */
+	bool verify;
+	/* send only the content defined chunks the receiver lacks */
+	bool dedup;
+	bool compress;
+	/* 0 picks one per cpu */
+	unsigned compress_threads;
+	/* only the data extents of files are sent, holes are recreated */
+	bool sparse;
+	/* a json summary of the transfer on stderr */
+	bool stats;
 } args;
 
+/* keys of the options without a short one */
+enum { OPT_STATS = 0x100 };
+
 static inline int parse_path(args *restrict a, const char *path)
 {
 	a->path = malloc(PATH_MAX);
@@ -59,6 +103,62 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 	case 'p':
 		a->port = htons(atoi(arg));
 		break;
+	case 'e':
+		if (parse_engine(arg, op_write, &a->engine) < 0)
+			argp_usage(state);
+		break;
+	case 'b':
+		a->batch_threshold = arg ? strtoul(arg, NULL, 10) :
+					   DEFAULT_BATCH_THRESHOLD;
+		if (a->batch_threshold > BATCH_FRAME_SIZE) {
+			fprintf(stderr, "batch threshold can be at most %d\n",
+				BATCH_FRAME_SIZE);
+			argp_usage(state);
+		}
+		break;
+	case 'P':
+		a->pipeline = true;
+		break;
+	case 'R':
+		a->resume = true;
+		break;
+	case 'D':
+		a->delta = true;
+		break;
+	case 'V':
+		a->verify = true;
+		break;
+	case 'C':
+		a->dedup = true;
+		break;
+	case 'S':
+		a->sparse = true;
+		break;
+	case OPT_STATS:
+		a->stats = true;
+		break;
+	case 'z':
+		a->compress = true;
+		a->compress_threads = arg ? atoi(arg) : 0;
+		break;
+	case 'r':
+		a->retries = atoi(arg);
+		break;
+	case 'j':
+		a->scan_threads = atoi(arg);
+		if (a->scan_threads < 1) {
+			fprintf(stderr, "there has to be at least one thread\n");
+			argp_usage(state);
+		}
+		break;
+	case 's':
+		a->streams = atoi(arg);
+		if (a->streams < 1 || a->streams > MAX_STREAMS) {
+			fprintf(stderr, "streams must be between 1 and %d\n",
+				MAX_STREAMS);
+			argp_usage(state);
+		}
+		break;
 	case ARGP_KEY_ARG:
 		switch (a->parsed++) {
 		case 0:
@@ -83,8 +183,45 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 	return 0;
 }
 
-/* also performs the handshake, etc */
-static int server_connect(int *dst_soc, struct in_addr addr, in_port_t port)
+/* returns 2 so the callers can pass a busy response on */
+static int read_busy(int soc, const header_t *h, unsigned *retry_after)
+{
+	busy_data_t busy;
+
+	if (h->data_size != sizeof(busy) ||
+	    perf_soc_op(soc, op_read, &busy, sizeof(busy), NULL) < 0)
+		return -1;
+
+	*retry_after = busy.retry_after;
+	fprintf(stderr, "server is busy, it asked to retry in %us\n",
+		busy.retry_after);
+
+	return 2;
+}
+
+/* returns 1 so the callers can pass a rejection on */
+static int read_nack(int soc, const header_t *h)
+{
+	char why[MAX_NACK_SIZE];
+
+	if (h->data_size == 0)
+		return 1;
+	if (h->data_size > sizeof(why) ||
+	    perf_soc_op(soc, op_read, why, h->data_size, NULL) < 0)
+		return -1;
+
+	why[h->data_size - 1] = '\0';
+	fprintf(stderr, "server refused the transfer: %s\n", why);
+
+	return 1;
+}
+
+/*
+ * sends hello and expects an ack back
+ * returns 2 and sets retry_after if the server is busy
+ */
+static int server_hello(int *dst_soc, struct in_addr addr, in_port_t port,
+			header_t *hello, void *data, unsigned *retry_after)
 {
 	int soc, ret = 0;
 
@@ -105,44 +242,39 @@ static int server_connect(int *dst_soc, struct in_addr addr, in_port_t port)
 		perror("connect");
 		goto soc_cleanup;
 	}
+	set_nodelay(soc);
 
 	header_t header;
-	peer_info_t *data;
-	if (!(data = create_pinfo_message(&header))) {
+	if (send_msg(soc, hello, data) < 0) {
 		ret = -1;
 		goto soc_cleanup;
 	}
 
-	if (send_msg(soc, &header, data) < 0) {
-		ret = -1;
-		goto hello_cleanup;
-	}
-
 	if (perf_soc_op(soc, op_read, &header, sizeof(header_t), NULL) < 0) {
 		ret = -1;
-		goto hello_cleanup;
+		goto soc_cleanup;
 	}
 
 	switch (header.type) {
 	case mt_ack:
 		ret = 0;
-		goto hello_cleanup;
+		break;
 	case mt_nack:
 		fprintf(stderr, "server did not permit connection\n");
 		ret = 1;
-		goto hello_cleanup;
+		break;
+	case mt_busy:
+		ret = read_busy(soc, &header, retry_after);
+		break;
 	default:
 		fprintf(stderr, "invalid response from the server: %u\n",
 			header.type);
 		ret = -1;
-		goto hello_cleanup;
+		break;
 	}
 
-hello_cleanup:
-	free(data);
-
 soc_cleanup:
-	if (ret < 0) {
+	if (ret != 0) {
 		close(soc);
 	} else {
 		*dst_soc = soc;
@@ -151,6 +283,39 @@ soc_cleanup:
 	return ret;
 }
 
+/* also performs the handshake, etc */
+static int server_connect(int *dst_soc, struct in_addr addr, in_port_t port,
+			  unsigned *retry_after)
+{
+	header_t header;
+	peer_info_t *data;
+	if (!(data = create_pinfo_message(&header)))
+		return -1;
+
+	const int ret =
+		server_hello(dst_soc, addr, port, &header, data, retry_after);
+	free(data);
+
+	return ret;
+}
+
+/* opens an extra data connection of a striped session */
+static int server_join(int *dst_soc, struct in_addr addr, in_port_t port,
+		       uint64_t session_id, uint32_t stream,
+		       unsigned *retry_after)
+{
+	join_data_t data = {
+		.session_id = session_id,
+		.stream = stream,
+	};
+	header_t header = {
+		.type = mt_join,
+		.data_size = sizeof(data),
+	};
+
+	return server_hello(dst_soc, addr, port, &header, &data, retry_after);
+}
+
 #define GOTO(label)                                             \
 	do {                                                    \
 		fprintf(stderr, "%s:%i\n", __FILE__, __LINE__); \
@@ -159,18 +324,29 @@ soc_cleanup:
 #define read_header() perf_soc_op(soc, op_read, &h, sizeof(header_t), NULL)
 
 /*
+ * sends the transfer request and waits for the answer
  * returns:
  *      -1 on failure
  *      0 on server accepting
  *      1 on server rejecting
+ *      2 on server being busy, retry_after is set
  */
-static int send_metadata(int soc, entries_t *metadata)
+static int send_request(int soc, const entries_t *metadata, uint32_t streams,
+			uint32_t flags, size_t batch_threshold,
+			unsigned *retry_after)
 {
 	header_t h;
 
 	request_data_t *data = create_request_message(metadata, &h);
 	if (!data)
 		return -1;
+	data->streams = streams;
+	/* the entries always follow in the compact encoding */
+	data->flags = flags | tf_compact;
+	if (batch_threshold) {
+		data->flags |= tf_batch;
+		data->batch_threshold = batch_threshold;
+	}
 
 	int ret = 0;
 
@@ -185,37 +361,158 @@ static int send_metadata(int soc, entries_t *metadata)
 		ret = 0;
 		break;
 	case mt_nack:
-		ret = 1;
-		GOTO(data_cleanup);
+		ret = read_nack(soc, &h);
+		break;
+	case mt_busy:
+		ret = read_busy(soc, &h, retry_after);
+		break;
 	default:
 		ret = -1;
-		GOTO(data_cleanup);
+		break;
 	}
 
-	send_stream(soc, &metadata->entries);
+data_cleanup:
+	free(data);
+
+	return ret;
+}
+
+/*
+ * returns like send_request
+ * with tf_resume, *resume is set to the bytes the server has of every entry
+ */
+static int send_metadata(int soc, entries_t *metadata, uint32_t streams,
+			 uint32_t flags, size_t batch_threshold,
+			 uint64_t *session_id, off_t **resume,
+			 unsigned *retry_after)
+{
+	header_t h;
+	int ret;
+
+	if ((ret = send_request(soc, metadata, streams, flags, batch_threshold,
+				retry_after)) != 0)
+		return ret;
+
+	stats_phase_begin(sp_metadata);
+
+	if (send_compact_entries(soc, &metadata->entries) < 0)
+		return -1;
 
 	if ((ret = read_header()) < 0)
-		GOTO(data_cleanup);
+		GOTO(error);
+
+	session_data_t session;
 
 	switch (h.type) {
 	case mt_ack:
 		ret = 0;
 		break;
+	case mt_session:
+		if ((ret = perf_soc_op(soc, op_read, &session, sizeof(session),
+				       NULL)) < 0)
+			GOTO(error);
+		*session_id = session.session_id;
+		ret = 0;
+		break;
+	case mt_resume:
+		if (h.data_size != metadata->entries.metadata.len * sizeof(off_t)) {
+			ret = -1;
+			GOTO(error);
+		}
+		if (!(*resume = malloc(h.data_size))) {
+			ret = -1;
+			GOTO(error);
+		}
+		if ((ret = perf_soc_op(soc, op_read, *resume, h.data_size,
+				       NULL)) < 0)
+			GOTO(error);
+		ret = 0;
+		break;
 	case mt_nack:
 		ret = 1;
-		GOTO(data_cleanup);
+		GOTO(error);
 	default:
 		ret = -1;
-		GOTO(data_cleanup);
+		GOTO(error);
 	}
 
-data_cleanup:
-	free(data);
+error:
+	return ret;
+}
+
+/* the first done entries are out, see verifier_ready */
+static void entries_sent(verifier_t *verifier, size_t done)
+{
+	if (verifier)
+		verifier_ready(verifier, done);
+}
+
+/*
+ * compressor is NULL unless tf_compress was requested, verifier unless
+ * tf_verify was
+ */
+static int send_all_files(entries_t *fs, int soc, transfer_engine engine,
+			  size_t batch_threshold, compressor_t *compressor,
+			  bool sparse, verifier_t *verifier)
+{
+	if (chdir(fs->parent_path) < 0) {
+		perror("chdir");
+		return -1;
+	}
+
+	stream_iter_t it;
+	stream_iter_init(&it, &fs->entries);
+	entry_t *ne;
+
+	progress_bar_t p;
+
+	if (engine_is_batched(engine)) {
+		/* nothing goes through here, the verifier reads the files */
+		entries_sent(verifier, fs->entries.metadata.len);
+		prog_bar_init(&p, fs->total_file_size,
+			      count_files(&fs->entries));
+		return send_batched(soc, &fs->entries, engine, &p);
+	}
+
+	batch_t batch;
+	batch_init(&batch, batch_threshold);
+	int ret = 0;
+
+	if (verifier)
+		verifier_attach(verifier);
+
+	for (size_t i = 0; (ne = stream_iter_next(&it));
+	     entries_sent(verifier, ++i)) {
+		if (ne->type == et_dir)
+			continue;
+
+		if (is_batched(&batch, ne)) {
+			if ((ret = send_batched_entry(soc, ne, it, &batch)) < 0)
+				break;
+			continue;
+		}
+
+		prog_bar_init(&p, ne->size, 1);
+
+		if (compressor)
+			ret = send_compressed_entry(soc, ne, compressor, engine,
+						    &p);
+		else if (sparse)
+			ret = send_sparse_entry(soc, ne, engine, &p);
+		else
+			ret = send_entry(soc, ne, engine, &p);
+		if (ret < 0)
+			break;
+	}
+
+	destroy_batch(&batch);
 
 	return ret;
 }
 
-static int send_all_files(entries_t *fs, int soc)
+/* skips what the server already has, resume holds an off_t per entry */
+static int send_resumed(entries_t *fs, int soc, transfer_engine engine,
+			const off_t *resume)
 {
 	if (chdir(fs->parent_path) < 0) {
 		perror("chdir");
@@ -225,75 +522,853 @@ static int send_all_files(entries_t *fs, int soc)
 	stream_iter_t it;
 	stream_iter_init(&it, &fs->entries);
 	entry_t *ne;
-	entry_handles_t fdata;
 
 	progress_bar_t p;
+	off_t skipped = 0;
+	int ret = 0;
 
-	while ((ne = stream_iter_next(&it))) {
+	for (size_t i = 0; (ne = stream_iter_next(&it)); ++i) {
 		if (ne->type == et_dir)
 			continue;
 
-		if (get_entry_handles(ne, &fdata, op_read) < 0) {
-			return -1;
+		if (resume[i] < 0 || resume[i] > ne->size) {
+			fprintf(stderr, "invalid resume offset for `%s`\n",
+				ne->rel_path);
+			ret = -1;
+			break;
 		}
 
-		prog_bar_init(&p, ne->rel_path, ne->size,
-			      (struct timespec){ .tv_nsec = 500e3 });
+		skipped += resume[i];
+		progress_add(resume[i], resume[i] == ne->size);
+		if (resume[i] == ne->size)
+			continue;
+
+		const int fd = open_entry(ne, op_read);
+		if (fd < 0) {
+			ret = -1;
+			break;
+		}
+
+		prog_bar_init(&p, ne->size - resume[i], 1);
+		ret = send_range(soc, fd, resume[i], ne->size - resume[i],
+				 engine, &p);
+		close(fd);
 
-		const int ret =
-			perf_soc_op(soc, op_write, fdata.map, fdata.size, &p);
-		close_entry_handles(&fdata);
 		if (ret < 0)
+			break;
+	}
+
+	if (skipped > 0) {
+		size_info size = bytes_to_size(skipped);
+		printf("resumed, skipped %.2lf%s the server already had\n",
+		       size.size, unit(size));
+	}
+
+	return ret;
+}
+
+/*
+ * tf_delta: all signatures are read before anything is sent, the server
+ * writes them without reading in between
+ */
+static int send_deltas(entries_t *fs, int soc, transfer_engine engine)
+{
+	if (chdir(fs->parent_path) < 0) {
+		perror("chdir");
+		return -1;
+	}
+
+	const size_t len = fs->entries.metadata.len;
+	delta_sig_t *sigs = calloc(len, sizeof(delta_sig_t));
+	if (!sigs) {
+		PERROR("calloc");
+		return -1;
+	}
+
+	stream_iter_t it;
+	entry_t *ne;
+	int ret = 0;
+
+	stream_iter_init(&it, &fs->entries);
+	for (size_t i = 0; (ne = stream_iter_next(&it)); ++i) {
+		if (ne->type == et_reg && recv_signature(soc, &sigs[i]) < 0) {
+			fprintf(stderr, "invalid signature for `%s`\n",
+				ne->rel_path);
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	progress_bar_t p;
+	size_t same = 0;
+
+	stream_iter_init(&it, &fs->entries);
+	for (size_t i = 0; (ne = stream_iter_next(&it)); ++i) {
+		if (ne->type == et_dir)
+			continue;
+
+		if (sigs[i].header.status == ds_same) {
+			++same;
+			progress_add(ne->size, 1);
+			continue;
+		}
+
+		const int fd = open_entry(ne, op_read);
+		if (fd < 0) {
+			ret = -1;
+			break;
+		}
+
+		prog_bar_init(&p, ne->size, 1);
+		ret = send_delta(soc, fd, ne->size, &sigs[i], engine, &p);
+		close(fd);
+
+		if (ret < 0)
+			break;
+	}
+
+	printf("%zu files were unchanged\n", same);
+
+cleanup:
+	for (size_t i = 0; i < len; ++i)
+		free(sigs[i].blocks);
+	free(sigs);
+
+	return ret;
+}
+
+static void *map_entry(const entry_t *entry)
+{
+	const int fd = open_entry(entry, op_read);
+	if (fd < 0)
+		return NULL;
+
+	void *map = mmap(NULL, entry->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		PERROR("mmap");
+		return NULL;
+	}
+	madvise(map, entry->size, MADV_SEQUENTIAL);
+
+	return map;
+}
+
+/* stream_range_fn, arg is the chunk_list_t per entry */
+static int split_entries(stream_t *entries, size_t begin, size_t end,
+			 void *arg)
+{
+	chunk_list_t *lists = arg;
+
+	for (size_t i = begin; i < end; ++i) {
+		const entry_t *ne = stream_get(entries, i);
+		if (ne->type == et_dir)
+			continue;
+
+		void *map = NULL;
+		if (ne->size && !(map = map_entry(ne)))
+			return -1;
+
+		const int split = cdc_split(map, ne->size, &lists[i]);
+		if (map)
+			munmap(map, ne->size);
+		if (split < 0)
 			return -1;
 	}
 
 	return 0;
 }
 
+/* tf_dedup: like with deltas, all lists go out before any answer is read */
+static int send_dedup(entries_t *fs, int soc)
+{
+	if (chdir(fs->parent_path) < 0) {
+		perror("chdir");
+		return -1;
+	}
+
+	const size_t len = fs->entries.metadata.len;
+	chunk_list_t *lists = calloc(len, sizeof(chunk_list_t));
+	uint8_t **missing = calloc(len, sizeof(uint8_t *));
+	if (!lists || !missing) {
+		PERROR("calloc");
+		free(lists);
+		free(missing);
+		return -1;
+	}
+
+	stream_iter_t it;
+	entry_t *ne;
+	int ret = -1;
+	off_t sent = 0;
+
+	/* chunking is the expensive part, every cpu takes a range of files */
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (stream_parallel_for(&fs->entries, cpus > 0 ? cpus : 1,
+				split_entries, lists) < 0)
+		goto cleanup;
+
+	stream_iter_init(&it, &fs->entries);
+	for (size_t i = 0; (ne = stream_iter_next(&it)); ++i) {
+		if (ne->type == et_dir)
+			continue;
+
+		header_t h = {
+			.type = mt_chunk_list,
+			.data_size = lists[i].len * sizeof(chunk_ref_t),
+		};
+		if (send_msg(soc, &h, lists[i].refs) < 0)
+			goto cleanup;
+	}
+
+	stream_iter_init(&it, &fs->entries);
+	for (size_t i = 0; (ne = stream_iter_next(&it)); ++i) {
+		header_t h;
+
+		if (ne->type == et_dir)
+			continue;
+
+		if (receive_msg(soc, &h, (void **)&missing[i]) < 0) {
+			missing[i] = NULL;
+			goto cleanup;
+		}
+		if (h.type != mt_missing ||
+		    h.data_size != (lists[i].len + 7) / 8) {
+			fprintf(stderr, "invalid answer for `%s`\n",
+				ne->rel_path);
+			goto cleanup;
+		}
+	}
+
+	stream_iter_init(&it, &fs->entries);
+	for (size_t i = 0; (ne = stream_iter_next(&it)); ++i) {
+		if (ne->type == et_dir)
+			continue;
+		if (ne->size == 0) {
+			progress_add(0, 1);
+			continue;
+		}
+
+		uint8_t *map = NULL;
+		off_t off = 0;
+
+		for (size_t j = 0; j < lists[i].len; ++j) {
+			const uint32_t chunk_len = lists[i].refs[j].len;
+
+			if (missing[i][j / 8] & 1 << j % 8) {
+				if (!map && !(map = map_entry(ne)))
+					goto cleanup;
+				if (perf_soc_op(soc, op_write, map + off,
+						chunk_len, NULL) < 0) {
+					munmap(map, ne->size);
+					goto cleanup;
+				}
+				sent += chunk_len;
+			}
+			off += chunk_len;
+			progress_add(chunk_len, 0);
+		}
+
+		if (map)
+			munmap(map, ne->size);
+		progress_add(0, 1);
+	}
+
+	size_info size = bytes_to_size(sent);
+	printf("sent %.2lf%s, the receiver had the rest\n", size.size,
+	       unit(size));
+	ret = 0;
+
+cleanup:
+	for (size_t i = 0; i < len; ++i) {
+		free(lists[i].refs);
+		free(missing[i]);
+	}
+	free(lists);
+	free(missing);
+
+	return ret;
+}
+
+typedef struct stripe_sender {
+	pthread_t tid;
+	int soc;
+	const stripe_t *stripe;
+	transfer_engine engine;
+	session_stats_t *stats;
+	int ret;
+} stripe_sender_t;
+
+static void *send_stripe(void *arg)
+{
+	stripe_sender_t *sender = arg;
+	const stripe_t *stripe = sender->stripe;
+
+	stats_attach(sender->stats);
+	sender->ret = 0;
+
+	for (size_t i = 0; i < stripe->len; ++i) {
+		const stripe_item_t *item = &stripe->items[i];
+
+		const int fd = open_entry(item->entry, op_read);
+		if (fd < 0) {
+			sender->ret = -1;
+			break;
+		}
+
+		sender->ret = send_range(sender->soc, fd, item->offset,
+					 item->len, sender->engine, NULL);
+		close(fd);
+		if (sender->ret < 0)
+			break;
+		progress_add(item->len,
+			     item->offset + item->len == item->entry->size);
+	}
+
+	return NULL;
+}
+
+/* socs[0] is the connection that sent the metadata */
+static int send_striped(entries_t *fs, int *socs, unsigned streams,
+			transfer_engine engine)
+{
+	if (chdir(fs->parent_path) < 0) {
+		perror("chdir");
+		return -1;
+	}
+
+	stripe_plan_t plan;
+	if (plan_stripes(&fs->entries, streams, &plan) < 0)
+		return -1;
+
+	/* empty files are created by the receiver, no stripe carries them */
+	stream_iter_t it;
+	stream_iter_init(&it, &fs->entries);
+	const entry_t *entry;
+	while ((entry = stream_iter_next(&it)))
+		if (entry->type == et_reg && entry->size == 0)
+			progress_add(0, 1);
+
+	stripe_sender_t senders[MAX_STREAMS];
+	int ret = 0;
+	unsigned started = 1;
+
+	for (unsigned i = 0; i < streams; ++i) {
+		senders[i] = (stripe_sender_t){
+			.soc = socs[i],
+			.stripe = &plan.stripes[i],
+			.engine = engine,
+			.stats = stats_current(),
+		};
+	}
+
+	for (; started < streams; ++started) {
+		if (pthread_create(&senders[started].tid, NULL, send_stripe,
+				   &senders[started])) {
+			PERROR("pthread_create");
+			ret = -1;
+			/* the receiver would wait forever for this stream */
+			for (unsigned i = 0; i < streams; ++i)
+				shutdown(socs[i], SHUT_RDWR);
+			break;
+		}
+	}
+
+	if (ret == 0)
+		send_stripe(&senders[0]);
+	ret = ret < 0 ? ret : senders[0].ret;
+
+	for (unsigned i = 1; i < started; ++i) {
+		pthread_join(senders[i].tid, NULL);
+		if (senders[i].ret < 0)
+			ret = -1;
+	}
+
+	destroy_stripe_plan(&plan);
+
+	return ret;
+}
+
+/*
+ * connects every stream and gets the transfer accepted
+ * returns like send_metadata, socs are only left open on success
+ */
+static int open_session(const args *a, entries_t *fs, int *socs,
+			off_t **resume, unsigned *retry_after)
+{
+	int ret;
+	unsigned connected = 0;
+
+	if ((ret = server_connect(&socs[0], a->addr, a->port, retry_after)) !=
+	    0)
+		return ret;
+	connected = 1;
+
+	uint64_t session_id = 0;
+	const uint32_t flags = (a->resume ? tf_resume : 0) |
+			       (a->delta ? tf_delta : 0) |
+			       (a->verify ? tf_verify : 0) |
+			       (a->dedup ? tf_dedup : 0) |
+			       (a->compress ? tf_compress : 0) |
+			       (a->sparse ? tf_sparse : 0);
+	ret = send_metadata(socs[0], fs, a->streams, flags, a->batch_threshold,
+			    &session_id, resume, retry_after);
+	if (ret != 0)
+		goto error;
+
+	for (; connected < a->streams; ++connected) {
+		if ((ret = server_join(&socs[connected], a->addr, a->port,
+				       session_id, connected, retry_after)) !=
+		    0) {
+			fprintf(stderr, "could not open data stream %u\n",
+				connected);
+			/* the rest of the session is already waiting */
+			ret = ret == 2 ? -1 : ret;
+			goto error;
+		}
+	}
+
+	return 0;
+
+error:
+	for (unsigned i = 0; i < connected; ++i) {
+		shutdown(socs[i], SHUT_RDWR);
+		close(socs[i]);
+	}
+
+	return ret;
+}
+
+/* a chunk of entries the scanner has walked but not sent yet */
+typedef struct scan_chunk {
+	off_t total_file_size;
+	stream_t entries;
+	struct scan_chunk *next;
+} scan_chunk_t;
+
+/* walks the tree on its own thread and queues the chunks for sending */
+typedef struct scanner {
+	pthread_t tid;
+	const char *path;
+	entries_t fs;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	scan_chunk_t *head;
+	scan_chunk_t **tail;
+	/* set by the scanner once the walk is over */
+	bool done;
+	/* set by the sender to stop the walk early */
+	bool cancel;
+	int ret;
+} scanner_t;
+
+static int queue_chunk(entries_t *fs, void *arg)
+{
+	scanner_t *s = arg;
+
+	scan_chunk_t *chunk = malloc(sizeof(*chunk));
+	if (!chunk) {
+		PERROR("malloc");
+		return -1;
+	}
+	*chunk = (scan_chunk_t){
+		.total_file_size = fs->total_file_size,
+		.entries = fs->entries,
+	};
+
+	pthread_mutex_lock(&s->lock);
+	const bool cancel = s->cancel;
+	if (!cancel) {
+		*s->tail = chunk;
+		s->tail = &chunk->next;
+		pthread_cond_signal(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if (cancel) {
+		destroy_stream(&chunk->entries);
+		free(chunk);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *scan_tree(void *arg)
+{
+	scanner_t *s = arg;
+
+	const int ret = scan_entries_chunked(s->path, &s->fs, PIPELINE_CHUNK,
+					     queue_chunk, s);
+
+	pthread_mutex_lock(&s->lock);
+	s->ret = ret;
+	s->done = true;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+static int start_scanner(scanner_t *s, const char *path)
+{
+	*s = (scanner_t){
+		.path = path,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	s->tail = &s->head;
+
+	if (pthread_create(&s->tid, NULL, scan_tree, s)) {
+		PERROR("pthread_create");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * waits for the oldest unsent chunk without removing it
+ * returns NULL once the walk is over and everything was sent
+ * fs is filled in as a view of the chunk and must not be destroyed
+ */
+static scan_chunk_t *peek_chunk(scanner_t *s, entries_t *fs)
+{
+	pthread_mutex_lock(&s->lock);
+	while (!s->head && !s->done)
+		pthread_cond_wait(&s->cond, &s->lock);
+	scan_chunk_t *chunk = s->head;
+	pthread_mutex_unlock(&s->lock);
+
+	if (chunk) {
+		/* parent_path is set before the first chunk is queued */
+		*fs = (entries_t){
+			.total_file_size = chunk->total_file_size,
+			.parent_path = s->fs.parent_path,
+			.parent_path_len = s->fs.parent_path_len,
+			.entries = chunk->entries,
+		};
+	}
+
+	return chunk;
+}
+
+static void pop_chunk(scanner_t *s)
+{
+	pthread_mutex_lock(&s->lock);
+	scan_chunk_t *chunk = s->head;
+	s->head = chunk->next;
+	if (!s->head)
+		s->tail = &s->head;
+	pthread_mutex_unlock(&s->lock);
+
+	destroy_stream(&chunk->entries);
+	free(chunk);
+}
+
+/* stops the walk if it is still running and frees whatever is left */
+static int stop_scanner(scanner_t *s)
+{
+	pthread_mutex_lock(&s->lock);
+	s->cancel = true;
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_join(s->tid, NULL);
+
+	while (s->head)
+		pop_chunk(s);
+
+	destroy_entries(&s->fs);
+
+	return s->ret;
+}
+
+/*
+ * connects while the scanner is running and sends the request as soon as
+ * the first chunk, holding the root entry, is there
+ * returns like send_request, soc is only left open on success
+ */
+static int open_pipelined(const args *a, scanner_t *s, int *soc,
+			  unsigned *retry_after)
+{
+	int ret;
+
+	if ((ret = server_connect(soc, a->addr, a->port, retry_after)) != 0)
+		return ret;
+
+	entries_t first;
+	if (!peek_chunk(s, &first)) {
+		fprintf(stderr, "could not open file\n");
+		ret = -1;
+		goto error;
+	}
+
+	ret = send_request(*soc, &first, 1,
+			   tf_streaming | (a->compress ? tf_compress : 0) |
+				   (a->sparse ? tf_sparse : 0),
+			   a->batch_threshold, retry_after);
+	if (ret != 0)
+		goto error;
+
+	printf("sending %s while scanning\n",
+	       ((entry_t *)stream_get(&first.entries, 0))->rel_path);
+
+	return 0;
+
+error:
+	shutdown(*soc, SHUT_RDWR);
+	close(*soc);
+
+	return ret;
+}
+
+/* every chunk goes out as its entries followed by their data */
+static int send_chunks(scanner_t *s, int soc, const args *a,
+		       compressor_t *compressor)
+{
+	entries_t chunk;
+
+	while (peek_chunk(s, &chunk)) {
+		header_t h = {
+			.type = mt_chunk,
+			.data_size = chunk.entries.metadata.len,
+		};
+
+		const size_t files = count_files(&chunk.entries);
+		stats_phase_begin(sp_metadata);
+		stats_files(files);
+		progress_expect(chunk.total_file_size, files);
+		/* the chunk header and its entries leave together */
+		frame_writer_t w;
+		frame_init(&w, soc);
+		if (frame_put(&w, &h, sizeof(h)) < 0 ||
+		    put_compact_entries(&w, &chunk.entries) < 0 ||
+		    frame_flush(&w) < 0)
+			return -1;
+
+		stats_phase_begin(sp_data);
+		if (send_all_files(&chunk, soc, a->engine, a->batch_threshold,
+				   compressor, a->sparse, NULL) < 0)
+			return -1;
+
+		pop_chunk(s);
+	}
+
+	if (s->ret < 0) {
+		fprintf(stderr, "scanning `%s` failed\n", a->path);
+		return -1;
+	}
+
+	header_t end = { .type = mt_chunk, .data_size = 0 };
+	return perf_soc_op(soc, op_write, &end, sizeof(end), NULL) < 0 ? -1 :
+									 0;
+}
+
+static void start_stats(const args *a, session_stats_t *stats,
+			stats_phase phase)
+{
+	static char peer[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &a->addr, peer, sizeof(peer));
+
+	stats_start(stats, peer, phase);
+	stats_attach(stats);
+}
+
+static void finish_stats(const args *a, session_stats_t *stats, bool ok)
+{
+	stats_attach(NULL);
+	stats_finish(stats, ok);
+
+	if (a->stats) {
+		stats_print_session(stderr, stats);
+		fputc('\n', stderr);
+	}
+}
+
+/* client_main for --pipeline, the scan overlaps with the whole transfer */
+static int client_pipelined(const args *a)
+{
+	/* the walk overlaps with everything, it has no phase of its own */
+	session_stats_t stats;
+	start_stats(a, &stats, sp_handshake);
+
+	scanner_t s;
+	if (start_scanner(&s, a->path) < 0)
+		return EXIT_FAILURE;
+
+	int ret, soc;
+	unsigned retry_after = 0;
+
+	for (unsigned attempt = 0;; ++attempt) {
+		ret = open_pipelined(a, &s, &soc, &retry_after);
+		if (ret != 2 || attempt == a->retries)
+			break;
+
+		sleep(retry_after);
+	}
+
+	switch (ret) {
+	case 0:
+		break;
+	case 1:
+		printf("server did not accept the transfer. exiting\n");
+		CLEANUP(scanner_cleanup);
+	case 2:
+		printf("server stayed busy. exiting\n");
+		CLEANUP(scanner_cleanup);
+	case -1:
+		perror("sending metadata");
+		CLEANUP(scanner_cleanup);
+	default:
+		__builtin_unreachable();
+	}
+
+	/* the sizes are added chunk by chunk */
+	progress_begin(0, 0);
+
+	compressor_t compressor = { 0 };
+	if (a->compress &&
+	    start_compressor(&compressor, a->compress_threads) < 0) {
+		ret = EXIT_FAILURE;
+	} else if (send_chunks(&s, soc, a,
+			       a->compress ? &compressor : NULL) < 0) {
+		fprintf(stderr, "could not send all files\n");
+		ret = EXIT_FAILURE;
+	} else {
+		ret = EXIT_SUCCESS;
+	}
+
+	destroy_compressor(&compressor);
+	shutdown(soc, SHUT_RDWR);
+	close(soc);
+	progress_end();
+
+scanner_cleanup:
+	stop_scanner(&s);
+	finish_stats(a, &stats, ret == EXIT_SUCCESS);
+
+	return ret;
+}
+
 /* will do all the cleanup necessary */
-static int client_main(in_port_t port, struct in_addr addr, char *file_path)
+static int client_main(const args *a)
 {
+	session_stats_t stats;
+	start_stats(a, &stats, sp_scan);
+
 	entries_t fs;
-	if (create_entries(file_path, &fs) < 0) {
+	if (create_entries_parallel(a->path, &fs, a->scan_threads) < 0) {
 		fprintf(stderr, "could not open file\n");
 		exit(EXIT_FAILURE);
 	}
+	const size_t files = count_files(&fs.entries);
+	stats_files(files);
+	stats_phase_begin(sp_handshake);
 
 	int ret = EXIT_SUCCESS;
-	int server;
-	if (server_connect(&server, addr, port) != 0) {
-		CLEANUP(fs_cleanup);
+	int socs[MAX_STREAMS];
+	unsigned retry_after = 0;
+	off_t *resume = NULL;
+
+	for (unsigned attempt = 0;; ++attempt) {
+		ret = open_session(a, &fs, socs, &resume, &retry_after);
+		if (ret != 2 || attempt == a->retries)
+			break;
+
+		sleep(retry_after);
 	}
 
-	switch (send_metadata(server, &fs)) {
+	switch (ret) {
 	case 0:
 		break;
 	case 1:
 		printf("server did not accept the transfer. exiting\n");
-		CLEANUP(server_cleanup);
+		CLEANUP(fs_cleanup);
+	case 2:
+		printf("server stayed busy. exiting\n");
+		CLEANUP(fs_cleanup);
 	case -1:
 		perror("sending metadata");
-		CLEANUP(server_cleanup);
+		CLEANUP(fs_cleanup);
 	default:
 		__builtin_unreachable();
 	}
+	stats_phase_begin(sp_data);
 
 	size_info size = bytes_to_size(fs.total_file_size);
 	printf("sending %s, size %.2lf%s\n",
-	       ((entry_t *)fs.entries.data)->rel_path, size.size, unit(size));
+	       ((entry_t *)stream_get(&fs.entries, 0))->rel_path, size.size,
+	       unit(size));
+	progress_begin(fs.total_file_size, files);
 
-	if ((ret = send_all_files(&fs, server)) < 0) {
+	verifier_t verifier = { 0 };
+	compressor_t compressor = { 0 };
+	if (a->verify) {
+		/* hashing runs alongside the transfer */
+		if (chdir(fs.parent_path) < 0) {
+			perror("chdir");
+			CLEANUP(server_cleanup);
+		}
+		/* only plain sends see every byte, the others are hashed */
+		if (start_verifier(&verifier, &fs.entries,
+				   resume || a->delta || a->dedup) < 0)
+			CLEANUP(server_cleanup);
+	}
+
+	if (a->compress &&
+	    start_compressor(&compressor, a->compress_threads) < 0)
+		CLEANUP(server_cleanup);
+
+	if (a->streams > 1)
+		ret = send_striped(&fs, socs, a->streams, a->engine);
+	else if (resume)
+		ret = send_resumed(&fs, socs[0], a->engine, resume);
+	else if (a->delta)
+		ret = send_deltas(&fs, socs[0], a->engine);
+	else if (a->dedup)
+		ret = send_dedup(&fs, socs[0]);
+	else
+		ret = send_all_files(&fs, socs[0], a->engine,
+				     a->batch_threshold,
+				     a->compress ? &compressor : NULL,
+				     a->sparse, a->verify ? &verifier : NULL);
+
+	if (ret < 0) {
 		fprintf(stderr, "could not send all files\n");
 		CLEANUP(server_cleanup);
 	}
 
+	if (a->verify) {
+		ssize_t mismatches;
+		stats_phase_begin(sp_verify);
+		if (send_digests(socs[0], &verifier) < 0 ||
+		    (mismatches = recv_mismatches(socs[0], &verifier)) < 0) {
+			fprintf(stderr, "could not verify the transfer\n");
+			CLEANUP(server_cleanup);
+		}
+		if (mismatches > 0) {
+			fprintf(stderr, "%zd files arrived corrupted\n",
+				mismatches);
+			CLEANUP(server_cleanup);
+		}
+		printf("verified %zu entries\n", verifier.len);
+	}
+
 	ret = EXIT_SUCCESS;
 server_cleanup:
-	shutdown(server, SHUT_RDWR);
-	close(server);
+	progress_end();
+	destroy_compressor(&compressor);
+	destroy_verifier(&verifier);
+	for (unsigned i = 0; i < a->streams; ++i) {
+		shutdown(socs[i], SHUT_RDWR);
+		close(socs[i]);
+	}
 
 fs_cleanup:
+	free(resume);
 	destroy_entries(&fs);
+	finish_stats(a, &stats, ret == EXIT_SUCCESS);
 
 	return ret;
 }
@@ -305,6 +1380,38 @@ int main(int argc, char **argv)
 		{ "port", 'p', "PORT", 0,
 		  "change the server port from default (" STRINGIFY(
 			  DEFAULT_PORT) ")" },
+		{ "engine", 'e', "ENGINE", 0,
+		  "how file data is sent: mmap (default), sendfile or uring" },
+		{ "streams", 's', "N", 0,
+		  "stripe the data over N connections (default 1)" },
+		{ "batch", 'b', "SIZE", OPTION_ARG_OPTIONAL,
+		  "pack files smaller than SIZE (default " STRINGIFY(
+			  DEFAULT_BATCH_THRESHOLD) ") into batch frames" },
+		{ "retries", 'r', "N", 0,
+		  "how often to retry while the server is busy "
+		  "(default " STRINGIFY(DEFAULT_RETRIES) ")" },
+		{ "scan-threads", 'j', "N", 0,
+		  "walk the directory tree with N threads (default 1)" },
+		{ "pipeline", 'P', 0, 0,
+		  "start sending while the directory tree is still walked" },
+		{ "resume", 'R', 0, 0,
+		  "continue an interrupted transfer of the same files" },
+		{ "verify", 'V', 0, 0,
+		  "hash every file on both sides and compare the digests" },
+		{ "dedup", 'C', 0, 0,
+		  "split files into content defined chunks and only send "
+		  "the ones the receiver has not stored yet" },
+		{ "delta", 'D', 0, 0,
+		  "only send the parts of files that differ from the "
+		  "receiver's copies" },
+		{ "sparse", 'S', 0, 0,
+		  "only send the data of sparse files, the receiver "
+		  "recreates the holes" },
+		{ "compress", 'z', "THREADS", OPTION_ARG_OPTIONAL,
+		  "compress files that sample as compressible on THREADS "
+		  "threads (default one per cpu)" },
+		{ "stats", OPT_STATS, 0, 0,
+		  "print a json summary of the transfer to stderr" },
 		{ 0 }
 	};
 
@@ -316,14 +1423,87 @@ int main(int argc, char **argv)
 
 	args a = {
 		.port = htons(DEFAULT_PORT),
+		.engine = te_mmap,
+		.streams = 1,
+		.retries = DEFAULT_RETRIES,
+		.scan_threads = 1,
 	};
 
 	if (argp_parse(&arg_parser, argc, argv, 0, NULL, &a) < 0) {
 		return EXIT_FAILURE;
 	}
 
+	/* a server that gives up shows as a failed write, not a dead client */
+	signal(SIGPIPE, SIG_IGN);
+
+	probe_engine(&a.engine);
+	if (a.batch_threshold &&
+	    (engine_is_batched(a.engine) || a.streams > 1)) {
+		fprintf(stderr, "batching is not used with the %s engine "
+				"or with several streams\n",
+			get_engine_name(a.engine));
+		a.batch_threshold = 0;
+	}
+
+	/* dropped first, the modes that refuse it still work without it */
+	if (a.pipeline && (a.streams > 1 || a.scan_threads > 1)) {
+		fprintf(stderr, "pipelining is not used with several streams "
+				"or scan threads\n");
+		a.pipeline = false;
+	}
+
+	if (a.resume && (a.streams > 1 || a.pipeline)) {
+		fprintf(stderr, "resuming is not supported with several streams "
+				"or pipelining\n");
+		return EXIT_FAILURE;
+	}
+	if (a.verify && (a.streams > 1 || a.pipeline)) {
+		fprintf(stderr, "verifying is not supported with several "
+				"streams or pipelining\n");
+		return EXIT_FAILURE;
+	}
+	if (a.delta && (a.streams > 1 || a.pipeline || a.resume)) {
+		fprintf(stderr, "delta transfers are not supported with several "
+				"streams, pipelining or resuming\n");
+		return EXIT_FAILURE;
+	}
+	if (a.dedup && (a.streams > 1 || a.pipeline || a.resume || a.delta)) {
+		fprintf(stderr, "dedup is not supported with several streams, "
+				"pipelining, resuming or delta transfers\n");
+		return EXIT_FAILURE;
+	}
+	if (a.compress && (a.streams > 1 || a.resume || a.delta || a.dedup)) {
+		fprintf(stderr, "compression is not supported with several "
+				"streams, resuming, delta or dedup transfers\n");
+		return EXIT_FAILURE;
+	}
+	if (a.sparse &&
+	    (a.streams > 1 || a.resume || a.delta || a.dedup || a.compress)) {
+		fprintf(stderr, "sparse transfers are not supported with several "
+				"streams, resuming, delta, dedup or compressed "
+				"transfers\n");
+		return EXIT_FAILURE;
+	}
+	if ((a.compress || a.sparse) && engine_is_batched(a.engine)) {
+		fprintf(stderr, "compression and sparse transfers are not used "
+				"with the %s engine\n",
+			get_engine_name(a.engine));
+		a.compress = a.sparse = false;
+	}
+	if ((a.resume || a.delta || a.dedup) && a.batch_threshold) {
+		fprintf(stderr, "batching is not used when resuming "
+				"or with delta or dedup transfers\n");
+		a.batch_threshold = 0;
+	}
+
 	printf("addr: %s, path: %s, port: %u\n", inet_ntoa(a.addr), a.path,
 	       a.port);
 
-	return client_main(a.port, a.addr, a.path);
+	if (progress_start_reporter("Sending") < 0)
+		return EXIT_FAILURE;
+
+	const int ret = a.pipeline ? client_pipelined(&a) : client_main(&a);
+	progress_stop_reporter();
+
+	return ret;
 }
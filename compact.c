@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compact.h"
+#include "core.h"
+#include "entry.h"
+
+/* one varint can take up to 10 bytes */
+#define MAX_RECORD_HEAD (7 * 10)
+
+enum compact_field {
+	cf_type,
+	cf_permissions,
+	cf_size,
+	cf_sec,
+	cf_nsec,
+	cf_prefix,
+	cf_suffix,
+	cf_path,
+};
+
+static inline uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		*p++ = v | 0x80;
+	*p++ = v;
+
+	return p;
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static int encode_entries(const stream_t *entries, uint8_t **out,
+			  size_t *size)
+{
+	size_t cap = COMPACT_BUF_SIZE, len = 0;
+	uint8_t *buf = malloc(cap);
+	if (!buf)
+		ERR_GOTO("malloc");
+
+	stream_iter_t it;
+	stream_iter_init(&it, entries);
+	const entry_t *entry, *prev = NULL;
+	size_t prev_len = 0;
+
+	while ((entry = stream_iter_next(&it))) {
+		const size_t path_len = strlen(entry->rel_path);
+
+		size_t prefix = 0;
+		while (prefix < prev_len && prefix < path_len &&
+		       prev->rel_path[prefix] == entry->rel_path[prefix])
+			++prefix;
+
+		if (cap - len < MAX_RECORD_HEAD + path_len) {
+			cap = 2 * cap + path_len;
+			uint8_t *new_buf = realloc(buf, cap);
+			if (!new_buf)
+				ERR_GOTO("realloc");
+			buf = new_buf;
+		}
+
+		const time_t prev_sec = prev ? prev->mtime.tv_sec : 0;
+		uint8_t *p = buf + len;
+		p = put_varint(p, entry->type);
+		p = put_varint(p, entry->permissions);
+		p = put_varint(p, entry->size);
+		p = put_varint(p, zigzag(entry->mtime.tv_sec - prev_sec));
+		p = put_varint(p, entry->mtime.tv_nsec);
+		p = put_varint(p, prefix);
+		p = put_varint(p, path_len - prefix);
+		memcpy(p, entry->rel_path + prefix, path_len - prefix);
+		len = p - buf + path_len - prefix;
+
+		prev = entry;
+		prev_len = path_len;
+	}
+
+	*out = buf;
+	*size = len;
+
+	return 0;
+
+error:
+	free(buf);
+
+	return -1;
+}
+
+int put_compact_entries(frame_writer_t *w, const stream_t *entries)
+{
+	uint8_t *buf;
+	size_t size;
+	if (encode_entries(entries, &buf, &size) < 0)
+		return -1;
+
+	compact_header_t header = {
+		.len = htole64(entries->metadata.len),
+		.size = htole64(size),
+	};
+
+	int ret = 0;
+	if (frame_put(w, &header, sizeof(header)) < 0 ||
+	    frame_put(w, buf, size) < 0)
+		ret = -1;
+
+	free(buf);
+
+	return ret;
+}
+
+int send_compact_entries(int soc, const stream_t *entries)
+{
+	frame_writer_t w;
+	frame_init(&w, soc);
+
+	if (put_compact_entries(&w, entries) < 0)
+		return -1;
+
+	return frame_flush(&w);
+}
+
+int recv_compact_entries(int soc, stream_t *entries)
+{
+	*entries = (stream_t){ 0 };
+
+	compact_header_t header;
+	if (perf_soc_op(soc, op_read, &header, sizeof(header), NULL) < 0)
+		return -1;
+
+	entry_decoder_t *decoder = malloc(sizeof(entry_decoder_t));
+	uint8_t *buf = malloc(COMPACT_BUF_SIZE);
+	if (!decoder || !buf) {
+		PERROR("malloc");
+		goto error;
+	}
+
+	if (entry_decoder_init(decoder, entries, &header) < 0)
+		goto error;
+
+	for (uint64_t left = le64toh(header.size); left;) {
+		const size_t n = left < COMPACT_BUF_SIZE ? left :
+							   COMPACT_BUF_SIZE;
+		if (perf_soc_op(soc, op_read, buf, n, NULL) < 0 ||
+		    entry_decoder_feed(decoder, buf, n) < 0)
+			goto error;
+		left -= n;
+	}
+
+	if (!entry_decoder_done(decoder)) {
+		fprintf(stderr, "the entries ended early\n");
+		goto error;
+	}
+
+	free(buf);
+	free(decoder);
+
+	return 0;
+
+error:
+	free(buf);
+	free(decoder);
+	destroy_stream(entries);
+	*entries = (stream_t){ 0 };
+
+	return -1;
+}
+
+int entry_decoder_init(entry_decoder_t *d, stream_t *entries,
+		       const compact_header_t *header)
+{
+	const uint64_t len = le64toh(header->len);
+	const uint64_t size = le64toh(header->size);
+
+	if (len == 0 || len > size / COMPACT_MIN_RECORD) {
+		fprintf(stderr, "%" PRIu64 " entries cannot take %" PRIu64
+				" bytes\n",
+			len, size);
+		return -1;
+	}
+
+	d->entries = entries;
+	d->left = len;
+	d->field = 0;
+	d->shift = 0;
+	d->varint = 0;
+	d->suffix_left = 0;
+	d->sec = 0;
+	d->path_len = 0;
+
+	return 0;
+}
+
+static int finish_record(entry_decoder_t *d)
+{
+	const uint64_t *f = d->fields;
+
+	if ((f[cf_type] != et_reg && f[cf_type] != et_dir) ||
+	    f[cf_permissions] > (mode_t)-1 || f[cf_size] > INT64_MAX ||
+	    f[cf_nsec] >= 1000000000 || d->path_len == 0 ||
+	    memchr(d->path, '\0', d->path_len)) {
+		fprintf(stderr, "malformed entry\n");
+		return -1;
+	}
+
+	d->sec += unzigzag(f[cf_sec]);
+	const struct timespec mtime = {
+		.tv_sec = d->sec,
+		.tv_nsec = f[cf_nsec],
+	};
+
+	if (!add_entry(d->entries, f[cf_type], f[cf_permissions], f[cf_size],
+		       mtime, d->path, d->path_len))
+		return -1;
+
+	d->left--;
+	d->field = 0;
+
+	return 0;
+}
+
+int entry_decoder_feed(entry_decoder_t *d, const uint8_t *buf, size_t len)
+{
+	const uint8_t *p = buf, *const end = buf + len;
+
+	while (p < end) {
+		if (d->left == 0) {
+			fprintf(stderr, "trailing bytes after the entries\n");
+			return -1;
+		}
+
+		if (d->field < cf_path) {
+			const uint8_t b = *p++;
+			if (d->shift >= 64) {
+				fprintf(stderr, "varint too long\n");
+				return -1;
+			}
+
+			d->varint |= (uint64_t)(b & 0x7f) << d->shift;
+			d->shift += 7;
+			if (b & 0x80)
+				continue;
+
+			d->fields[d->field++] = d->varint;
+			d->varint = 0;
+			d->shift = 0;
+			if (d->field < cf_path)
+				continue;
+
+			/* the new path starts as a prefix of the previous one */
+			const uint64_t prefix = d->fields[cf_prefix];
+			const uint64_t suffix = d->fields[cf_suffix];
+			if (prefix > d->path_len || suffix >= PATH_MAX ||
+			    prefix + suffix >= PATH_MAX) {
+				fprintf(stderr, "malformed entry path\n");
+				return -1;
+			}
+			d->path_len = prefix;
+			d->suffix_left = suffix;
+		}
+
+		const size_t n = (size_t)(end - p) < d->suffix_left ?
+					 (size_t)(end - p) :
+					 d->suffix_left;
+		memcpy(d->path + d->path_len, p, n);
+		p += n;
+		d->path_len += n;
+		d->suffix_left -= n;
+
+		if (d->suffix_left == 0 && finish_record(d) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+bool entry_decoder_done(const entry_decoder_t *d)
+{
+	return d->left == 0 && d->field == 0;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "core.h"
+#include "stream.h"
+
+/*
+ * tf_compact: the entries go out as a compact_header_t and then the
+ * records, every record is a run of LEB128 varints
+ *
+ *	type, permissions, size,
+ *	mtime seconds (zigzag, relative to the previous record), nanoseconds,
+ *	bytes shared with the previous path, length of the rest
+ *
+ * followed by the rest of the path without a null byte, so nothing depends
+ * on the byte order, word size or padding of either side
+ */
+typedef struct compact_header {
+	/* both little endian */
+	uint64_t len;
+	uint64_t size;
+} compact_header_t;
+
+/* the shortest record, one byte per varint */
+#define COMPACT_MIN_RECORD 7
+#define COMPACT_BUF_SIZE (64 << 10)
+
+/* queues the entries, they are only sure to be sent after a frame_flush */
+int put_compact_entries(frame_writer_t *w, const stream_t *entries);
+int send_compact_entries(int soc, const stream_t *entries);
+int recv_compact_entries(int soc, stream_t *entries);
+
+/* decodes records as their bytes arrive, in whatever pieces that is */
+typedef struct entry_decoder {
+	stream_t *entries;
+	/* records that have not been completed yet */
+	uint64_t left;
+
+	/* the varint being read and how many of the record are done */
+	unsigned field;
+	unsigned shift;
+	uint64_t varint;
+	uint64_t fields[7];
+	size_t suffix_left;
+
+	time_t sec;
+	/* the previous path while the varints are read */
+	size_t path_len;
+	char path[PATH_MAX];
+} entry_decoder_t;
+
+/* returns -1 if the header is not plausible */
+int entry_decoder_init(entry_decoder_t *decoder, stream_t *entries,
+		       const compact_header_t *header);
+/* returns -1 for malformed records, entries is left to the caller */
+int entry_decoder_feed(entry_decoder_t *decoder, const uint8_t *buf,
+		       size_t len);
+bool entry_decoder_done(const entry_decoder_t *decoder);
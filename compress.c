@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "core.h"
+#include "lz.h"
+#include "verify.h"
+
+/* smaller files are not worth the frames */
+#define COMPRESS_MIN_SIZE (4 << 10)
+/* spread over the file, so a compressed archive with a text header is caught */
+#define COMPRESS_SAMPLES 4
+#define COMPRESS_SAMPLE (16 << 10)
+
+static inline size_t min_size(size_t a, size_t b)
+{
+	return a < b ? a : b;
+}
+
+/* the file is compressed if its samples shrink by at least an eighth */
+static bool worth_compressing(compressor_t *c, const uint8_t *data,
+			      size_t len)
+{
+	if (len < COMPRESS_MIN_SIZE)
+		return false;
+
+	const size_t sample = min_size(len, COMPRESS_SAMPLE);
+	const unsigned samples = len > COMPRESS_SAMPLE ? COMPRESS_SAMPLES : 1;
+	size_t raw = 0, comp = 0;
+
+	for (unsigned i = 0; i < samples; ++i) {
+		const size_t off =
+			samples > 1 ? (len - sample) / (samples - 1) * i : 0;
+		const size_t n = lz_compress(data + off, sample, c->sample,
+					     sample);
+
+		raw += sample;
+		comp += n ? n : sample;
+	}
+
+	return comp * 8 < raw * 7;
+}
+
+static void compress_block(compressor_t *c, size_t i)
+{
+	compress_slot_t *slot = &c->slots[i % c->window];
+	const size_t off = i * COMPRESS_BLOCK;
+	const size_t len = min_size(c->len - off, COMPRESS_BLOCK);
+
+	/* anything that does not come out smaller is sent as it is */
+	slot->frame = (compress_frame_t){
+		.raw_len = len,
+		.comp_len = lz_compress(c->data + off, len, slot->buf, len - 1),
+	};
+}
+
+static void *compress_worker(void *arg)
+{
+	compressor_t *c = arg;
+
+	pthread_mutex_lock(&c->lock);
+	for (;;) {
+		while (!c->stop && (c->next >= c->blocks ||
+				    c->next >= c->sent + c->window))
+			pthread_cond_wait(&c->cond, &c->lock);
+		if (c->stop)
+			break;
+
+		const size_t i = c->next++;
+		++c->busy;
+		pthread_mutex_unlock(&c->lock);
+
+		compress_block(c, i);
+
+		pthread_mutex_lock(&c->lock);
+		c->slots[i % c->window].done = true;
+		--c->busy;
+		pthread_cond_broadcast(&c->cond);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+int start_compressor(compressor_t *c, unsigned threads)
+{
+	if (threads == 0) {
+		const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	if (threads > COMPRESS_MAX_THREADS)
+		threads = COMPRESS_MAX_THREADS;
+
+	*c = (compressor_t){
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.window = 2 * threads,
+		.slots = calloc(2 * threads, sizeof(compress_slot_t)),
+		.sample = malloc(COMPRESS_SAMPLE),
+	};
+	if (!c->slots || !c->sample) {
+		PERROR("malloc");
+		goto error;
+	}
+
+	for (unsigned i = 0; i < c->window; ++i) {
+		if (!(c->slots[i].buf = malloc(COMPRESS_BLOCK)))
+			ERR_GOTO("malloc");
+	}
+
+	for (; c->threads < threads; ++c->threads) {
+		if (pthread_create(&c->tids[c->threads], NULL, compress_worker,
+				   c)) {
+			PERROR("pthread_create");
+			break;
+		}
+	}
+	if (c->threads == 0)
+		goto error;
+
+	return 0;
+
+error:
+	destroy_compressor(c);
+
+	return -1;
+}
+
+void destroy_compressor(compressor_t *c)
+{
+	if (c->threads) {
+		pthread_mutex_lock(&c->lock);
+		c->stop = true;
+		pthread_cond_broadcast(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+
+		for (unsigned i = 0; i < c->threads; ++i)
+			pthread_join(c->tids[i], NULL);
+		c->threads = 0;
+	}
+
+	for (unsigned i = 0; c->slots && i < c->window; ++i)
+		free(c->slots[i].buf);
+	free(c->slots);
+	c->slots = NULL;
+	free(c->sample);
+	c->sample = NULL;
+}
+
+static int send_blocks(int soc, compressor_t *c, const uint8_t *data,
+		       size_t len, progress_bar_t *prog_bar)
+{
+	pthread_mutex_lock(&c->lock);
+	c->data = data;
+	c->len = len;
+	c->blocks = (len + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK;
+	c->next = c->sent = 0;
+	for (unsigned i = 0; i < c->window; ++i)
+		c->slots[i].done = false;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+
+	int ret = 0;
+	for (size_t i = 0; i < c->blocks; ++i) {
+		compress_slot_t *slot = &c->slots[i % c->window];
+
+		pthread_mutex_lock(&c->lock);
+		while (!slot->done)
+			pthread_cond_wait(&c->cond, &c->lock);
+		pthread_mutex_unlock(&c->lock);
+
+		compress_frame_t frame = slot->frame;
+		const void *payload = frame.comp_len ?
+					      slot->buf :
+					      data + i * COMPRESS_BLOCK;
+		if (perf_soc_op(soc, op_write, &frame, sizeof(frame), NULL) <
+			    0 ||
+		    perf_soc_op(soc, op_write, (void *)payload,
+				frame.comp_len ? frame.comp_len : frame.raw_len,
+				NULL) < 0) {
+			ret = -1;
+			break;
+		}
+		verify_feed(i * COMPRESS_BLOCK, data + i * COMPRESS_BLOCK,
+			    frame.raw_len);
+
+		if (prog_bar)
+			prog_bar_advance(prog_bar,
+					 i * COMPRESS_BLOCK + frame.raw_len);
+
+		pthread_mutex_lock(&c->lock);
+		slot->done = false;
+		++c->sent;
+		pthread_cond_broadcast(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+	}
+
+	/* the data is unmapped next, no thread may still be reading it */
+	pthread_mutex_lock(&c->lock);
+	c->blocks = c->next;
+	while (c->busy)
+		pthread_cond_wait(&c->cond, &c->lock);
+	pthread_mutex_unlock(&c->lock);
+
+	if (prog_bar && ret == 0)
+		prog_bar_finish(prog_bar);
+
+	return ret;
+}
+
+int send_compressed_entry(int soc, entry_t *entry, compressor_t *c,
+			  transfer_engine engine, progress_bar_t *prog_bar)
+{
+	entry_handles_t handles;
+	if (get_entry_handles(entry, &handles, op_read) < 0)
+		return -1;
+
+	int ret = -1;
+	uint32_t mode = worth_compressing(c, handles.map, handles.size) ?
+				      cm_blocks :
+				      cm_raw;
+
+	if (perf_soc_op(soc, op_write, &mode, sizeof(mode), NULL) < 0)
+		goto cleanup;
+
+	if (mode == cm_blocks) {
+		madvise(handles.map, handles.size, MADV_SEQUENTIAL);
+		ret = send_blocks(soc, c, handles.map, handles.size, prog_bar);
+	} else if (handles.size == 0) {
+		ret = 0;
+	} else if (engine == te_sendfile) {
+		ret = perf_file_op(soc, op_write, handles.fd, 0, handles.size,
+				   prog_bar) < 0 ?
+			      -1 :
+			      0;
+	} else {
+		ret = send_mapping(soc, handles.map, handles.size, prog_bar);
+	}
+	/* sendfile never brings the bytes in, the verifier reads those */
+	if (ret == 0 && mode == cm_raw && engine != te_sendfile)
+		verify_feed(0, handles.map, handles.size);
+
+cleanup:
+	close_entry_handles(&handles);
+
+	return ret;
+}
+
+/* decompresses straight into the mapping of the file */
+static int recv_blocks(int soc, uint8_t *map, size_t len,
+		       progress_bar_t *prog_bar)
+{
+	uint8_t *buf = malloc(COMPRESS_BLOCK);
+	if (!buf) {
+		PERROR("malloc");
+		return -1;
+	}
+
+	for (size_t off = 0; off < len;) {
+		compress_frame_t frame;
+		if (perf_soc_op(soc, op_read, &frame, sizeof(frame), NULL) < 0)
+			goto error;
+
+		if (frame.raw_len == 0 || frame.raw_len > COMPRESS_BLOCK ||
+		    frame.raw_len > len - off ||
+		    frame.comp_len >= frame.raw_len) {
+			fprintf(stderr, "malformed compressed block\n");
+			goto error;
+		}
+
+		if (frame.comp_len == 0) {
+			if (perf_soc_op(soc, op_read, map + off, frame.raw_len,
+					NULL) < 0)
+				goto error;
+		} else {
+			if (perf_soc_op(soc, op_read, buf, frame.comp_len,
+					NULL) < 0)
+				goto error;
+
+			if (lz_decompress(buf, frame.comp_len, map + off,
+					  frame.raw_len) != frame.raw_len) {
+				fprintf(stderr, "corrupt compressed block\n");
+				goto error;
+			}
+		}
+		verify_feed(off, map + off, frame.raw_len);
+
+		off += frame.raw_len;
+		if (prog_bar)
+			prog_bar_advance(prog_bar, off);
+	}
+
+	if (prog_bar)
+		prog_bar_finish(prog_bar);
+
+	free(buf);
+
+	return 0;
+
+error:
+	free(buf);
+
+	return -1;
+}
+
+int recv_compressed_entry(int soc, entry_t *entry, transfer_engine engine,
+			  progress_bar_t *prog_bar)
+{
+	uint32_t mode;
+	if (perf_soc_op(soc, op_read, &mode, sizeof(mode), NULL) < 0)
+		return -1;
+
+	if (mode == cm_raw)
+		return recv_entry(soc, entry, engine, prog_bar);
+
+	if (mode != cm_blocks) {
+		fprintf(stderr, "unknown compression mode %u\n", mode);
+		return -1;
+	}
+
+	entry_handles_t handles;
+	if (get_entry_handles(entry, &handles, op_write) < 0)
+		return -1;
+
+	int ret = -1;
+	if (ftruncate(handles.fd, handles.size) < 0) {
+		PERROR("ftruncate");
+		goto cleanup;
+	}
+
+	ret = recv_blocks(soc, handles.map, handles.size, prog_bar);
+
+cleanup:
+	close_entry_handles(&handles);
+
+	return ret;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "entry.h"
+#include "progress_bar.h"
+#include "transfer.h"
+
+/* blocks are compressed independently, see lz.h */
+#define COMPRESS_BLOCK (256 << 10)
+#define COMPRESS_MAX_THREADS 16
+
+/*
+ * tf_compress: every entry that is not batched starts with a uint32_t
+ * compress_mode, cm_raw entries follow as without the flag, cm_blocks ones
+ * as a compress_frame_t and its payload per COMPRESS_BLOCK of the file
+ */
+typedef enum compress_mode {
+	/* sampling found the file not worth compressing */
+	cm_raw,
+	cm_blocks,
+} compress_mode;
+
+typedef struct compress_frame {
+	uint32_t raw_len;
+	/* 0 if the block did not compress and raw_len bytes follow as they are */
+	uint32_t comp_len;
+} compress_frame_t;
+
+typedef struct compress_slot {
+	compress_frame_t frame;
+	uint8_t *buf;
+	bool done;
+} compress_slot_t;
+
+/*
+ * compresses the blocks of the file being sent on its own threads, a window
+ * of blocks ahead of the socket, which gets them in order
+ */
+typedef struct compressor {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+
+	const uint8_t *data;
+	size_t len;
+	size_t blocks;
+	/* the next block to compress, blocks below sent are out */
+	size_t next;
+	size_t sent;
+	/* threads in the middle of a block */
+	unsigned busy;
+
+	/* block i goes into slots[i % window] */
+	unsigned window;
+	compress_slot_t *slots;
+	/* for sampling, on the sending thread */
+	uint8_t *sample;
+
+	unsigned threads;
+	pthread_t tids[COMPRESS_MAX_THREADS];
+} compressor_t;
+
+/* 0 threads picks one per online cpu */
+int start_compressor(compressor_t *compressor, unsigned threads);
+/* fine to call on a zeroed compressor */
+void destroy_compressor(compressor_t *compressor);
+
+/* chdir to entries_t.parent_path before running */
+int send_compressed_entry(int soc, entry_t *entry, compressor_t *compressor,
+			  transfer_engine engine, progress_bar_t *prog_bar);
+int recv_compressed_entry(int soc, entry_t *entry, transfer_engine engine,
+			  progress_bar_t *prog_bar);
@@ -1,18 +1,27 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <pwd.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "core.h"
+#include "probes.h"
 #include "progress_bar.h"
+#include "stats.h"
+
+#define SPLICE_PIPE_SIZE (1 << 20)
 
 #define SOCKET_OPERATION(op, ret, ...)           \
 	do {                                     \
@@ -47,66 +56,351 @@ const char *const unit(size_info info)
 	return (info.unit_idx < UNIT_LEN) ? size_units[info.unit_idx] : NULL;
 }
 
-ssize_t perf_soc_op(int soc, operation_type op, void *restrict buf, size_t len,
-		    progress_bar_t *const restrict prog_bar)
+static int soc_op_begin(int soc, int *old_flags,
+			progress_bar_t *const restrict prog_bar)
 {
-	int event = op_read ? POLLIN : POLLOUT;
+	if (!prog_bar)
+		return 0;
 
-	ssize_t sent = 0;
-	int old_flags = 0;
+	*old_flags = fcntl(soc, F_GETFL, 0);
+	if (fcntl(soc, F_SETFL, *old_flags | O_NONBLOCK) < 0) {
+		perror("fcntl");
+		return -1;
+	}
+
+	assert(!(*old_flags & O_NONBLOCK));
+
+	return 0;
+}
+
+static int soc_op_wait(int soc, operation_type op)
+{
 	struct pollfd p = {
 		.fd = soc,
-		.events = event,
+		.events = op == op_read ? POLLIN : POLLOUT,
 	};
 
-	if (prog_bar) {
-		old_flags = fcntl(soc, F_GETFL, 0);
-		if (fcntl(soc, F_SETFL, old_flags | O_NONBLOCK) < 0) {
-			perror("fcntl");
-			return -1;
-		}
+	const int64_t start = stats_now_ns();
+	int ret = poll(&p, 1, DEFAULT_POLL_TIMEOUT);
+	const int64_t waited = stats_now_ns() - start;
+	stats_poll(waited);
+	PROBE3(soc_wait, soc, op, waited);
+	if (ret == 0) {
+		fprintf(stderr, "sending timed out\n");
+		return -1;
+	} else if (ret < 0) {
+		perror("send_all poll");
+		return -1;
+	}
+	assert(ret == 1);
+
+	return 0;
+}
 
-		assert(!(old_flags & O_NONBLOCK));
-		prog_bar_start(prog_bar);
+static int soc_op_end(int soc, int old_flags,
+		      progress_bar_t *const restrict prog_bar)
+{
+	if (!prog_bar)
+		return 0;
+
+	if (fcntl(soc, F_SETFL, old_flags) < 0) {
+		perror("fcntl");
+		return -1;
 	}
+	prog_bar_finish(prog_bar);
+
+	return 0;
+}
+
+ssize_t perf_soc_op(int soc, operation_type op, void *restrict buf, size_t len,
+		    progress_bar_t *const restrict prog_bar)
+{
+	ssize_t sent = 0;
+	int old_flags = 0;
+
+	PROBE3(soc_op__start, soc, op, len);
+
+	if (soc_op_begin(soc, &old_flags, prog_bar) < 0)
+		return -1;
 
 	ssize_t s;
 	while (sent < len) {
 		SOCKET_OPERATION(op, s, soc, (void *)((uintptr_t)buf + sent),
 				 len - sent, 0);
+		stats_io(op, s);
 		if (s < 0) {
 			if (errno != EWOULDBLOCK) {
 				perror("send");
 				sent = s;
 				break;
 			}
+		} else if (s == 0 && op == op_read) {
+			/* the rest is never coming */
+			fprintf(stderr, "the peer closed the connection\n");
+			sent = -1;
+			break;
 		} else {
 			sent += s;
 		}
 
 		if (prog_bar) {
 			prog_bar_advance(prog_bar, sent);
-			int ret = poll(&p, 1, DEFAULT_POLL_TIMEOUT);
-			if (ret == 0) {
-				fprintf(stderr, "sending timed out\n");
+			if (soc_op_wait(soc, op) < 0) {
 				sent = -1;
 				break;
-			} else if (ret < 0) {
-				perror("send_all poll");
+			}
+		}
+	}
+
+	if (soc_op_end(soc, old_flags, prog_bar) < 0)
+		return -1;
+
+	PROBE4(soc_op__done, soc, op, len, sent);
+
+	return sent;
+}
+
+void set_nodelay(int soc)
+{
+	const int one = 1;
+	if (setsockopt(soc, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
+		PERROR("setsockopt");
+}
+
+void frame_init(frame_writer_t *w, int soc)
+{
+	w->soc = soc;
+	w->len = 0;
+	w->more = false;
+}
+
+/* sends what was gathered and then len bytes of data */
+static int frame_send(frame_writer_t *w, const void *data, size_t len,
+		      int flags)
+{
+	struct iovec iov[2] = {
+		{ .iov_base = w->buf, .iov_len = w->len },
+		{ .iov_base = (void *)data, .iov_len = len },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+	};
+	const size_t total = w->len + len;
+	ssize_t ret = total;
+
+	PROBE3(soc_op__start, w->soc, op_write, total);
+
+	for (size_t left = total; left > 0;) {
+		ssize_t s = sendmsg(w->soc, &msg, flags);
+		stats_io(op_write, s);
+		if (s < 0 && errno == EINTR)
+			continue;
+		if (s < 0) {
+			PERROR("sendmsg");
+			ret = -1;
+			break;
+		}
+
+		/* short writes only happen on signals, skip what went out */
+		left -= s;
+		while (left > 0 && (size_t)s >= msg.msg_iov->iov_len) {
+			s -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (left > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + s;
+			msg.msg_iov->iov_len -= s;
+		}
+	}
+
+	PROBE4(soc_op__done, w->soc, op_write, total, ret);
+
+	w->len = 0;
+	w->more = flags & MSG_MORE;
+
+	return ret < 0 ? -1 : 0;
+}
+
+int frame_put(frame_writer_t *w, const void *data, size_t len)
+{
+	if (len <= FRAME_BUF_SIZE - w->len) {
+		if (len)
+			memcpy(w->buf + w->len, data, len);
+		w->len += len;
+		return 0;
+	}
+
+	/* too big to gather, it goes now and the flush pushes out its tail */
+	return frame_send(w, data, len, MSG_MORE);
+}
+
+int frame_flush(frame_writer_t *w)
+{
+	if (w->len > 0)
+		return frame_send(w, NULL, 0, 0);
+
+	if (w->more) {
+		/*
+		 * nothing is left to send without MSG_MORE, clearing TCP_CORK
+		 * pushes out the held back tail just the same, even though it
+		 * was never set
+		 * unix sockets hold nothing back and do not have the option
+		 */
+		const int zero = 0;
+		const int ret = setsockopt(w->soc, IPPROTO_TCP, TCP_CORK, &zero,
+					   sizeof(zero));
+		stats_syscall();
+		w->more = false;
+		if (ret < 0 && errno != EOPNOTSUPP && errno != ENOPROTOOPT) {
+			PERROR("setsockopt");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static ssize_t splice_to_file(int soc, int pipe_fds[2], int fd,
+			      off_t *offset, size_t len)
+{
+	ssize_t s = splice(soc, NULL, pipe_fds[1], NULL, len,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	stats_io(op_read, s);
+	if (s <= 0)
+		return s;
+
+	for (ssize_t left = s; left > 0;) {
+		ssize_t w = splice(pipe_fds[0], NULL, fd, offset, left,
+				   SPLICE_F_MOVE);
+		stats_syscall();
+		if (w < 0)
+			return -1;
+		left -= w;
+	}
+
+	return s;
+}
+
+ssize_t perf_file_op(int soc, operation_type op, int fd, off_t offset,
+		     size_t len, progress_bar_t *const restrict prog_bar)
+{
+	ssize_t sent = 0;
+	int old_flags = 0;
+	int pipe_fds[2] = { -1, -1 };
+
+	PROBE5(file_op__start, soc, op, fd, offset, len);
+
+	if (op == op_read) {
+		if (pipe(pipe_fds) < 0) {
+			perror("pipe");
+			return -1;
+		}
+		/* fewer round trips through the pipe, best effort */
+		fcntl(pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	}
+
+	if (soc_op_begin(soc, &old_flags, prog_bar) < 0) {
+		sent = -1;
+		goto cleanup;
+	}
+
+	ssize_t s;
+	while (sent < len) {
+		if (op == op_read) {
+			s = splice_to_file(soc, pipe_fds, fd, &offset,
+					   len - sent);
+		} else {
+			s = sendfile(soc, fd, &offset, len - sent);
+			stats_io(op_write, s);
+		}
+
+		if (s < 0) {
+			if (errno != EWOULDBLOCK) {
+				perror(op == op_read ? "splice" : "sendfile");
+				sent = s;
+				break;
+			}
+		} else if (s == 0) {
+			fprintf(stderr, op == op_read ?
+						"connection closed while receiving\n" :
+						"file shrank while sending\n");
+			sent = -1;
+			break;
+		} else {
+			sent += s;
+		}
+
+		if (prog_bar) {
+			prog_bar_advance(prog_bar, sent);
+			if (soc_op_wait(soc, op) < 0) {
 				sent = -1;
 				break;
 			}
-			assert(ret == 1);
+		} else if (s < 0 && soc_op_wait(soc, op) < 0) {
+			sent = -1;
+			break;
 		}
 	}
 
-	if (prog_bar) {
-		if (fcntl(soc, F_SETFL, old_flags) < 0) {
-			perror("fcntl");
+	if (soc_op_end(soc, old_flags, prog_bar) < 0)
+		sent = -1;
+
+cleanup:
+	if (op == op_read) {
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+	}
+
+	PROBE5(file_op__done, soc, op, fd, len, sent);
+
+	return sent;
+}
+
+#define COPY_BUF_SIZE (1 << 20)
+
+int copy_fd_range(int src, off_t src_off, int dst, off_t dst_off, size_t len)
+{
+	while (len > 0) {
+		const ssize_t n =
+			copy_file_range(src, &src_off, dst, &dst_off, len, 0);
+		if (n < 0 && (errno == EXDEV || errno == EINVAL ||
+			      errno == ENOSYS || errno == EOPNOTSUPP))
+			break;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			PERROR("copy_file_range");
 			return -1;
 		}
-		prog_bar_finish(prog_bar);
+		len -= n;
 	}
 
-	return sent;
+	if (len == 0)
+		return 0;
+
+	char *buf = malloc(COPY_BUF_SIZE);
+	if (!buf) {
+		PERROR("malloc");
+		return -1;
+	}
+
+	int ret = 0;
+	while (len > 0) {
+		const size_t chunk = len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE;
+		const ssize_t n = pread(src, buf, chunk, src_off);
+		if (n <= 0 || pwrite(dst, buf, n, dst_off) != n) {
+			PERROR("pread/pwrite");
+			ret = -1;
+			break;
+		}
+		src_off += n;
+		dst_off += n;
+		len -= n;
+	}
+
+	free(buf);
+
+	return ret;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,3 +39,46 @@ typedef enum operation { op_read, op_write } operation_type;
 
 ssize_t perf_soc_op(int soc, operation_type op, void *restrict buf, size_t len,
 		    progress_bar_t *const restrict prog_bar);
+
+/*
+ * small writes go out right away instead of waiting for the peer's ack,
+ * gathering them is left to frame_writer_t
+ */
+void set_nodelay(int soc);
+
+/* bytes a frame_writer_t gathers before it has to send */
+#define FRAME_BUF_SIZE (16 * 1024)
+
+/*
+ * what goes out on a connection up to the next frame_flush
+ * small pieces are gathered, bigger ones leave at once together with them
+ * but with MSG_MORE, so the kernel holds back a partial segment at the end
+ * and a run of messages reaches the peer as full segments
+ * the flush, before waiting for an answer, pushes out whatever is left
+ * the data of frame_put can be reused as soon as it returns
+ */
+typedef struct frame_writer {
+	int soc;
+	size_t len;
+	/* the last send had MSG_MORE, the kernel may still hold its tail */
+	bool more;
+	char buf[FRAME_BUF_SIZE];
+} frame_writer_t;
+
+void frame_init(frame_writer_t *w, int soc);
+int frame_put(frame_writer_t *w, const void *data, size_t len);
+int frame_flush(frame_writer_t *w);
+
+/*
+ * moves len bytes between the socket and fd starting at offset without
+ * copying through userspace: sendfile when writing to the socket,
+ * splice through a pipe when reading from it
+ */
+ssize_t perf_file_op(int soc, operation_type op, int fd, off_t offset,
+		     size_t len, progress_bar_t *const restrict prog_bar);
+
+/*
+ * copies len bytes between two files, copy_file_range can share extents,
+ * a plain copy is the fallback
+ */
+int copy_fd_range(int src, off_t src_off, int dst, off_t dst_off, size_t len);
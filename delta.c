@@ -0,0 +1,499 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "delta.h"
+#include "hash.h"
+#include "message.h"
+
+#define DELTA_TMP_SUFFIX ".fs_delta"
+
+/* rsync's heuristic, the square root of the size */
+static uint32_t block_size(off_t size)
+{
+	uint32_t bs = (uint32_t)sqrt((double)size) & ~7u;
+
+	if (bs < DELTA_MIN_BLOCK)
+		return DELTA_MIN_BLOCK;
+	if (bs > DELTA_MAX_BLOCK)
+		return DELTA_MAX_BLOCK;
+	return bs;
+}
+
+int make_signature(const entry_t *entry, delta_sig_t *sig)
+{
+	*sig = (delta_sig_t){ 0 };
+
+	struct stat st;
+	if (stat(entry->rel_path, &st) < 0 || !S_ISREG(st.st_mode)) {
+		sig->header.status = ds_new;
+		return 0;
+	}
+
+	if (st.st_size == entry->size &&
+	    st.st_mtim.tv_sec == entry->mtime.tv_sec &&
+	    st.st_mtim.tv_nsec == entry->mtime.tv_nsec) {
+		sig->header.status = ds_same;
+		return 0;
+	}
+
+	const uint32_t bs = block_size(st.st_size);
+	sig->header = (delta_sig_header_t){
+		.status = ds_changed,
+		.block_size = bs,
+		.blocks = (st.st_size + bs - 1) / bs,
+		.size = st.st_size,
+	};
+
+	if (sig->header.blocks == 0)
+		return 0;
+
+	const int fd = open(entry->rel_path, O_RDONLY);
+	if (fd < 0) {
+		PERROR("open");
+		return -1;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		PERROR("mmap");
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	if (!(sig->blocks = malloc(sig->header.blocks * sizeof(block_sig_t)))) {
+		PERROR("malloc");
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	for (uint64_t i = 0; i < sig->header.blocks; ++i) {
+		const uint8_t *block = (uint8_t *)map + i * bs;
+		const size_t len =
+			st.st_size - i * bs < bs ? st.st_size - i * bs : bs;
+		rolling_t r;
+
+		rolling_init(&r, block, len);
+		sig->blocks[i] = (block_sig_t){
+			.strong = hash64(block, len, 0),
+			.weak = rolling_digest(&r),
+		};
+	}
+
+	munmap(map, st.st_size);
+
+	return 0;
+}
+
+int put_signature(frame_writer_t *w, const delta_sig_t *sig)
+{
+	const size_t blocks_size = sig->header.blocks * sizeof(block_sig_t);
+	header_t h = {
+		.type = mt_signature,
+		.data_size = sizeof(delta_sig_header_t) + blocks_size,
+	};
+
+	if (frame_put(w, &h, sizeof(h)) < 0 ||
+	    frame_put(w, &sig->header, sizeof(delta_sig_header_t)) < 0 ||
+	    frame_put(w, sig->blocks, blocks_size) < 0)
+		return -1;
+
+	return 0;
+}
+
+int recv_signature(int soc, delta_sig_t *sig)
+{
+	header_t h;
+	*sig = (delta_sig_t){ 0 };
+
+	if (perf_soc_op(soc, op_read, &h, sizeof(h), NULL) < 0 ||
+	    h.type != mt_signature || h.data_size < sizeof(delta_sig_header_t))
+		return -1;
+
+	if (perf_soc_op(soc, op_read, &sig->header, sizeof(delta_sig_header_t),
+			NULL) < 0)
+		return -1;
+
+	const size_t blocks_size = h.data_size - sizeof(delta_sig_header_t);
+	if (blocks_size != sig->header.blocks * sizeof(block_sig_t) ||
+	    (sig->header.status == ds_changed && sig->header.block_size == 0))
+		return -1;
+
+	if (blocks_size == 0)
+		return 0;
+
+	if (!(sig->blocks = malloc(blocks_size))) {
+		PERROR("malloc");
+		return -1;
+	}
+
+	if (perf_soc_op(soc, op_read, sig->blocks, blocks_size, NULL) < 0) {
+		free(sig->blocks);
+		sig->blocks = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* weak checksum lookup, chains of blocks sharing a bucket */
+typedef struct sig_index {
+	uint32_t mask;
+	uint32_t *buckets;
+	uint32_t *next;
+} sig_index_t;
+
+#define SIG_NONE UINT32_MAX
+
+static inline uint32_t sig_bucket(const sig_index_t *idx, uint32_t weak)
+{
+	return (weak * 0x9e3779b1u) >> 7 & idx->mask;
+}
+
+static int build_index(sig_index_t *idx, const delta_sig_t *sig,
+		       uint64_t full_blocks)
+{
+	uint32_t buckets = 1024;
+	while (buckets < 2 * full_blocks)
+		buckets <<= 1;
+
+	*idx = (sig_index_t){
+		.mask = buckets - 1,
+		.buckets = malloc(buckets * sizeof(uint32_t)),
+		.next = malloc((full_blocks + 1) * sizeof(uint32_t)),
+	};
+	if (!idx->buckets || !idx->next) {
+		PERROR("malloc");
+		free(idx->buckets);
+		free(idx->next);
+		return -1;
+	}
+
+	memset(idx->buckets, 0xff, buckets * sizeof(uint32_t));
+
+	/* in reverse, so chains start with the lowest block */
+	for (uint64_t i = full_blocks; i-- > 0;) {
+		const uint32_t b = sig_bucket(idx, sig->blocks[i].weak);
+		idx->next[i] = idx->buckets[b];
+		idx->buckets[b] = i;
+	}
+
+	return 0;
+}
+
+static void destroy_index(sig_index_t *idx)
+{
+	free(idx->buckets);
+	free(idx->next);
+}
+
+/* ops are buffered so consecutive copies go out as one */
+typedef struct delta_out {
+	int soc;
+	const uint8_t *map;
+	off_t literal_start;
+	delta_op_t copy;
+	progress_bar_t *prog_bar;
+} delta_out_t;
+
+static int send_op(delta_out_t *out, const delta_op_t *op)
+{
+	return perf_soc_op(out->soc, op_write, (void *)op, sizeof(*op), NULL) <
+			       0 ?
+		       -1 :
+		       0;
+}
+
+static int flush_copy(delta_out_t *out)
+{
+	if (out->copy.count == 0)
+		return 0;
+
+	const int ret = send_op(out, &out->copy);
+	out->copy.count = 0;
+
+	return ret;
+}
+
+/* sends the literal data in [literal_start, end) */
+static int flush_literal(delta_out_t *out, off_t end)
+{
+	if (end == out->literal_start)
+		return 0;
+
+	if (flush_copy(out) < 0)
+		return -1;
+
+	const delta_op_t op = {
+		.kind = do_literal,
+		.arg = end - out->literal_start,
+	};
+	if (send_op(out, &op) < 0 ||
+	    perf_soc_op(out->soc, op_write,
+			(void *)(out->map + out->literal_start), op.arg,
+			NULL) < 0)
+		return -1;
+
+	out->literal_start = end;
+	if (out->prog_bar)
+		prog_bar_advance(out->prog_bar, end);
+
+	return 0;
+}
+
+static int add_copy(delta_out_t *out, uint32_t block)
+{
+	if (out->copy.count && out->copy.arg + out->copy.count == block) {
+		out->copy.count++;
+		return 0;
+	}
+
+	if (flush_copy(out) < 0)
+		return -1;
+
+	out->copy = (delta_op_t){
+		.kind = do_copy,
+		.count = 1,
+		.arg = block,
+	};
+
+	return 0;
+}
+
+static int match_blocks(delta_out_t *out, off_t size, const delta_sig_t *sig)
+{
+	const uint32_t bs = sig->header.block_size;
+	const uint32_t last_len = sig->header.size % bs;
+	/* a short last block can only match the end of the new file */
+	const uint64_t full_blocks = sig->header.blocks - (last_len != 0);
+	const uint8_t *map = out->map;
+
+	sig_index_t idx;
+	if (build_index(&idx, sig, full_blocks) < 0)
+		return -1;
+
+	int ret = 0;
+	off_t pos = 0;
+	rolling_t r;
+
+	if (size >= bs)
+		rolling_init(&r, map, bs);
+
+	while (pos + bs <= size) {
+		const uint32_t weak = rolling_digest(&r);
+		uint32_t match = SIG_NONE;
+		bool hashed = false;
+		uint64_t strong = 0;
+
+		for (uint32_t i = idx.buckets[sig_bucket(&idx, weak)];
+		     i != SIG_NONE; i = idx.next[i]) {
+			if (sig->blocks[i].weak != weak)
+				continue;
+			if (!hashed) {
+				strong = hash64(map + pos, bs, 0);
+				hashed = true;
+			}
+			if (sig->blocks[i].strong == strong) {
+				match = i;
+				break;
+			}
+		}
+
+		if (match != SIG_NONE) {
+			if ((ret = flush_literal(out, pos)) < 0 ||
+			    (ret = add_copy(out, match)) < 0)
+				goto cleanup;
+
+			pos += bs;
+			out->literal_start = pos;
+			if (pos + bs <= size)
+				rolling_init(&r, map + pos, bs);
+			continue;
+		}
+
+		if (pos - out->literal_start >= DELTA_LITERAL_MAX &&
+		    (ret = flush_literal(out, pos)) < 0)
+			goto cleanup;
+
+		if (pos + bs < size)
+			rolling_roll(&r, map[pos], map[pos + bs]);
+		++pos;
+	}
+
+	if (last_len && size >= last_len &&
+	    size - last_len >= out->literal_start &&
+	    hash64(map + size - last_len, last_len, 0) ==
+		    sig->blocks[full_blocks].strong) {
+		if ((ret = flush_literal(out, size - last_len)) < 0 ||
+		    (ret = add_copy(out, full_blocks)) < 0)
+			goto cleanup;
+		out->literal_start = size;
+	}
+
+cleanup:
+	destroy_index(&idx);
+
+	return ret;
+}
+
+int send_delta(int soc, int fd, off_t size, const delta_sig_t *sig,
+	       transfer_engine engine, progress_bar_t *prog_bar)
+{
+	delta_out_t out = {
+		.soc = soc,
+		.prog_bar = prog_bar,
+	};
+	const delta_op_t end = { .kind = do_end };
+
+	if (sig->header.status == ds_new || sig->header.blocks == 0) {
+		const delta_op_t op = { .kind = do_literal, .arg = size };
+
+		if (size && (send_op(&out, &op) < 0 ||
+			     send_range(soc, fd, 0, size, engine, prog_bar) < 0))
+			return -1;
+
+		return send_op(&out, &end);
+	}
+
+	if (size == 0)
+		return send_op(&out, &end);
+
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		PERROR("mmap");
+		return -1;
+	}
+	madvise(map, size, MADV_SEQUENTIAL);
+	out.map = map;
+
+	int ret = match_blocks(&out, size, sig);
+	if (ret == 0)
+		ret = flush_literal(&out, size);
+	if (ret == 0)
+		ret = flush_copy(&out);
+	if (ret == 0)
+		ret = send_op(&out, &end);
+
+	if (prog_bar)
+		prog_bar_finish(prog_bar);
+	munmap(map, size);
+
+	return ret;
+}
+
+static int apply_ops(int soc, int old_fd, int tmp_fd, const entry_t *entry,
+		     const delta_sig_header_t *sig, transfer_engine engine)
+{
+	const uint64_t bs = sig->block_size;
+	off_t pos = 0;
+	delta_op_t op;
+
+	for (;;) {
+		if (perf_soc_op(soc, op_read, &op, sizeof(op), NULL) < 0)
+			return -1;
+
+		switch (op.kind) {
+		case do_end:
+			if (pos != entry->size) {
+				fprintf(stderr, "delta for `%s` is %ld bytes "
+						"short\n",
+					entry->rel_path, entry->size - pos);
+				return -1;
+			}
+			return 0;
+		case do_literal:
+			if (op.arg > (uint64_t)(entry->size - pos) ||
+			    recv_range(soc, tmp_fd, pos, op.arg, engine,
+				       NULL) < 0)
+				return -1;
+			pos += op.arg;
+			break;
+		case do_copy: {
+			if (old_fd < 0 || op.count == 0 ||
+			    op.arg + op.count > sig->blocks)
+				return -1;
+
+			const off_t src = op.arg * bs;
+			off_t len = op.count * bs;
+			if (src + len > (off_t)sig->size)
+				len = sig->size - src;
+			if (len > entry->size - pos ||
+			    copy_fd_range(old_fd, src, tmp_fd, pos, len) < 0)
+				return -1;
+			pos += len;
+			break;
+		}
+		default:
+			fprintf(stderr, "invalid delta op %u\n", op.kind);
+			return -1;
+		}
+	}
+}
+
+int recv_delta(int soc, const entry_t *entry, const delta_sig_header_t *sig,
+	       transfer_engine engine)
+{
+	char tmp_path[PATH_MAX];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s" DELTA_TMP_SUFFIX,
+		     entry->rel_path) >= (int)sizeof(tmp_path)) {
+		fprintf(stderr, "path too long: %s\n", entry->rel_path);
+		return -1;
+	}
+
+	int old_fd = -1;
+	if (sig->status == ds_changed &&
+	    (old_fd = open(entry->rel_path, O_RDONLY)) < 0) {
+		PERROR("open");
+		return -1;
+	}
+
+	int ret = -1;
+	const int tmp_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (tmp_fd < 0) {
+		PERROR("open");
+		goto cleanup;
+	}
+
+	if (apply_ops(soc, old_fd, tmp_fd, entry, sig, engine) < 0)
+		goto cleanup;
+
+	/* the mtime is what the next quick check compares */
+	const struct timespec times[2] = {
+		{ .tv_nsec = UTIME_OMIT },
+		entry->mtime,
+	};
+	if (fchmod(tmp_fd, entry->permissions & 07777) < 0 ||
+	    futimens(tmp_fd, times) < 0) {
+		PERROR("fchmod/futimens");
+		goto cleanup;
+	}
+
+	if (rename(tmp_path, entry->rel_path) < 0) {
+		PERROR("rename");
+		goto cleanup;
+	}
+
+	ret = 0;
+
+cleanup:
+	if (tmp_fd >= 0) {
+		close(tmp_fd);
+		if (ret < 0)
+			unlink(tmp_path);
+	}
+	if (old_fd >= 0)
+		close(old_fd);
+
+	return ret;
+}
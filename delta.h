@@ -0,0 +1,83 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "entry.h"
+#include "progress_bar.h"
+#include "transfer.h"
+
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK (128 * 1024)
+/* literal runs are flushed once they grow this big */
+#define DELTA_LITERAL_MAX (1 << 20)
+
+/*
+ * tf_delta: the receiver acks the metadata and sends a mt_signature message for
+ * every regular entry, in order, holding a delta_sig_header_t and the block
+ * signatures of the file it already has
+ *
+ * the sender then sends delta_op_t runs, each ending with do_end, for every
+ * entry that is not ds_same, literal data directly follows its op
+ */
+typedef enum delta_status {
+	/* nothing there, the whole file is sent as a literal */
+	ds_new,
+	/* size and mtime match, nothing is sent */
+	ds_same,
+	/* the blocks are matched against the old file */
+	ds_changed,
+} delta_status;
+
+typedef struct delta_sig_header {
+	uint32_t status;
+	uint32_t block_size;
+	uint64_t blocks;
+	/* size of the old file */
+	uint64_t size;
+} delta_sig_header_t;
+
+typedef struct block_sig {
+	uint64_t strong;
+	uint32_t weak;
+} block_sig_t;
+
+typedef struct delta_sig {
+	delta_sig_header_t header;
+	block_sig_t *blocks;
+} delta_sig_t;
+
+typedef enum delta_op_kind {
+	/* arg bytes of literal data follow */
+	do_literal,
+	/* count blocks of the old file starting at block arg */
+	do_copy,
+	do_end,
+} delta_op_kind;
+
+typedef struct delta_op {
+	uint32_t kind;
+	uint32_t count;
+	uint64_t arg;
+} delta_op_t;
+
+/*
+ * chdir to the download dir before running
+ * compares the entry with what is already there and signs the old file if
+ * it changed, sig->blocks has to be freed
+ */
+int make_signature(const entry_t *entry, delta_sig_t *sig);
+
+/* queues the signature, it is only sure to be sent after a frame_flush */
+int put_signature(frame_writer_t *w, const delta_sig_t *sig);
+/* sig->blocks has to be freed */
+int recv_signature(int soc, delta_sig_t *sig);
+
+/* fd is the new file the sender has, the engine only moves literals */
+int send_delta(int soc, int fd, off_t size, const delta_sig_t *sig,
+	       transfer_engine engine, progress_bar_t *prog_bar);
+/*
+ * chdir to the download dir before running
+ * rebuilds the entry next to the old file from the ops and moves it in place
+ */
+int recv_delta(int soc, const entry_t *entry, const delta_sig_header_t *sig,
+	       transfer_engine engine);
@@ -1,20 +1,30 @@
 #define _GNU_SOURCE
 #include <assert.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <ftw.h>
 #include <libgen.h>
 #include <linux/limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "core.h"
 #include "entry.h"
+#include "probes.h"
 
 #define MAX_FD 20
+#define SCAN_DENTS_BUF (64 * 1024)
+/* the first chunk is small so the transfer can start right away */
+#define SCAN_FIRST_CHUNK 64
 
 const char *get_entry_type_name(entry_type entry_type)
 {
@@ -23,6 +33,51 @@ const char *get_entry_type_name(entry_type entry_type)
 
 static entries_t *entries;
 
+/* set while scan_entries_chunked runs */
+static entries_chunk_fn chunk_fn;
+static void *chunk_arg;
+static size_t chunk_len, chunk_max;
+
+/* hands the entries gathered so far over to chunk_fn */
+static int flush_chunk(void)
+{
+	if (chunk_fn(entries, chunk_arg) < 0)
+		return -1;
+
+	entries->entries = (stream_t){ 0 };
+	entries->total_file_size = 0;
+
+	chunk_len = chunk_len * 2 < chunk_max ? chunk_len * 2 : chunk_max;
+
+	return 0;
+}
+
+entry_t *add_entry(stream_t *stream, entry_type type, mode_t mode, off_t size,
+		   struct timespec mtime, const char *rel_path,
+		   size_t rel_path_len)
+{
+	const size_t relative_path_size = rel_path_len + 1;
+	const size_t path_size = relative_path_size + alignof(entry_t) -
+				 relative_path_size % alignof(entry_t);
+	const size_t struct_size = sizeof(entry_t) + path_size;
+
+	entry_t *new_entry = stream_add_item(stream, struct_size);
+	if (new_entry == NULL)
+		return NULL;
+
+	*new_entry = (entry_t){
+		.type = type,
+		.permissions = mode,
+		.size = size,
+		.mtime = mtime,
+		.path_size = path_size,
+	};
+	memcpy(new_entry->rel_path, rel_path, rel_path_len);
+	new_entry->rel_path[rel_path_len] = '\0';
+
+	return new_entry;
+}
+
 static int fn(const char *path, const struct stat *s, int flags, struct FTW *f)
 {
 	static char buf[PATH_MAX];
@@ -51,30 +106,24 @@ static int fn(const char *path, const struct stat *s, int flags, struct FTW *f)
 	if (entries->parent_path[entries->parent_path_len] != '/')
 		++relative_path;
 
-	const size_t relative_path_size = strlen(relative_path) + 1;
-	const size_t path_size = relative_path_size + alignof(entry_t) -
-				 relative_path_size % alignof(entry_t);
-	const size_t struct_size = sizeof(entry_t) + path_size;
-
-	entry_t *new_entry = stream_add_item(&entries->entries, struct_size);
+	const entry_t *new_entry = add_entry(
+		&entries->entries, flags == FTW_F ? et_reg : et_dir,
+		s->st_mode, flags == FTW_F ? s->st_size : 0, s->st_mtim,
+		relative_path, strlen(relative_path));
 	if (new_entry == NULL)
 		goto error;
 
-	*new_entry = (entry_t){
-		.type = flags == FTW_F ? et_reg : et_dir,
-		.permissions = s->st_mode,
-		.size = flags == FTW_F ? s->st_size : 0,
-		.path_size = path_size,
-	};
-	memcpy(new_entry->rel_path, relative_path, relative_path_size);
-
 	entries->total_file_size += new_entry->size;
 
+	if (chunk_fn && entries->entries.metadata.len >= chunk_len)
+		return flush_chunk();
+
 error:
 	return 0;
 }
 
-int create_entries(const char *path, entries_t *e)
+/* leaves the cleanup on failure to the callers */
+static int walk_entries(const char *path, entries_t *e)
 {
 	*e = (entries_t){ 0 };
 	entries = e;
@@ -89,10 +138,445 @@ int create_entries(const char *path, entries_t *e)
 	if (nftw(path, &fn, MAX_FD, 0) < 0)
 		ERR_GOTO("nftw");
 
+	if (chunk_fn && entries->entries.metadata.len > 0)
+		return flush_chunk();
+
 	return 0;
 
 error:
-	destroy_entries(entries);
+	return -1;
+}
+
+int create_entries(const char *path, entries_t *e)
+{
+	chunk_fn = NULL;
+
+	if (walk_entries(path, e) < 0) {
+		destroy_entries(e);
+		return -1;
+	}
+
+	return 0;
+}
+
+int scan_entries_chunked(const char *path, entries_t *e, size_t max_len,
+			 entries_chunk_fn fn, void *arg)
+{
+	chunk_fn = fn;
+	chunk_arg = arg;
+	chunk_max = max_len;
+	chunk_len = SCAN_FIRST_CHUNK < max_len ? SCAN_FIRST_CHUNK : max_len;
+
+	const int ret = walk_entries(path, e);
+	chunk_fn = NULL;
+
+	/* the chunks already handed out still need the parent path */
+	if (ret < 0) {
+		destroy_stream(&e->entries);
+		e->entries = (stream_t){ 0 };
+	}
+
+	return ret;
+}
+
+typedef struct scan_dir {
+	/* relative to entries_t.parent_path */
+	char *rel_path;
+	size_t rel_path_len;
+} scan_dir_t;
+
+/* queued directories are dirs[head, head + len) */
+typedef struct scan_queue {
+	pthread_mutex_t lock;
+	scan_dir_t *dirs;
+	size_t head;
+	size_t len;
+	size_t cap;
+} scan_queue_t;
+
+typedef struct scanner scanner_t;
+
+typedef struct scan_worker {
+	pthread_t tid;
+	scanner_t *scanner;
+	unsigned idx;
+
+	/* the owner works on the back, thieves take from the front */
+	scan_queue_t queue;
+	char *dents;
+
+	stream_t entries;
+	off_t total_file_size;
+} scan_worker_t;
+
+struct scanner {
+	const entries_t *entries;
+	int parent_fd;
+
+	unsigned threads;
+	scan_worker_t *workers;
+
+	/* directories queued or being scanned, the walk ends at 0 */
+	atomic_size_t pending;
+	atomic_bool failed;
+};
+
+static int scan_push(scan_worker_t *w, const char *rel_path, size_t len)
+{
+	scan_queue_t *q = &w->queue;
+	scan_dir_t dir = {
+		.rel_path = strndup(rel_path, len),
+		.rel_path_len = len,
+	};
+	if (dir.rel_path == NULL) {
+		PERROR("strndup");
+		return -1;
+	}
+
+	pthread_mutex_lock(&q->lock);
+
+	if (q->head + q->len == q->cap && q->head > 0) {
+		memmove(q->dirs, q->dirs + q->head, q->len * sizeof(scan_dir_t));
+		q->head = 0;
+	}
+
+	if (q->len == q->cap) {
+		const size_t cap = q->cap ? q->cap * 2 : 64;
+		void *new_mem = realloc(q->dirs, cap * sizeof(scan_dir_t));
+		if (new_mem == NULL) {
+			pthread_mutex_unlock(&q->lock);
+			PERROR("realloc");
+			free(dir.rel_path);
+			return -1;
+		}
+		q->dirs = new_mem;
+		q->cap = cap;
+	}
+
+	q->dirs[q->head + q->len++] = dir;
+	atomic_fetch_add(&w->scanner->pending, 1);
+
+	pthread_mutex_unlock(&q->lock);
+
+	return 0;
+}
+
+static bool scan_take(scan_worker_t *w, scan_dir_t *dir)
+{
+	scanner_t *sc = w->scanner;
+
+	pthread_mutex_lock(&w->queue.lock);
+	const bool own = w->queue.len > 0;
+	if (own)
+		*dir = w->queue.dirs[w->queue.head + --w->queue.len];
+	pthread_mutex_unlock(&w->queue.lock);
+
+	if (own)
+		return true;
+
+	for (unsigned i = 1; i < sc->threads; ++i) {
+		scan_queue_t *victim =
+			&sc->workers[(w->idx + i) % sc->threads].queue;
+		bool stolen = false;
+
+		pthread_mutex_lock(&victim->lock);
+		if (victim->len > 0) {
+			*dir = victim->dirs[victim->head++];
+			victim->len--;
+			stolen = true;
+		}
+		pthread_mutex_unlock(&victim->lock);
+
+		if (stolen)
+			return true;
+	}
+
+	return false;
+}
+
+static void scan_child(scan_worker_t *w, int dir_fd, const struct dirent64 *d,
+		       char *rel_path, size_t len)
+{
+	const entries_t *e = w->scanner->entries;
+	static_assert(PATH_MAX * 2 < SCAN_DENTS_BUF, "");
+	char *resolved = NULL;
+
+	/* only symlinks need the expensive resolution */
+	if (d->d_type == DT_LNK || d->d_type == DT_UNKNOWN) {
+		char abs_path[PATH_MAX * 2];
+		snprintf(abs_path, sizeof(abs_path), "%s/%s", e->parent_path,
+			 rel_path);
+
+		if (!(resolved = realpath(abs_path, NULL))) {
+			PERROR("realpath");
+			return;
+		}
+		if (strstr(resolved, e->parent_path) != resolved) {
+			fprintf(stderr,
+				"symlinks outside of the root folder "
+				"are not supported: %s\n",
+				rel_path);
+			goto cleanup;
+		}
+
+		rel_path = resolved + e->parent_path_len;
+		if (e->parent_path[e->parent_path_len - 1] != '/')
+			++rel_path;
+		len = strlen(rel_path);
+	}
+
+	struct statx stx;
+	if (statx(dir_fd, d->d_name, AT_STATX_SYNC_AS_STAT,
+		  STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME,
+		  &stx) < 0) {
+		PERROR("statx");
+		goto cleanup;
+	}
+
+	const struct timespec mtime = {
+		.tv_sec = stx.stx_mtime.tv_sec,
+		.tv_nsec = stx.stx_mtime.tv_nsec,
+	};
+
+	if (S_ISREG(stx.stx_mode)) {
+		if (!add_entry(&w->entries, et_reg, stx.stx_mode, stx.stx_size,
+			       mtime, rel_path, len))
+			atomic_store(&w->scanner->failed, true);
+		w->total_file_size += stx.stx_size;
+	} else if (S_ISDIR(stx.stx_mode)) {
+		if (!add_entry(&w->entries, et_dir, stx.stx_mode, 0, mtime,
+			       rel_path, len))
+			atomic_store(&w->scanner->failed, true);
+		/* a linked directory is walked under its real path already */
+		if (!resolved && scan_push(w, rel_path, len) < 0)
+			atomic_store(&w->scanner->failed, true);
+	} else {
+		fprintf(stderr,
+			"file `%s` is an unsupported file type "
+			"or an error occurred while reading it\n",
+			rel_path);
+	}
+
+cleanup:
+	free(resolved);
+}
+
+static void scan_dir(scan_worker_t *w, const scan_dir_t *dir)
+{
+	const int fd = openat(w->scanner->parent_fd, dir->rel_path,
+			      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		PERROR("openat");
+		return;
+	}
+
+	/* child paths are built in place after the directory's own */
+	char path[PATH_MAX];
+	memcpy(path, dir->rel_path, dir->rel_path_len);
+	path[dir->rel_path_len] = '/';
+	char *name = path + dir->rel_path_len + 1;
+	const size_t name_max = sizeof(path) - dir->rel_path_len - 1;
+
+	ssize_t n;
+	while ((n = getdents64(fd, w->dents, SCAN_DENTS_BUF)) > 0) {
+		for (ssize_t off = 0; off < n;) {
+			const struct dirent64 *d =
+				(struct dirent64 *)(w->dents + off);
+			off += d->d_reclen;
+
+			if (strcmp(d->d_name, ".") == 0 ||
+			    strcmp(d->d_name, "..") == 0)
+				continue;
+
+			const size_t name_len = strlen(d->d_name);
+			if (name_len >= name_max) {
+				fprintf(stderr, "path too long: %s/%s\n",
+					dir->rel_path, d->d_name);
+				continue;
+			}
+			memcpy(name, d->d_name, name_len + 1);
+
+			scan_child(w, fd, d, path,
+				   dir->rel_path_len + 1 + name_len);
+		}
+	}
+	if (n < 0)
+		PERROR("getdents64");
+
+	close(fd);
+}
+
+static void *scan_worker(void *arg)
+{
+	scan_worker_t *w = arg;
+	scanner_t *sc = w->scanner;
+	scan_dir_t dir;
+
+	while (true) {
+		if (!scan_take(w, &dir)) {
+			if (atomic_load(&sc->pending) == 0)
+				break;
+			sched_yield();
+			continue;
+		}
+
+		scan_dir(w, &dir);
+		free(dir.rel_path);
+		atomic_fetch_sub(&sc->pending, 1);
+	}
+
+	return NULL;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	return strcmp((*(entry_t *const *)a)->rel_path,
+		      (*(entry_t *const *)b)->rel_path);
+}
+
+/* sorted by path, which puts every directory before its contents */
+static int merge_entries(scanner_t *sc, entries_t *e)
+{
+	size_t len = 0;
+	for (unsigned i = 0; i < sc->threads; ++i)
+		len += sc->workers[i].entries.metadata.len;
+
+	entry_t **all = malloc((len ? len : 1) * sizeof(entry_t *));
+	if (all == NULL) {
+		PERROR("malloc");
+		return -1;
+	}
+
+	size_t j = 0;
+	for (unsigned i = 0; i < sc->threads; ++i) {
+		stream_iter_t it;
+		stream_iter_init(&it, &sc->workers[i].entries);
+		entry_t *entry;
+		while ((entry = stream_iter_next(&it)))
+			all[j++] = entry;
+		e->total_file_size += sc->workers[i].total_file_size;
+	}
+
+	qsort(all, len, sizeof(entry_t *), compare_entries);
+
+	int ret = 0;
+	for (j = 0; j < len; ++j) {
+		if (!add_entry(&e->entries, all[j]->type, all[j]->permissions,
+			       all[j]->size, all[j]->mtime, all[j]->rel_path,
+			       strlen(all[j]->rel_path))) {
+			ret = -1;
+			break;
+		}
+	}
+
+	free(all);
+
+	return ret;
+}
+
+int create_entries_parallel(const char *path, entries_t *e, unsigned threads)
+{
+	if (threads <= 1)
+		return create_entries(path, e);
+
+	*e = (entries_t){ 0 };
+
+	if (!(e->parent_path = realpath(path, NULL)))
+		ERR_GOTO("realpath");
+
+	const char *root_name = strdupa(basename(e->parent_path));
+	e->parent_path = dirname(e->parent_path);
+	e->parent_path_len = strlen(e->parent_path);
+
+	struct stat root;
+	if (stat(path, &root) < 0)
+		ERR_GOTO("stat");
+
+	const bool root_dir = S_ISDIR(root.st_mode);
+	if (!add_entry(&e->entries, root_dir ? et_dir : et_reg, root.st_mode,
+		       root_dir ? 0 : root.st_size, root.st_mtim, root_name,
+		       strlen(root_name)))
+		goto error;
+	e->total_file_size = root_dir ? 0 : root.st_size;
+
+	if (!root_dir)
+		return 0;
+
+	scanner_t sc = {
+		.entries = e,
+		.threads = threads,
+		.workers = calloc(threads, sizeof(scan_worker_t)),
+	};
+	if (sc.workers == NULL)
+		ERR_GOTO("calloc");
+
+	int ret = 0;
+	unsigned started = 0;
+
+	if ((sc.parent_fd = open(e->parent_path,
+				 O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		PERROR("open");
+		ret = -1;
+		goto scan_cleanup;
+	}
+
+	for (unsigned i = 0; i < threads; ++i) {
+		sc.workers[i] = (scan_worker_t){
+			.scanner = &sc,
+			.idx = i,
+			.queue.lock = PTHREAD_MUTEX_INITIALIZER,
+			.dents = malloc(SCAN_DENTS_BUF),
+		};
+		if (sc.workers[i].dents == NULL) {
+			PERROR("malloc");
+			ret = -1;
+			goto scan_cleanup;
+		}
+	}
+
+	if ((ret = scan_push(&sc.workers[0], root_name, strlen(root_name))) <
+	    0)
+		goto scan_cleanup;
+
+	for (; started < threads; ++started) {
+		if (pthread_create(&sc.workers[started].tid, NULL, scan_worker,
+				   &sc.workers[started])) {
+			PERROR("pthread_create");
+			break;
+		}
+	}
+	/* the started ones still finish the walk */
+	if (started == 0)
+		ret = -1;
+
+	for (unsigned i = 0; i < started; ++i)
+		pthread_join(sc.workers[i].tid, NULL);
+
+	if (ret == 0 && atomic_load(&sc.failed))
+		ret = -1;
+	if (ret == 0)
+		ret = merge_entries(&sc, e);
+
+scan_cleanup:
+	if (sc.parent_fd >= 0)
+		close(sc.parent_fd);
+	for (unsigned i = 0; i < threads; ++i) {
+		const scan_queue_t *q = &sc.workers[i].queue;
+		for (size_t j = q->head; j < q->head + q->len; ++j)
+			free(q->dirs[j].rel_path);
+		free(sc.workers[i].queue.dirs);
+		free(sc.workers[i].dents);
+		destroy_stream(&sc.workers[i].entries);
+	}
+	free(sc.workers);
+
+	if (ret < 0)
+		goto error;
+
+	return 0;
+
+error:
+	destroy_entries(e);
 
 	return -1;
 }
@@ -103,23 +587,239 @@ void destroy_entries(entries_t *entries)
 	destroy_stream(&entries->entries);
 }
 
-int get_entry_handles(entry_t *entry, entry_handles_t *handles,
-		      operation_type operation)
+static int entry_table_reserve(entry_table_t *t, size_t len, size_t pool_size)
+{
+	if (len > t->cap) {
+		size_t cap = t->cap ? 2 * t->cap : 64;
+		if (cap < len)
+			cap = len;
+
+		uint8_t *types = realloc(t->types, cap * sizeof(*t->types));
+		if (types)
+			t->types = types;
+		mode_t *modes = realloc(t->modes, cap * sizeof(*t->modes));
+		if (modes)
+			t->modes = modes;
+		off_t *sizes = realloc(t->sizes, cap * sizeof(*t->sizes));
+		if (sizes)
+			t->sizes = sizes;
+		struct timespec *mtimes =
+			realloc(t->mtimes, cap * sizeof(*t->mtimes));
+		if (mtimes)
+			t->mtimes = mtimes;
+		size_t *offsets = realloc(t->path_offsets,
+					  (cap + 1) * sizeof(*t->path_offsets));
+		if (offsets)
+			t->path_offsets = offsets;
+
+		if (!types || !modes || !sizes || !mtimes || !offsets)
+			ERR_GOTO("realloc");
+		t->cap = cap;
+	}
+
+	if (pool_size > t->pool_cap) {
+		size_t cap = t->pool_cap ? 2 * t->pool_cap : 4096;
+		if (cap < pool_size)
+			cap = pool_size;
+
+		char *pool = realloc(t->pool, cap);
+		if (!pool)
+			ERR_GOTO("realloc");
+		t->pool = pool;
+		t->pool_cap = cap;
+	}
+
+	return 0;
+
+error:
+	return -1;
+}
+
+int entry_table_add(entry_table_t *t, entry_type type, mode_t mode,
+		    off_t size, struct timespec mtime, const char *rel_path,
+		    size_t rel_path_len)
+{
+	if (entry_table_reserve(t, t->len + 1,
+				t->pool_size + rel_path_len + 1) < 0)
+		return -1;
+
+	const size_t i = t->len++;
+	t->types[i] = type;
+	t->modes[i] = mode;
+	t->sizes[i] = size;
+	t->mtimes[i] = mtime;
+	t->path_offsets[i] = t->pool_size;
+
+	memcpy(t->pool + t->pool_size, rel_path, rel_path_len);
+	t->pool[t->pool_size + rel_path_len] = '\0';
+	t->pool_size += rel_path_len + 1;
+	t->path_offsets[i + 1] = t->pool_size;
+
+	return 0;
+}
+
+int entry_table_from_stream(entry_table_t *t, const stream_t *entries)
+{
+	*t = (entry_table_t){ 0 };
+
+	/* the paths take less than the entries they came from */
+	if (entry_table_reserve(t, entries->metadata.len, entries->size) < 0)
+		goto error;
+
+	stream_iter_t it;
+	stream_iter_init(&it, entries);
+	const entry_t *entry;
+
+	while ((entry = stream_iter_next(&it))) {
+		if (entry_table_add(t, entry->type, entry->permissions,
+				    entry->size, entry->mtime, entry->rel_path,
+				    strlen(entry->rel_path)) < 0)
+			goto error;
+	}
+
+	return 0;
+
+error:
+	destroy_entry_table(t);
+
+	return -1;
+}
+
+int entry_table_to_stream(const entry_table_t *t, stream_t *entries)
+{
+	for (size_t i = 0; i < t->len; ++i) {
+		const size_t path_len =
+			t->path_offsets[i + 1] - t->path_offsets[i] - 1;
+
+		if (!add_entry(entries, t->types[i], t->modes[i], t->sizes[i],
+			       t->mtimes[i], entry_table_path(t, i), path_len))
+			return -1;
+	}
+
+	return 0;
+}
+
+void destroy_entry_table(entry_table_t *t)
+{
+	free(t->types);
+	free(t->modes);
+	free(t->sizes);
+	free(t->mtimes);
+	free(t->path_offsets);
+	free(t->pool);
+
+	*t = (entry_table_t){ 0 };
+}
+
+off_t entry_table_total_size(const entry_table_t *t)
+{
+	off_t total = 0;
+
+	/* masked instead of branching, so the loop vectorizes */
+	for (size_t i = 0; i < t->len; ++i)
+		total += t->sizes[i] & -(off_t)(t->types[i] == et_reg);
+
+	return total;
+}
+
+size_t count_files(const stream_t *entries)
+{
+	stream_iter_t it;
+	stream_iter_init(&it, entries);
+
+	size_t files = 0;
+	const entry_t *entry;
+	while ((entry = stream_iter_next(&it)))
+		files += entry->type == et_reg;
+
+	return files;
+}
+
+int check_entries(const stream_t *entries)
+{
+	stream_iter_t it;
+	stream_iter_init(&it, entries);
+
+	const entry_t *entry;
+	for (size_t i = 0; (entry = stream_iter_next(&it)); ++i) {
+		const size_t size = entries->metadata.sizes[i];
+		if (size < sizeof(entry_t) || size % alignof(entry_t) ||
+		    entry->path_size != size - sizeof(entry_t) ||
+		    !memchr(entry->rel_path, '\0', entry->path_size)) {
+			fprintf(stderr, "entry %zu is malformed\n", i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int open_entry(const entry_t *entry, operation_type operation)
 {
 	assert(entry->type == et_reg);
 
 	int open_flags = operation == op_read ?
 				 O_RDONLY :
-				 O_RDWR | O_CREAT | O_APPEND | O_EXCL;
+				 O_RDWR | O_CREAT | O_EXCL;
+
+	int fd = open(entry->rel_path, open_flags, entry->permissions);
+	if (fd < 0)
+		PERROR("open");
+
+	return fd;
+}
+
+int reopen_entry(const entry_t *entry)
+{
+	assert(entry->type == et_reg);
+
+	int fd = open(entry->rel_path, O_RDWR | O_CREAT, entry->permissions);
+	if (fd < 0)
+		PERROR("open");
+
+	return fd;
+}
+
+int set_mtimes(const stream_t *entries)
+{
+	stream_iter_t it;
+	stream_iter_init(&it, entries);
+	const entry_t *entry;
+	int ret = 0;
+
+	while ((entry = stream_iter_next(&it))) {
+		if (entry->type != et_reg)
+			continue;
+
+		const struct timespec times[2] = {
+			{ .tv_nsec = UTIME_OMIT },
+			entry->mtime,
+		};
+		if (utimensat(AT_FDCWD, entry->rel_path, times, 0) < 0) {
+			PERROR("utimensat");
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+int get_entry_handles(entry_t *entry, entry_handles_t *handles,
+		      operation_type operation)
+{
+	assert(entry->type == et_reg);
+
 	int map_flags = operation == op_read ? PROT_READ : PROT_WRITE;
 
 	*handles = (entry_handles_t){
 		.size = entry->size,
 	};
 
-	if ((handles->fd =
-		     open(entry->rel_path, open_flags, entry->permissions)) < 0)
-		ERR_GOTO("open");
+	if ((handles->fd = open_entry(entry, operation)) < 0)
+		return -1;
+
+	PROBE4(entry__open, entry->rel_path, entry->size, operation,
+	       handles->fd);
 
 	if (handles->size == 0)
 		return 0;
@@ -140,6 +840,7 @@ error:
 
 void close_entry_handles(entry_handles_t *handles)
 {
+	PROBE2(entry__close, handles->fd, handles->size);
 	munmap(handles->map, handles->size);
 	close(handles->fd);
 }
@@ -1,5 +1,7 @@
 #pragma once
+#include <stdint.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "core.h"
 #include "stream.h"
@@ -10,6 +12,7 @@ typedef struct entry {
 	entry_type type;
 	mode_t permissions;
 	off_t size;
+	struct timespec mtime;
 
 	/* includes the null byte */
 	/* contains alignment padding */
@@ -20,6 +23,11 @@ typedef struct entry {
 
 const char *get_entry_type_name(entry_type entry_type);
 
+/* appends an entry, rel_path does not have to be null-terminated */
+entry_t *add_entry(stream_t *stream, entry_type type, mode_t mode, off_t size,
+		   struct timespec mtime, const char *rel_path,
+		   size_t rel_path_len);
+
 typedef struct entries {
 	off_t total_file_size;
 
@@ -31,7 +39,72 @@ typedef struct entries {
 } entries_t;
 
 int create_entries(const char *path, entries_t *entries);
+/*
+ * walks the tree with threads workers stealing directories from each other
+ * the entries come out sorted by path, 1 thread falls back to create_entries
+ */
+int create_entries_parallel(const char *path, entries_t *entries,
+			    unsigned threads);
+/*
+ * called with the entries walked since the previous chunk, it takes over
+ * entries->entries and entries->total_file_size only covers the chunk
+ * returning -1 stops the walk
+ */
+typedef int (*entries_chunk_fn)(entries_t *entries, void *arg);
+/*
+ * like create_entries, but hands the entries to fn in chunks of at most
+ * max_len while the walk is still running, parents always come first
+ * entries is left without any entries, only the parent path, and has to be
+ * destroyed even if the walk failed
+ */
+int scan_entries_chunked(const char *path, entries_t *entries,
+			 size_t max_len, entries_chunk_fn fn, void *arg);
 void destroy_entries(entries_t *entries);
+/* the regular files among the entries */
+size_t count_files(const stream_t *entries);
+/*
+ * for entries a peer sent, every item has to be laid out like add_entry
+ * does it, with rel_path ending inside of it
+ */
+int check_entries(const stream_t *entries);
+
+/*
+ * the same entries as parallel arrays, so passes that only need the sizes or
+ * types do not drag every path through the cache
+ * the path of entry i is pool[path_offsets[i], path_offsets[i + 1]), the
+ * null byte included
+ */
+typedef struct entry_table {
+	size_t len;
+	size_t cap;
+	uint8_t *types;
+	mode_t *modes;
+	off_t *sizes;
+	struct timespec *mtimes;
+	/* len + 1 of them */
+	size_t *path_offsets;
+
+	size_t pool_size;
+	size_t pool_cap;
+	char *pool;
+} entry_table_t;
+
+int entry_table_add(entry_table_t *table, entry_type type, mode_t mode,
+		    off_t size, struct timespec mtime, const char *rel_path,
+		    size_t rel_path_len);
+int entry_table_from_stream(entry_table_t *table, const stream_t *entries);
+/* appends the entries of the table to the stream */
+int entry_table_to_stream(const entry_table_t *table, stream_t *entries);
+void destroy_entry_table(entry_table_t *table);
+
+static inline const char *entry_table_path(const entry_table_t *table,
+					   size_t i)
+{
+	return table->pool + table->path_offsets[i];
+}
+
+/* of the regular files */
+off_t entry_table_total_size(const entry_table_t *table);
 
 typedef struct entry_handles {
 	int fd;
@@ -39,6 +112,19 @@ typedef struct entry_handles {
 	size_t size;
 } entry_handles_t;
 
+/* chdir to entries_t.parent_path before running */
+/* returns the fd or -1, the file is created when writing */
+int open_entry(const entry_t *entry, operation_type operation);
+/* like open_entry for writing, but an existing file is kept as it is */
+int reopen_entry(const entry_t *entry);
+
+/*
+ * chdir to entries_t.parent_path before running
+ * gives every regular file the sender's mtime once its data is written, the
+ * quick check of a later delta transfer compares it
+ */
+int set_mtimes(const stream_t *entries);
+
 /* chdir to entries_t.parent_path before running */
 /* will set entry_handles.map to NULL if entry.size is 0 */
 int get_entry_handles(entry_t *entry, entry_handles_t *handles,
@@ -0,0 +1,658 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <endian.h>
+#include <linux/limits.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "compact.h"
+#include "core.h"
+#include "entry.h"
+#include "event_loop.h"
+#include "message.h"
+#include "probes.h"
+#include "progress_bar.h"
+#include "server.h"
+#include "stats.h"
+#include "stream.h"
+
+#define EV_BUF_SIZE (256 * 1024)
+#define EV_MAX_EVENTS 64
+/* bytes one session may take per wakeup before the others get a turn */
+#define EV_FAIR_SHARE (4 << 20)
+#define EV_MAX_MSG_SIZE (PATH_MAX + 4096)
+/* requests with other flags or several streams go to a thread of their own */
+#define EV_SUPPORTED_FLAGS (tf_batch | tf_compact)
+
+typedef enum ev_state {
+	es_pinfo_header,
+	es_pinfo,
+	es_req_header,
+	es_req,
+	es_stream_info,
+	es_stream_sizes,
+	es_stream_data,
+	es_compact_header,
+	es_compact_data,
+	es_data,
+	es_batch_header,
+	es_batch_data,
+	es_done,
+	/* given to hand_off_client */
+	es_handed,
+} ev_state;
+
+typedef struct ev_session {
+	int soc;
+	char addr_str[INET_ADDRSTRLEN];
+	ev_state state;
+	time_t last_active;
+
+	/* the read that has to complete before the state can advance */
+	void *dst;
+	size_t want;
+	size_t got;
+
+	header_t header;
+	peer_info_t *info;
+	request_data_t *request;
+	/* bytes reserved against --max-inflight */
+	off_t admitted;
+	stream_info_t sinfo;
+	stream_t entries;
+	stream_iter_t it;
+
+	/* tf_compact, only set while the entries are decoded */
+	compact_header_t compact;
+	entry_decoder_t *decoder;
+	uint8_t *compact_buf;
+	uint64_t compact_left;
+
+	/* entry whose data is being received */
+	entry_t *entry;
+	int fd;
+	off_t file_done;
+
+	batch_t batch;
+	batch_header_t batch_header;
+
+	session_stats_t stats;
+	/* counted by the progress reporter since it was accepted */
+	bool progress;
+
+	struct ev_session *prev;
+	struct ev_session *next;
+} ev_session_t;
+
+typedef struct ev_loop {
+	pthread_t tid;
+	int epfd;
+	char *buf;
+
+	/* only used to find sessions that timed out */
+	pthread_mutex_t lock;
+	ev_session_t *sessions;
+} ev_loop_t;
+
+static time_t now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static void ev_set_state(ev_session_t *s, ev_state state)
+{
+	PROBE3(ev__state, s->soc, s->state, state);
+	s->state = state;
+}
+
+static void ev_expect(ev_session_t *s, ev_state state, void *dst, size_t want)
+{
+	ev_set_state(s, state);
+	s->dst = dst;
+	s->want = want;
+	s->got = 0;
+}
+
+static int ev_reply(ev_session_t *s, message_type type)
+{
+	header_t h = {
+		.type = type,
+		.data_size = 0,
+	};
+
+	/* the peer is waiting for it, so the socket buffer is empty */
+	const ssize_t sent =
+		send(s->soc, &h, sizeof(h), MSG_DONTWAIT | MSG_NOSIGNAL);
+	stats_io(op_write, sent);
+	if (sent != sizeof(h)) {
+		PERROR("send");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* 1 when the expected read completed, 0 if it has to wait, -1 on error */
+static int ev_fill(ev_session_t *s)
+{
+	while (s->got < s->want) {
+		const ssize_t r = recv(s->soc, (char *)s->dst + s->got,
+				       s->want - s->got, 0);
+		stats_io(op_read, r);
+		if (r < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		if (r == 0) {
+			fprintf(stderr, "Host %s closed the connection\n",
+				s->addr_str);
+			return -1;
+		}
+		s->got += r;
+	}
+
+	return 1;
+}
+
+/* min is the smallest data_size the fields read from the message need */
+static int ev_alloc_msg(ev_session_t *s, ev_state state, void **dst,
+			size_t min)
+{
+	if (s->header.data_size < min ||
+	    s->header.data_size > EV_MAX_MSG_SIZE) {
+		fprintf(stderr, "Host %s sent a message of %zu bytes\n",
+			s->addr_str, s->header.data_size);
+		return -1;
+	}
+
+	if (!(*dst = malloc(s->header.data_size))) {
+		PERROR("malloc");
+		return -1;
+	}
+	ev_expect(s, state, *dst, s->header.data_size);
+
+	return 1;
+}
+
+static int ev_confirm(ev_session_t *s)
+{
+	const request_data_t *req = s->request;
+
+	char why[128];
+	if (check_request(req, s->header.data_size, why, sizeof(why)) < 0) {
+		fprintf(stderr, "Host %s sent an invalid request: %s\n",
+			s->addr_str, why);
+		send_nack(s->soc, why);
+		return -1;
+	}
+
+	if (req->streams != 1 || req->flags & ~EV_SUPPORTED_FLAGS) {
+		ev_set_state(s, es_handed);
+		return 1;
+	}
+
+	if (!admit_transfer(req->total_file_size)) {
+		send_busy(s->soc, s->addr_str);
+		return -1;
+	}
+	s->admitted = req->total_file_size;
+
+	/* never waits for stdin, the loops only run with --yes */
+	const int accept =
+		ask_transfer(s->info->username, s->addr_str, s->request);
+	if (accept < 0 || ev_reply(s, accept ? mt_ack : mt_nack) < 0)
+		return -1;
+	if (!accept)
+		return -1;
+
+	progress_begin(req->total_file_size, 0);
+	s->progress = true;
+	stats_phase_begin(sp_metadata);
+	batch_init(&s->batch,
+		   req->flags & tf_batch ? req->batch_threshold : 0);
+	if (req->flags & tf_compact)
+		ev_expect(s, es_compact_header, &s->compact,
+			  sizeof(s->compact));
+	else
+		ev_expect(s, es_stream_info, &s->sinfo, sizeof(s->sinfo));
+
+	return 1;
+}
+
+static int ev_entries_received(ev_session_t *s)
+{
+	if (ev_reply(s, mt_ack) < 0)
+		return -1;
+	const size_t files = count_files(&s->entries);
+	stats_files(files);
+	progress_expect(0, files);
+	stats_phase_begin(sp_data);
+	stream_iter_init(&s->it, &s->entries);
+	ev_set_state(s, es_data);
+
+	return 1;
+}
+
+static void ev_expect_compact(ev_session_t *s)
+{
+	ev_expect(s, es_compact_data, s->compact_buf,
+		  s->compact_left < COMPACT_BUF_SIZE ? s->compact_left :
+						       COMPACT_BUF_SIZE);
+}
+
+static int ev_compact_begin(ev_session_t *s)
+{
+	s->decoder = malloc(sizeof(entry_decoder_t));
+	s->compact_buf = malloc(COMPACT_BUF_SIZE);
+	if (!s->decoder || !s->compact_buf) {
+		PERROR("malloc");
+		return -1;
+	}
+
+	if (entry_decoder_init(s->decoder, &s->entries, &s->compact) < 0)
+		return -1;
+
+	s->compact_left = le64toh(s->compact.size);
+	ev_expect_compact(s);
+
+	return 1;
+}
+
+/* every piece is decoded as soon as it is in */
+static int ev_compact_data(ev_session_t *s)
+{
+	if (entry_decoder_feed(s->decoder, s->compact_buf, s->got) < 0)
+		return -1;
+
+	s->compact_left -= s->got;
+	if (s->compact_left) {
+		ev_expect_compact(s);
+		return 1;
+	}
+
+	if (!entry_decoder_done(s->decoder)) {
+		fprintf(stderr, "Host %s sent too few entries\n", s->addr_str);
+		return -1;
+	}
+
+	free(s->decoder);
+	free(s->compact_buf);
+	s->decoder = NULL;
+	s->compact_buf = NULL;
+
+	return ev_entries_received(s);
+}
+
+/* called when the read of the current state completed */
+static int ev_advance(ev_session_t *s)
+{
+	switch (s->state) {
+	case es_pinfo_header:
+		/* the extra connections of a striped transfer join its thread */
+		if (s->header.type == mt_join) {
+			ev_set_state(s, es_handed);
+			return 1;
+		}
+		if (s->header.type != mt_pinfo) {
+			fprintf(stderr,
+				"Client from host %s didn't send a peer info "
+				"message\n",
+				s->addr_str);
+			return -1;
+		}
+		return ev_alloc_msg(s, es_pinfo, (void **)&s->info,
+				    sizeof(peer_info_t) + 1);
+	case es_pinfo:
+		((char *)s->info)[s->header.data_size - 1] = '\0';
+		if (ev_reply(s, mt_ack) < 0)
+			return -1;
+		printf("Client %s from address %s has connected\n",
+		       s->info->username, s->addr_str);
+		ev_expect(s, es_req_header, &s->header, sizeof(s->header));
+		return 1;
+	case es_req_header:
+		if (s->header.type != mt_req) {
+			fprintf(stderr,
+				"Client %s from host %s didn't send a request "
+				"messsage\n",
+				s->info->username, s->addr_str);
+			return -1;
+		}
+		return ev_alloc_msg(s, es_req, (void **)&s->request,
+				    sizeof(request_data_t));
+	case es_req:
+		return ev_confirm(s);
+	case es_stream_info:
+		if (stream_alloc(&s->entries, &s->sinfo, sizeof(entry_t)) < 0)
+			return -1;
+		ev_expect(s, es_stream_sizes, s->entries.metadata.sizes,
+			  s->sinfo.len * sizeof(size_t));
+		return 1;
+	case es_stream_sizes:
+		if (stream_check(&s->entries, sizeof(entry_t)) < 0)
+			return -1;
+		ev_expect(s, es_stream_data, s->entries.head->data,
+			  s->sinfo.size);
+		return 1;
+	case es_stream_data:
+		if (check_entries(&s->entries) < 0)
+			return -1;
+		return ev_entries_received(s);
+	case es_compact_header:
+		return ev_compact_begin(s);
+	case es_compact_data:
+		return ev_compact_data(s);
+	case es_batch_header:
+		if (batch_frame_begin(&s->batch, &s->batch_header) < 0)
+			return -1;
+		ev_expect(s, es_batch_data, s->batch.buf, s->batch.size);
+		return 1;
+	case es_batch_data:
+		ev_set_state(s, es_data);
+		return 1;
+	case es_data:
+	case es_done:
+	case es_handed:
+		break;
+	}
+
+	return -1;
+}
+
+static void ev_next_entry(ev_session_t *s)
+{
+	if (s->fd >= 0)
+		close(s->fd);
+	s->fd = -1;
+	s->file_done = 0;
+	s->entry = NULL;
+}
+
+/* receives file data until the socket runs dry or the next frame is due */
+static int ev_data(ev_loop_t *loop, ev_session_t *s, size_t *budget)
+{
+	while (*budget > 0) {
+		if (!s->entry && !(s->entry = stream_iter_next(&s->it))) {
+			if (set_mtimes(&s->entries) < 0)
+				return -1;
+			ev_set_state(s, es_done);
+			return 1;
+		}
+
+		entry_t *e = s->entry;
+
+		if (e->type == et_dir) {
+			if (mkdir(e->rel_path, e->permissions) < 0)
+				PERROR("mkdir");
+			ev_next_entry(s);
+			continue;
+		}
+
+		if (is_batched(&s->batch, e)) {
+			if (s->batch.left == 0) {
+				ev_expect(s, es_batch_header, &s->batch_header,
+					  sizeof(s->batch_header));
+				return 1;
+			}
+			if (batch_write_entry(e, &s->batch) < 0)
+				return -1;
+			ev_next_entry(s);
+			continue;
+		}
+
+		if (s->fd < 0 && (s->fd = open_entry(e, op_write)) < 0)
+			return -1;
+
+		if (s->file_done == e->size) {
+			progress_add(0, 1);
+			ev_next_entry(s);
+			continue;
+		}
+
+		const off_t left = e->size - s->file_done;
+		const ssize_t r = recv(s->soc, loop->buf,
+				       left < EV_BUF_SIZE ? left : EV_BUF_SIZE,
+				       0);
+		stats_io(op_read, r);
+		if (r < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		if (r == 0) {
+			fprintf(stderr, "Host %s closed the connection\n",
+				s->addr_str);
+			return -1;
+		}
+
+		for (ssize_t written = 0; written < r;) {
+			const ssize_t w = pwrite(s->fd, loop->buf + written,
+						 r - written,
+						 s->file_done + written);
+			stats_syscall();
+			if (w < 0) {
+				PERROR("pwrite");
+				return -1;
+			}
+			written += w;
+		}
+
+		s->file_done += r;
+		progress_add(r, 0);
+		*budget = *budget > (size_t)r ? *budget - r : 0;
+	}
+
+	return 0;
+}
+
+/* 0 to keep the session, 1 when it finished and -1 on error */
+static int ev_drive(ev_loop_t *loop, ev_session_t *s)
+{
+	size_t budget = EV_FAIR_SHARE;
+	int ret;
+
+	s->last_active = now();
+	/* this thread works for every session in turn */
+	stats_attach(&s->stats);
+
+	do {
+		if (s->state == es_data) {
+			ret = ev_data(loop, s, &budget);
+		} else {
+			ret = ev_fill(s);
+			if (ret == 1)
+				ret = ev_advance(s);
+		}
+
+		if (s->state == es_done || s->state == es_handed) {
+			ret = 1;
+			break;
+		}
+	} while (ret == 1 && budget > 0);
+
+	stats_attach(NULL);
+
+	return ret;
+}
+
+static void ev_close(ev_loop_t *loop, ev_session_t *s)
+{
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s->soc, NULL);
+	if (s->fd >= 0)
+		close(s->fd);
+
+	if (s->state == es_handed &&
+	    hand_off_client(s->soc, s->addr_str, &s->stats, s->info,
+			    &s->header, s->request) == 0) {
+		s->info = NULL;
+		s->request = NULL;
+	} else {
+		close(s->soc);
+		printf("Disconnected client %s from host %s\n",
+		       s->info ? s->info->username : default_user_name,
+		       s->addr_str);
+
+		stats_finish(&s->stats, s->state == es_done);
+		report_session(&s->stats);
+	}
+	if (s->progress)
+		progress_end();
+
+	pthread_mutex_lock(&loop->lock);
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		loop->sessions = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	pthread_mutex_unlock(&loop->lock);
+
+	release_transfer(s->admitted);
+	free(s->info);
+	free(s->request);
+	destroy_stream(&s->entries);
+	free(s->decoder);
+	free(s->compact_buf);
+	destroy_batch(&s->batch);
+	free(s);
+}
+
+static void ev_close_idle(ev_loop_t *loop)
+{
+	const time_t deadline = now() - DEFAULT_POLL_TIMEOUT / 1000;
+	ev_session_t *idle[EV_MAX_EVENTS];
+	size_t len = 0;
+
+	pthread_mutex_lock(&loop->lock);
+	for (ev_session_t *s = loop->sessions; s && len < EV_MAX_EVENTS;
+	     s = s->next) {
+		if (s->last_active < deadline)
+			idle[len++] = s;
+	}
+	pthread_mutex_unlock(&loop->lock);
+
+	for (size_t i = 0; i < len; ++i) {
+		fprintf(stderr, "Host %s timed out\n", idle[i]->addr_str);
+		ev_close(loop, idle[i]);
+	}
+}
+
+static void *ev_run(void *arg)
+{
+	ev_loop_t *loop = arg;
+	struct epoll_event events[EV_MAX_EVENTS];
+	time_t last_sweep = now();
+
+	while (true) {
+		const int n = epoll_wait(loop->epfd, events, EV_MAX_EVENTS,
+					 1000);
+		if (n < 0 && errno != EINTR) {
+			PERROR("epoll_wait");
+			break;
+		}
+
+		for (int i = 0; i < n; ++i) {
+			ev_session_t *s = events[i].data.ptr;
+			if (ev_drive(loop, s) != 0)
+				ev_close(loop, s);
+		}
+
+		if (now() != last_sweep) {
+			ev_close_idle(loop);
+			last_sweep = now();
+		}
+	}
+
+	return NULL;
+}
+
+static void ev_add(ev_loop_t *loop, int soc, const struct sockaddr_in *addr)
+{
+	ev_session_t *s = malloc(sizeof(ev_session_t));
+	if (s == NULL) {
+		PERROR("malloc");
+		close(soc);
+		return;
+	}
+
+	*s = (ev_session_t){
+		.soc = soc,
+		.fd = -1,
+		.last_active = now(),
+	};
+	ev_expect(s, es_pinfo_header, &s->header, sizeof(s->header));
+
+	if (!inet_ntop(AF_INET, &addr->sin_addr, s->addr_str, INET_ADDRSTRLEN))
+		PERROR("inet_ntop");
+	stats_start(&s->stats, s->addr_str, sp_handshake);
+
+	pthread_mutex_lock(&loop->lock);
+	s->next = loop->sessions;
+	if (s->next)
+		s->next->prev = s;
+	loop->sessions = s;
+	pthread_mutex_unlock(&loop->lock);
+
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLRDHUP,
+		.data.ptr = s,
+	};
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, soc, &ev) < 0) {
+		PERROR("epoll_ctl");
+		ev_close(loop, s);
+	}
+}
+
+int run_event_loops(int listen_soc, unsigned loops, const char *download_dir)
+{
+	ev_loop_t *l = calloc(loops, sizeof(ev_loop_t));
+	if (l == NULL) {
+		PERROR("calloc");
+		return -1;
+	}
+
+	/* every session writes relative to the same directory */
+	if (chdir(download_dir) < 0) {
+		PERROR("chdir");
+		return -1;
+	}
+
+	for (unsigned i = 0; i < loops; ++i) {
+		pthread_mutex_init(&l[i].lock, NULL);
+		if ((l[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+			ERR_EXIT("epoll_create1");
+		if (!(l[i].buf = malloc(EV_BUF_SIZE)))
+			ERR_EXIT("malloc");
+		if (pthread_create(&l[i].tid, NULL, ev_run, &l[i]))
+			ERR_EXIT("pthread_create");
+	}
+
+	printf("Waiting for clients on %u event loops\n", loops);
+
+	for (unsigned next = 0;; next = (next + 1) % loops) {
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+
+		const int soc = accept4(listen_soc, (struct sockaddr *)&addr,
+					&len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (soc < 0) {
+			PERROR("accept");
+			continue;
+		}
+		set_nodelay(soc);
+
+		ev_add(&l[next], soc, &addr);
+	}
+
+	return 0;
+}
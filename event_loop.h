@@ -0,0 +1,13 @@
+#pragma once
+
+#define MAX_EVENT_LOOPS 64
+
+/*
+ * accepts clients forever and spreads them over loops epoll threads,
+ * every session is a non-blocking state machine instead of a thread, so
+ * transfers are never asked about and the server has to run with --yes
+ * the loops only receive plain and batched transfers, striped ones and those
+ * with any other flag are handed to a thread of their own once their
+ * request is in
+ */
+int run_event_loops(int listen_soc, unsigned loops, const char *download_dir);
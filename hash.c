@@ -0,0 +1,389 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "hash.h"
+
+#define P1 0x9e3779b185ebca87ull
+#define P2 0xc2b2ae3d27d4eb4full
+#define P3 0x165667b19e3779f9ull
+#define P4 0x85ebca77c2b2ae63ull
+#define P5 0x27d4eb2f165667c5ull
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+	return x << r | x >> (64 - r);
+}
+
+/* the wire and the disk are little endian, so are the hashes */
+static inline uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t in)
+{
+	acc += in * P2;
+	acc = rotl(acc, 31);
+	return acc * P1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t v)
+{
+	acc ^= round64(0, v);
+	return acc * P1 + P4;
+}
+
+uint64_t hash64(const void *data, size_t len, uint64_t seed)
+{
+	const uint8_t *p = data;
+	const uint8_t *const end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + P1 + P2;
+		uint64_t v2 = seed + P2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - P1;
+
+		for (; p + 32 <= end; p += 32) {
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+		}
+
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	} else {
+		h = seed + P5;
+	}
+
+	h += len;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= round64(0, read64(p));
+		h = rotl(h, 27) * P1 + P4;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)read32(p) * P1;
+		h = rotl(h, 23) * P2 + P3;
+		p += 4;
+	}
+	for (; p < end; ++p) {
+		h ^= *p * P5;
+		h = rotl(h, 11) * P1;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+void rolling_init(rolling_t *r, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	*r = (rolling_t){ .len = len };
+	for (size_t i = 0; i < len; ++i) {
+		r->a += p[i];
+		r->b += (len - i) * p[i];
+	}
+	r->a &= 0xffff;
+	r->b &= 0xffff;
+}
+
+#define PRIME32_1 0x9e3779b1u
+#define PRIME32_2 0x85ebca77u
+#define PRIME32_3 0xc2b2ae3du
+
+/* stripes per block, the accumulators are scrambled after every block */
+#define DIGEST_BLOCK 16
+#define SECRET_WORDS (DIGEST_BLOCK + 8)
+
+/* stripe n is keyed with words n to n + 7, the scramble uses the last 8 */
+static uint64_t secret[SECRET_WORDS];
+
+typedef void (*accumulate_fn)(uint64_t *acc, const uint8_t *p, size_t stripes,
+			      size_t *nth);
+
+static void accumulate_scalar(uint64_t *acc, const uint8_t *p, size_t stripes,
+			      size_t *nth)
+{
+	for (size_t s = 0; s < stripes; ++s, p += DIGEST_STRIPE) {
+		const uint64_t *key = &secret[*nth];
+
+		for (int i = 0; i < 8; ++i) {
+			const uint64_t data = read64(p + 8 * i);
+			const uint64_t dk = data ^ key[i];
+
+			acc[i ^ 1] += data;
+			acc[i] += (dk & 0xffffffff) * (dk >> 32);
+		}
+
+		if (++*nth < DIGEST_BLOCK)
+			continue;
+
+		*nth = 0;
+		for (int i = 0; i < 8; ++i) {
+			acc[i] ^= acc[i] >> 47;
+			acc[i] ^= secret[DIGEST_BLOCK + i];
+			acc[i] *= PRIME32_1;
+		}
+	}
+}
+
+#if defined(__x86_64__)
+/* sse2 is part of x86_64, so this one needs no target attribute */
+static void accumulate_sse2(uint64_t *acc, const uint8_t *p, size_t stripes,
+			    size_t *nth)
+{
+	__m128i a[4];
+	for (int i = 0; i < 4; ++i)
+		a[i] = _mm_loadu_si128((const __m128i *)acc + i);
+
+	const __m128i prime = _mm_set1_epi32(PRIME32_1);
+
+	for (size_t s = 0; s < stripes; ++s, p += DIGEST_STRIPE) {
+		const __m128i *key = (const __m128i *)&secret[*nth];
+
+		for (int i = 0; i < 4; ++i) {
+			const __m128i data =
+				_mm_loadu_si128((const __m128i *)p + i);
+			const __m128i dk =
+				_mm_xor_si128(data, _mm_loadu_si128(key + i));
+			const __m128i product =
+				_mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+			const __m128i swapped = _mm_shuffle_epi32(
+				data, _MM_SHUFFLE(1, 0, 3, 2));
+
+			a[i] = _mm_add_epi64(a[i],
+					     _mm_add_epi64(product, swapped));
+		}
+
+		if (++*nth < DIGEST_BLOCK)
+			continue;
+
+		*nth = 0;
+		const __m128i *skey = (const __m128i *)&secret[DIGEST_BLOCK];
+		for (int i = 0; i < 4; ++i) {
+			__m128i v = _mm_xor_si128(a[i], _mm_srli_epi64(a[i], 47));
+			v = _mm_xor_si128(v, _mm_loadu_si128(skey + i));
+
+			const __m128i lo = _mm_mul_epu32(v, prime);
+			const __m128i hi =
+				_mm_mul_epu32(_mm_srli_epi64(v, 32), prime);
+			a[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+		}
+	}
+
+	for (int i = 0; i < 4; ++i)
+		_mm_storeu_si128((__m128i *)acc + i, a[i]);
+}
+
+__attribute__((target("avx2"))) static void
+accumulate_avx2(uint64_t *acc, const uint8_t *p, size_t stripes, size_t *nth)
+{
+	__m256i a[2];
+	for (int i = 0; i < 2; ++i)
+		a[i] = _mm256_loadu_si256((const __m256i *)acc + i);
+
+	const __m256i prime = _mm256_set1_epi32(PRIME32_1);
+
+	for (size_t s = 0; s < stripes; ++s, p += DIGEST_STRIPE) {
+		const __m256i *key = (const __m256i *)&secret[*nth];
+
+		for (int i = 0; i < 2; ++i) {
+			const __m256i data =
+				_mm256_loadu_si256((const __m256i *)p + i);
+			const __m256i dk = _mm256_xor_si256(
+				data, _mm256_loadu_si256(key + i));
+			const __m256i product =
+				_mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+			const __m256i swapped = _mm256_shuffle_epi32(
+				data, _MM_SHUFFLE(1, 0, 3, 2));
+
+			a[i] = _mm256_add_epi64(
+				a[i], _mm256_add_epi64(product, swapped));
+		}
+
+		if (++*nth < DIGEST_BLOCK)
+			continue;
+
+		*nth = 0;
+		const __m256i *skey = (const __m256i *)&secret[DIGEST_BLOCK];
+		for (int i = 0; i < 2; ++i) {
+			__m256i v = _mm256_xor_si256(a[i],
+						     _mm256_srli_epi64(a[i], 47));
+			v = _mm256_xor_si256(v, _mm256_loadu_si256(skey + i));
+
+			const __m256i lo = _mm256_mul_epu32(v, prime);
+			const __m256i hi =
+				_mm256_mul_epu32(_mm256_srli_epi64(v, 32), prime);
+			a[i] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+		}
+	}
+
+	for (int i = 0; i < 2; ++i)
+		_mm256_storeu_si256((__m256i *)acc + i, a[i]);
+}
+#endif
+
+static const accumulate_fn kernels[] = {
+	[hk_scalar] = accumulate_scalar,
+#if defined(__x86_64__)
+	[hk_sse2] = accumulate_sse2,
+	[hk_avx2] = accumulate_avx2,
+#endif
+};
+
+static pthread_once_t digest_once = PTHREAD_ONCE_INIT;
+static hash_kernel kernel = hk_scalar;
+
+static bool kernel_supported(hash_kernel k)
+{
+#if defined(__x86_64__)
+	if (k == hk_avx2)
+		return __builtin_cpu_supports("avx2");
+	return true;
+#else
+	return k == hk_scalar;
+#endif
+}
+
+static void digest_setup(void)
+{
+	/* splitmix64, any fixed sequence of well mixed words would do */
+	uint64_t x = 0;
+	for (int i = 0; i < SECRET_WORDS; ++i) {
+		uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		secret[i] = z ^ (z >> 31);
+	}
+
+	__builtin_cpu_init();
+	kernel = kernel_supported(hk_avx2) ? hk_avx2 :
+		 kernel_supported(hk_sse2) ? hk_sse2 :
+					     hk_scalar;
+}
+
+hash_kernel digest_kernel(void)
+{
+	pthread_once(&digest_once, digest_setup);
+	return kernel;
+}
+
+const char *get_kernel_name(hash_kernel k)
+{
+	static const char *const names[] = {
+		[hk_scalar] = "scalar",
+		[hk_sse2] = "sse2",
+		[hk_avx2] = "avx2",
+	};
+
+	return names[k];
+}
+
+int digest_use_kernel(hash_kernel k)
+{
+	pthread_once(&digest_once, digest_setup);
+	if (!kernel_supported(k))
+		return -1;
+
+	kernel = k;
+	return 0;
+}
+
+void digest_init(digest_t *digest)
+{
+	pthread_once(&digest_once, digest_setup);
+
+	*digest = (digest_t){
+		.acc = { PRIME32_3, P1, P2, P3, P4, PRIME32_2, P5, PRIME32_1 },
+	};
+}
+
+void digest_update(digest_t *digest, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	const accumulate_fn accumulate = kernels[kernel];
+
+	digest->len += len;
+
+	if (digest->buf_len) {
+		const size_t fill = DIGEST_STRIPE - digest->buf_len < len ?
+					    DIGEST_STRIPE - digest->buf_len :
+					    len;
+		memcpy(digest->buf + digest->buf_len, p, fill);
+		digest->buf_len += fill;
+		p += fill;
+		len -= fill;
+
+		if (digest->buf_len < DIGEST_STRIPE)
+			return;
+
+		accumulate(digest->acc, digest->buf, 1, &digest->nth);
+		digest->buf_len = 0;
+	}
+
+	const size_t stripes = len / DIGEST_STRIPE;
+	accumulate(digest->acc, p, stripes, &digest->nth);
+	p += stripes * DIGEST_STRIPE;
+	len -= stripes * DIGEST_STRIPE;
+
+	memcpy(digest->buf, p, len);
+	digest->buf_len = len;
+}
+
+static inline uint64_t fold64(uint64_t a, uint64_t b)
+{
+	const __uint128_t m = (__uint128_t)a * b;
+	return (uint64_t)m ^ (uint64_t)(m >> 64);
+}
+
+uint64_t digest_final(const digest_t *digest)
+{
+	uint64_t acc[8];
+	size_t nth = digest->nth;
+	memcpy(acc, digest->acc, sizeof(acc));
+
+	/* the zero padding is told apart by the length mixed in below */
+	if (digest->buf_len) {
+		uint8_t last[DIGEST_STRIPE] = { 0 };
+		memcpy(last, digest->buf, digest->buf_len);
+		kernels[kernel](acc, last, 1, &nth);
+	}
+
+	uint64_t h = digest->len * P1;
+	for (int i = 0; i < 4; ++i)
+		h += fold64(acc[2 * i] ^ secret[2 * i + 1],
+			    acc[2 * i + 1] ^ secret[2 * i + 2]);
+
+	h ^= h >> 37;
+	h *= 0x165667919e3779f9ull;
+	h ^= h >> 32;
+
+	return h;
+}
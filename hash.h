@@ -0,0 +1,55 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* XXH64, the strong hash of delta blocks */
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+
+/*
+ * streaming content digest in the style of XXH3's long input loop, eight 64
+ * bit lanes over 64 byte stripes, so it vectorises well
+ * every kernel gives the same digest, the best one the cpu has is picked
+ */
+typedef enum hash_kernel { hk_scalar, hk_sse2, hk_avx2 } hash_kernel;
+
+#define DIGEST_STRIPE 64
+
+typedef struct digest {
+	uint64_t acc[8];
+	/* stripe within the current block */
+	size_t nth;
+	uint64_t len;
+	size_t buf_len;
+	uint8_t buf[DIGEST_STRIPE];
+} digest_t;
+
+void digest_init(digest_t *digest);
+void digest_update(digest_t *digest, const void *data, size_t len);
+uint64_t digest_final(const digest_t *digest);
+
+hash_kernel digest_kernel(void);
+const char *get_kernel_name(hash_kernel kernel);
+/* returns -1 if the cpu lacks it, for testing and benchmarks */
+int digest_use_kernel(hash_kernel kernel);
+
+/*
+ * the rsync weak checksum of a window, two 16 bit sums packed together
+ * it can be rolled forward one byte at a time
+ */
+typedef struct rolling {
+	uint32_t a;
+	uint32_t b;
+	size_t len;
+} rolling_t;
+
+void rolling_init(rolling_t *r, const void *data, size_t len);
+/* moves the window one byte, out leaves it and in enters it */
+static inline void rolling_roll(rolling_t *r, uint8_t out, uint8_t in)
+{
+	r->a = (r->a - out + in) & 0xffff;
+	r->b = (r->b - r->len * out + r->a) & 0xffff;
+}
+static inline uint32_t rolling_digest(const rolling_t *r)
+{
+	return r->a | r->b << 16;
+}
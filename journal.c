@@ -0,0 +1,273 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "entry.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC 0x6c6e726a73662e00ull
+
+typedef struct journal_header {
+	uint64_t magic;
+	uint64_t key;
+	uint64_t len;
+} journal_header_t;
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= p[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/* the padding after the paths is not initialised, so only fields are hashed */
+static uint64_t entries_key(const stream_t *entries)
+{
+	uint64_t key = FNV_OFFSET;
+	stream_iter_t it;
+	stream_iter_init(&it, entries);
+	const entry_t *entry;
+
+	while ((entry = stream_iter_next(&it))) {
+		key = fnv1a(key, &entry->type, sizeof(entry->type));
+		key = fnv1a(key, &entry->permissions,
+			    sizeof(entry->permissions));
+		key = fnv1a(key, &entry->size, sizeof(entry->size));
+		key = fnv1a(key, &entry->mtime, sizeof(entry->mtime));
+		key = fnv1a(key, entry->rel_path, strlen(entry->rel_path) + 1);
+	}
+
+	return key;
+}
+
+static int read_journal(journal_t *journal, uint64_t key)
+{
+	journal_header_t header;
+	const size_t done_size = journal->len * sizeof(off_t);
+
+	if (pread(journal->fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    header.magic != JOURNAL_MAGIC || header.key != key ||
+	    header.len != journal->len)
+		return -1;
+
+	if (pread(journal->fd, journal->done, done_size, sizeof(header)) !=
+	    (ssize_t)done_size)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * files whose directory entries never reached the disk can be gone after a
+ * crash even though their data was synced
+ */
+static void check_journal(journal_t *journal, const char *dir,
+			  const stream_t *entries)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	stream_iter_t it;
+	stream_iter_init(&it, entries);
+	const entry_t *entry;
+
+	for (size_t i = 0; (entry = stream_iter_next(&it)); ++i) {
+		if (journal->done[i] == 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->rel_path);
+		if (stat(path, &st) < 0 || st.st_size < journal->done[i])
+			journal->done[i] = 0;
+	}
+}
+
+/*
+ * without a journal, files that are there in full already, e.g. from a
+ * transfer that completed before, are not sent again
+ * that transfer left them with the sender's mtime, so like a delta's quick
+ * check anything with another mtime is some other file and sent over it
+ */
+static void find_complete(journal_t *journal, const char *dir,
+			  const stream_t *entries)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	stream_iter_t it;
+	stream_iter_init(&it, entries);
+	const entry_t *entry;
+
+	for (size_t i = 0; (entry = stream_iter_next(&it)); ++i) {
+		if (entry->type != et_reg || entry->size == 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->rel_path);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+		    st.st_size == entry->size &&
+		    st.st_mtim.tv_sec == entry->mtime.tv_sec &&
+		    st.st_mtim.tv_nsec == entry->mtime.tv_nsec)
+			journal->done[i] = entry->size;
+	}
+}
+
+static int write_journal(journal_t *journal, uint64_t key)
+{
+	const journal_header_t header = {
+		.magic = JOURNAL_MAGIC,
+		.key = key,
+		.len = journal->len,
+	};
+	const size_t done_size = journal->len * sizeof(off_t);
+
+	if (pwrite(journal->fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    pwrite(journal->fd, journal->done, done_size, sizeof(header)) !=
+		    (ssize_t)done_size)
+		ERR_GOTO("pwrite");
+
+	if (fdatasync(journal->fd) < 0)
+		ERR_GOTO("fdatasync");
+
+	return 0;
+
+error:
+	return -1;
+}
+
+int open_journal(journal_t *journal, const char *dir,
+		 const stream_t *entries)
+{
+	const uint64_t key = entries_key(entries);
+
+	*journal = (journal_t){
+		.fd = -1,
+		.len = entries->metadata.len,
+		.done = calloc(entries->metadata.len, sizeof(off_t)),
+	};
+	if (journal->done == NULL) {
+		PERROR("calloc");
+		return -1;
+	}
+
+	snprintf(journal->path, sizeof(journal->path), "%s/.fs_journal-%016llx",
+		 dir, (unsigned long long)key);
+
+	if ((journal->fd = open(journal->path, O_RDWR | O_CREAT, 0600)) < 0)
+		ERR_GOTO("open");
+
+	if (read_journal(journal, key) == 0) {
+		check_journal(journal, dir, entries);
+		journal->resumed = true;
+		return 1;
+	}
+
+	/* a new transfer, or a journal that never got fully written */
+	memset(journal->done, 0, journal->len * sizeof(off_t));
+	find_complete(journal, dir, entries);
+	if (ftruncate(journal->fd, 0) < 0)
+		ERR_GOTO("ftruncate");
+	if (write_journal(journal, key) < 0)
+		goto error;
+
+	return 0;
+
+error:
+	close_journal(journal);
+
+	return -1;
+}
+
+int journal_flush(journal_t *journal)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < journal->pending_len; ++i) {
+		if (fdatasync(journal->pending[i].fd) < 0) {
+			PERROR("fdatasync");
+			ret = -1;
+		}
+		close(journal->pending[i].fd);
+	}
+
+	/*
+	 * nothing is checkpointed unless all of it made it to the disk
+	 * the checkpoints themselves are not synced, losing one only means
+	 * sending that data again
+	 */
+	for (size_t i = 0; ret == 0 && i < journal->pending_len; ++i) {
+		const journal_pending_t *p = &journal->pending[i];
+
+		journal->done[p->entry] = p->done;
+		if (pwrite(journal->fd, &p->done, sizeof(off_t),
+			   sizeof(journal_header_t) +
+				   p->entry * sizeof(off_t)) != sizeof(off_t)) {
+			PERROR("pwrite");
+			ret = -1;
+		}
+	}
+
+	journal->pending_len = 0;
+	journal->unsynced = 0;
+
+	return ret;
+}
+
+int journal_add(journal_t *journal, size_t entry, int fd, off_t done,
+		size_t written)
+{
+	journal_pending_t *p = &journal->pending[journal->pending_len];
+
+	*p = (journal_pending_t){
+		.fd = dup(fd),
+		.entry = entry,
+		.done = done,
+	};
+	if (p->fd < 0) {
+		PERROR("dup");
+		return -1;
+	}
+
+	journal->pending_len++;
+	journal->unsynced += written;
+
+	if (journal->pending_len == JOURNAL_PENDING ||
+	    journal->unsynced >= JOURNAL_SYNC_BYTES)
+		return journal_flush(journal);
+
+	return 0;
+}
+
+int finish_journal(journal_t *journal)
+{
+	if (journal_flush(journal) < 0)
+		return -1;
+
+	if (unlink(journal->path) < 0) {
+		PERROR("unlink");
+		return -1;
+	}
+
+	return 0;
+}
+
+void close_journal(journal_t *journal)
+{
+	for (size_t i = 0; i < journal->pending_len; ++i)
+		close(journal->pending[i].fd);
+
+	if (journal->fd >= 0)
+		close(journal->fd);
+	free(journal->done);
+
+	*journal = (journal_t){ .fd = -1 };
+}
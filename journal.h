@@ -0,0 +1,61 @@
+#pragma once
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "stream.h"
+
+/* data is synced and checkpointed at least this often */
+#define JOURNAL_SYNC_BYTES (64l << 20)
+/* finished files wait for a shared sync until there are this many */
+#define JOURNAL_PENDING 64
+
+/*
+ * remembers how much of every entry of a transfer has safely reached the
+ * disk, it lives next to the downloads and is keyed by a hash of the
+ * entries, so a retry of the same transfer finds it again
+ *
+ * a checkpoint is only written after the data it covers was synced, so the
+ * journal can lag behind the files but never runs ahead of them
+ */
+typedef struct journal_pending {
+	/* dup of the written file, closed once synced */
+	int fd;
+	size_t entry;
+	off_t done;
+} journal_pending_t;
+
+typedef struct journal {
+	int fd;
+	char path[PATH_MAX];
+	/* an earlier attempt of the same transfer was found */
+	bool resumed;
+
+	size_t len;
+	/* bytes of every entry that are known to be on the disk */
+	off_t *done;
+
+	size_t pending_len;
+	journal_pending_t pending[JOURNAL_PENDING];
+	size_t unsynced;
+} journal_t;
+
+/*
+ * returns 1 if an earlier attempt was found, 0 for a new one, -1 on error
+ * entries whose files are shorter than their checkpoint start over, without
+ * an earlier attempt files that exist with the entry's size count as done
+ */
+int open_journal(journal_t *journal, const char *dir,
+		 const stream_t *entries);
+/*
+ * records that the entry was written up to done through fd, written bytes of
+ * it are new since the last call, fd stays owned by the caller
+ */
+int journal_add(journal_t *journal, size_t entry, int fd, off_t done,
+		size_t written);
+/* syncs everything added so far and writes the checkpoints */
+int journal_flush(journal_t *journal);
+/* the transfer is complete, the journal is removed */
+int finish_journal(journal_t *journal);
+void close_journal(journal_t *journal);
@@ -0,0 +1,214 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+/* matches do not start this close to the end, so the 4 byte reads are safe */
+#define LZ_LAST_LITERALS 12
+/* every 32 misses in a row the search skips one more byte */
+#define LZ_SKIP_SHIFT 5
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+size_t lz_bound(size_t len)
+{
+	return len + len / 255 + 16;
+}
+
+static uint8_t *put_len(uint8_t *op, size_t len)
+{
+	for (len -= 15; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+/* token, both length extensions, literals and the offset */
+static inline size_t sequence_size(size_t lit, size_t match)
+{
+	return 1 + lit / 255 + 1 + lit + 2 + match / 255 + 1;
+}
+
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	/* stale entries point at the start, the byte compare rejects them */
+	memset(table, 0, sizeof(table));
+
+	const uint8_t *ip = src, *anchor = src;
+	const uint8_t *const end = src + len;
+	const uint8_t *const match_limit =
+		len > LZ_LAST_LITERALS ? end - LZ_LAST_LITERALS : src;
+	uint8_t *op = dst;
+	uint8_t *const op_end = dst + cap;
+	unsigned misses = 0;
+
+	while (ip < match_limit) {
+		const uint32_t v = read32(ip);
+		const uint32_t h = lz_hash(v);
+		const uint8_t *ref = src + table[h];
+		table[h] = ip - src;
+
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != v) {
+			ip += 1 + (misses++ >> LZ_SKIP_SHIFT);
+			continue;
+		}
+		misses = 0;
+
+		size_t match = LZ_MIN_MATCH;
+		while (ip + match + 8 <= end) {
+			const uint64_t diff =
+				read64(ip + match) ^ read64(ref + match);
+			if (diff) {
+				match += __builtin_ctzll(diff) / 8;
+				goto matched;
+			}
+			match += 8;
+		}
+		while (ip + match < end && ref[match] == ip[match])
+			++match;
+matched:;
+
+		const size_t lit = ip - anchor;
+		if (sequence_size(lit, match) > (size_t)(op_end - op))
+			return 0;
+
+		const size_t mcode = match - LZ_MIN_MATCH;
+		uint8_t *token = op++;
+		*token = (lit >= 15 ? 15 : lit) << 4 | (mcode >= 15 ? 15 : mcode);
+		if (lit >= 15)
+			op = put_len(op, lit);
+		memcpy(op, anchor, lit);
+		op += lit;
+
+		const size_t offset = ip - ref;
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		if (mcode >= 15)
+			op = put_len(op, mcode);
+
+		ip += match;
+		anchor = ip;
+	}
+
+	const size_t lit = end - anchor;
+	if (sequence_size(lit, 0) > (size_t)(op_end - op))
+		return 0;
+
+	*op++ = (lit >= 15 ? 15 : lit) << 4;
+	if (lit >= 15)
+		op = put_len(op, lit);
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return op - dst;
+}
+
+static int get_len(const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= end)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+/*
+ * copies in 8 byte steps, writing up to 7 bytes past the match while there
+ * is room for it, an overlapping match repeats the last offset bytes, so once
+ * 8 of them are out it can continue from a whole number of periods back
+ */
+static inline void copy_match(uint8_t *op, const uint8_t *ref, size_t offset,
+			      size_t match, const uint8_t *op_end)
+{
+	uint8_t *const end = op + match;
+
+	if (offset < 8 && match >= 8) {
+		for (size_t i = 0; i < 8; ++i)
+			op[i] = ref[i];
+		op += 8;
+		ref = op - offset * ((8 + offset - 1) / offset);
+	}
+
+	if (op - ref >= 8) {
+		for (; op < end && op_end - op >= 8; op += 8, ref += 8)
+			memcpy(op, ref, 8);
+	}
+
+	while (op < end)
+		*op++ = *ref++;
+}
+
+ssize_t lz_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+		      size_t cap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *const end = src + len;
+	uint8_t *op = dst;
+	uint8_t *const op_end = dst + cap;
+
+	while (ip < end) {
+		const uint8_t token = *ip++;
+
+		size_t lit = token >> 4;
+		if (lit == 15 && get_len(&ip, end, &lit) < 0)
+			return -1;
+		if (lit > (size_t)(end - ip) || lit > (size_t)(op_end - op))
+			return -1;
+
+		if (lit <= 16 && end - ip >= 16 && op_end - op >= 16)
+			memcpy(op, ip, 16);
+		else
+			memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+
+		/* the last sequence has no match */
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return -1;
+		const size_t offset = ip[0] | ip[1] << 8;
+		ip += 2;
+
+		size_t match = token & 15;
+		if (match == 15 && get_len(&ip, end, &match) < 0)
+			return -1;
+		match += LZ_MIN_MATCH;
+
+		if (offset == 0 || offset > (size_t)(op - dst) ||
+		    match > (size_t)(op_end - op))
+			return -1;
+
+		copy_match(op, op - offset, offset, match, op_end);
+		op += match;
+	}
+
+	return op - dst;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * a byte oriented LZ77 codec in the style of LZ4, every block stands on its
+ * own, so blocks can be compressed on different threads
+ *
+ * a block is a run of sequences: a token with the literal length in the high
+ * nibble and the match length - 4 in the low one (15 means more length bytes
+ * follow, each adding up to 255), the literals, and a little endian 16 bit
+ * offset, the last sequence stops after its literals
+ */
+#define LZ_MIN_MATCH 4
+
+size_t lz_bound(size_t len);
+/* returns 0 if the result would not fit into cap */
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+/* returns the decompressed length or -1 for a malformed block */
+ssize_t lz_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+		      size_t cap);
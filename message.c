@@ -4,9 +4,42 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "batch.h"
 #include "core.h"
 #include "entry.h"
 #include "message.h"
+#include "stripe.h"
+
+/* the client options behind every transfer flag, by bit */
+static const char *const flag_names[] = {
+	"--batch", "--pipeline", "--resume", "--delta", "--verify",
+	"--dedup", "--compress", "--sparse", "compact entries",
+};
+
+/* striping only splits plain file data */
+#define STRIPE_CONFLICTS                                              \
+	(tf_streaming | tf_resume | tf_delta | tf_verify | tf_dedup | \
+	 tf_compress | tf_sparse)
+
+/* none of the flags of a may be set together with one of b */
+static const struct {
+	uint32_t a, b;
+} conflicts[] = {
+	{ tf_streaming, tf_verify },
+	{ tf_compress | tf_sparse, tf_resume | tf_delta | tf_dedup },
+	{ tf_compress, tf_sparse },
+	/* those receive every file their own way, batch frames would desync */
+	{ tf_batch, tf_resume | tf_delta | tf_dedup },
+};
+
+static const char *flag_name(uint32_t flags)
+{
+	const unsigned bit = __builtin_ctz(flags);
+
+	return bit < sizeof(flag_names) / sizeof(flag_names[0]) ?
+		       flag_names[bit] :
+		       "an unknown flag";
+}
 
 peer_info_t *create_pinfo_message(header_t *header)
 {
@@ -36,7 +69,7 @@ request_data_t *create_request_message(const entries_t *restrict entries,
 				       header_t *restrict header)
 {
 	const char *root_dir_basename =
-		((entry_t *)entries->entries.data)[0].rel_path;
+		((entry_t *)stream_get(&entries->entries, 0))->rel_path;
 	const size_t filename_size = strlen(root_dir_basename) + 1;
 
 	const size_t req_size = sizeof(request_data_t) + filename_size;
@@ -52,7 +85,8 @@ request_data_t *create_request_message(const entries_t *restrict entries,
 
 	*data = (request_data_t){
 		.total_file_size = entries->total_file_size,
-		.entry_type = ((entry_t *)entries->entries.data)[0].type,
+		.entry_type = ((entry_t *)stream_get(&entries->entries, 0))->type,
+		.streams = 1,
 		.filename_size = filename_size,
 	};
 	memcpy(data->filename, root_dir_basename, filename_size);
@@ -60,17 +94,83 @@ request_data_t *create_request_message(const entries_t *restrict entries,
 	return data;
 }
 
-int send_msg(int soc, header_t *h, void *data)
+int check_request(const request_data_t *req, size_t data_size, char *why,
+		  size_t why_len)
 {
-	if (perf_soc_op(soc, op_write, h, sizeof(header_t), NULL) < 0)
+	if (data_size < sizeof(request_data_t) || req->filename_size == 0 ||
+	    req->filename_size > data_size - sizeof(request_data_t) ||
+	    req->filename[req->filename_size - 1] != '\0') {
+		snprintf(why, why_len, "malformed request");
 		return -1;
+	}
 
-	if (perf_soc_op(soc, op_write, data, h->data_size, NULL) < 0)
+	if (req->total_file_size < 0) {
+		snprintf(why, why_len, "a negative total size");
 		return -1;
+	}
+
+	/* frames are buffered whole, the threshold bounds how big they get */
+	if (req->batch_threshold > BATCH_FRAME_SIZE) {
+		snprintf(why, why_len, "a batch threshold of %u, at most %d",
+			 req->batch_threshold, BATCH_FRAME_SIZE);
+		return -1;
+	}
+
+	if (req->streams < 1 || req->streams > MAX_STREAMS) {
+		snprintf(why, why_len, "%u streams, it has to be 1 to %d",
+			 req->streams, MAX_STREAMS);
+		return -1;
+	}
+
+	if (req->flags & ~TF_KNOWN) {
+		snprintf(why, why_len, "unknown flags 0x%x",
+			 req->flags & ~TF_KNOWN);
+		return -1;
+	}
+
+	if (req->streams > 1 && req->flags & STRIPE_CONFLICTS) {
+		snprintf(why, why_len, "--streams cannot be combined with %s",
+			 flag_name(req->flags & STRIPE_CONFLICTS));
+		return -1;
+	}
+
+	for (size_t i = 0; i < sizeof(conflicts) / sizeof(conflicts[0]); ++i) {
+		if (req->flags & conflicts[i].a && req->flags & conflicts[i].b) {
+			snprintf(why, why_len, "%s cannot be combined with %s",
+				 flag_name(req->flags & conflicts[i].a),
+				 flag_name(req->flags & conflicts[i].b));
+			return -1;
+		}
+	}
 
 	return 0;
 }
 
+int send_msg(int soc, header_t *h, void *data)
+{
+	frame_writer_t w;
+	frame_init(&w, soc);
+
+	if (frame_put(&w, h, sizeof(header_t)) < 0 ||
+	    frame_put(&w, data, h->data_size) < 0)
+		return -1;
+
+	return frame_flush(&w);
+}
+
+int send_nack(int soc, const char *why)
+{
+	header_t h = {
+		.type = mt_nack,
+		.data_size = why ? strnlen(why, MAX_NACK_SIZE - 1) + 1 : 0,
+	};
+	char buf[MAX_NACK_SIZE];
+	if (why)
+		snprintf(buf, sizeof(buf), "%s", why);
+
+	return send_msg(soc, &h, buf);
+}
+
 int receive_msg(int soc, header_t *restrict h, void *restrict *data)
 {
 	if (perf_soc_op(soc, op_read, h, sizeof(header_t), NULL) < 0)
@@ -1,5 +1,6 @@
 #pragma once
 #include <linux/limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>
 
@@ -9,7 +10,18 @@ typedef enum __attribute__((__packed__)) message_type {
 	mt_pinfo,
 	mt_req,
 	mt_ack,
+	/* may carry a null terminated reason of up to MAX_NACK_SIZE bytes */
 	mt_nack,
+	mt_session,
+	mt_join,
+	mt_busy,
+	mt_chunk,
+	mt_resume,
+	mt_signature,
+	mt_digests,
+	mt_mismatches,
+	mt_chunk_list,
+	mt_missing,
 } message_type;
 
 static const char default_user_name[] = "(???)";
@@ -25,20 +37,103 @@ typedef struct peer_info {
 	char username[];
 } peer_info_t;
 
+typedef enum transfer_flags {
+	/* small files are packed into batch frames, see batch.h */
+	tf_batch = 1 << 0,
+	/*
+	 * the entries are sent in chunks while the client is still scanning,
+	 * see mt_chunk below, total_file_size is unknown and left at 0
+	 */
+	tf_streaming = 1 << 1,
+	/*
+	 * the receiver answers the metadata with mt_resume instead of an ack,
+	 * its data is an off_t per entry with the bytes it already has, and
+	 * only the rest of every file is sent
+	 */
+	tf_resume = 1 << 2,
+	/* only the differences to the receiver's files are sent, see delta.h */
+	tf_delta = 1 << 3,
+	/*
+	 * both sides hash every file, after the data the sender sends its
+	 * digests (mt_digests, a uint64_t per entry) and the receiver answers
+	 * with the uint32_t indices of the entries that differ (mt_mismatches)
+	 */
+	tf_verify = 1 << 4,
+	/* files are sent as content defined chunks the receiver lacks, see cdc.h */
+	tf_dedup = 1 << 5,
+	/* entries that are not batched are framed by compress.h */
+	tf_compress = 1 << 6,
+	/* entries that are not batched are sent as extents, see sparse.h */
+	tf_sparse = 1 << 7,
+	/* the entries are encoded by compact.h instead of send_stream */
+	tf_compact = 1 << 8,
+} transfer_flags;
+
+/* every flag above, requests with any other are refused */
+#define TF_KNOWN ((tf_compact << 1) - 1)
+
 typedef struct request_data {
 	off_t total_file_size;
 	entry_type entry_type;
+	/* number of data connections, 1 unless striping */
+	uint32_t streams;
+	/* transfer_flags */
+	uint32_t flags;
+	/* files smaller than this are batched if tf_batch is set */
+	uint32_t batch_threshold;
 
 	/* includes the null byte */
 	size_t filename_size;
 	char filename[];
 } request_data_t;
 
+#define MAX_NACK_SIZE 256
+
+/* a request with a filename of PATH_MAX bytes */
+#define MAX_REQUEST_SIZE (sizeof(request_data_t) + PATH_MAX)
+
+/* sent instead of the final metadata ack when striping */
+typedef struct session_data {
+	uint64_t session_id;
+} session_data_t;
+
+/* opens one of the extra data connections of a striped session */
+typedef struct join_data {
+	uint64_t session_id;
+	uint32_t stream;
+} join_data_t;
+
+/*
+ * sent instead of an ack when the server is saturated, the client may try
+ * again after retry_after seconds
+ */
+typedef struct busy_data {
+	uint32_t retry_after;
+} busy_data_t;
+
+/*
+ * a header of type mt_chunk precedes every chunk of a streamed transfer
+ * data_size is the number of entries in the stream that follows, the chunk's
+ * file data comes right after the stream, and a data_size of 0 ends the
+ * transfer
+ */
+
 peer_info_t *create_pinfo_message(header_t *header);
 
 request_data_t *create_request_message(const entries_t *restrict entries,
 				       header_t *restrict header);
 
+/*
+ * checks that the request of data_size bytes holds its whole filename, that
+ * its size is not negative, its batch threshold is one the client could ask
+ * for and that its flags are known and go together with its streams, if not
+ * why says what is wrong
+ */
+int check_request(const request_data_t *req, size_t data_size, char *why,
+		  size_t why_len);
+
 int send_msg(int soc, header_t *h, void *data);
+/* why is sent along if it is not NULL */
+int send_nack(int soc, const char *why);
 /* data must be either NULL or ptr to malloced memory */
 int receive_msg(int soc, header_t *restrict h, void *restrict *data);
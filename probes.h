@@ -0,0 +1,83 @@
+#pragma once
+
+/*
+ * static probes of the provider file_sharer, for perf, bpftrace or
+ * systemtap to attach to a running process
+ * with <sys/sdt.h> every probe is a nop and an ELF note, without it they
+ * compile to nothing and their arguments are never evaluated
+ *
+ *	soc_op__start(soc, op, len)
+ *	soc_op__done(soc, op, len, ret)
+ *	soc_wait(soc, op, ns)
+ *	file_op__start(soc, op, fd, offset, len)
+ *	file_op__done(soc, op, fd, len, ret)
+ *	entry__open(path, size, op, fd)
+ *	entry__close(fd, size)
+ *	stream__add(len, size, item_size)
+ *	stream__send__start(soc, len, size)
+ *	stream__send__done(soc, len, size, ret)
+ *	stream__recv__start(soc)
+ *	stream__recv__done(soc, len, size, ret)
+ *	session__start(id, peer)
+ *	session__phase(id, from, to, ns)
+ *	session__done(id, ok)
+ *	ev__state(soc, from, to)
+ *	zerocopy__done(soc, len, sends, copied)
+ *
+ * op is 0 for reading and 1 for writing, ns is how long the wait or the
+ * phase that ended took, from and to are the same for the last phase of a
+ * session, copied is set if the kernel copied the data after all, everything
+ * else is timed between a start and its done, e.g.
+ *
+ *	bpftrace -e 'usdt:./server:file_sharer:soc_op__start
+ *			{ @t[tid] = nsecs; }
+ *		usdt:./server:file_sharer:soc_op__done /@t[tid]/
+ *			{ @us = hist((nsecs - @t[tid]) / 1000); delete(@t[tid]); }'
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SDT
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(file_sharer, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(file_sharer, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(file_sharer, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(file_sharer, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) \
+	DTRACE_PROBE5(file_sharer, name, a, b, c, d, e)
+#else
+/*
+ * sizeof keeps the arguments type checked and used, but not evaluated, + 0
+ * turns arrays into pointers like passing them to a probe would
+ */
+#define PROBE_ARG(a) ((void)sizeof((a) + 0))
+#define PROBE1(name, a)       \
+	do {                  \
+		PROBE_ARG(a); \
+	} while (0)
+#define PROBE2(name, a, b)    \
+	do {                  \
+		PROBE_ARG(a); \
+		PROBE_ARG(b); \
+	} while (0)
+#define PROBE3(name, a, b, c)       \
+	do {                        \
+		PROBE2(name, a, b); \
+		PROBE_ARG(c);       \
+	} while (0)
+#define PROBE4(name, a, b, c, d)    \
+	do {                        \
+		PROBE2(name, a, b); \
+		PROBE2(name, c, d); \
+	} while (0)
+#define PROBE5(name, a, b, c, d, e)    \
+	do {                           \
+		PROBE3(name, a, b, c); \
+		PROBE2(name, d, e);    \
+	} while (0)
+#endif
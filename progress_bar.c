@@ -1,8 +1,10 @@
-#include <bits/time.h>
-#include <fcntl.h>
+#define _GNU_SOURCE
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <time.h>
@@ -10,111 +12,310 @@
 
 #include "core.h"
 #include "progress_bar.h"
+#include "stats.h"
 
-size_info calculate_speed(const progress_bar_t *const bar, const size_t curr,
-			  const struct timespec dtt)
+/* redraws per second */
+#define REPORT_HZ 4
+/* seconds after which the rate has mostly forgotten a sample */
+#define RATE_WINDOW 2.0
+#define LINE_LEN 512
+
+#define ADD(counter, n) \
+	atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
+#define SUB(counter, n) \
+	atomic_fetch_sub_explicit(&(counter), (n), memory_order_relaxed)
+#define LOAD(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+#define STORE(counter, n) \
+	atomic_store_explicit(&(counter), (n), memory_order_relaxed)
+
+/* of every transfer since the last time none was running */
+static atomic_uint_fast64_t total_bytes;
+static atomic_uint_fast64_t done_bytes;
+static atomic_uint_fast64_t total_files;
+static atomic_uint_fast64_t done_files;
+static atomic_int_fast64_t start_ns;
+
+static atomic_uint active;
+static atomic_uint begun;
+/* taken to reset the counters and to end the line they are drawn on */
+static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* everything but stop is only touched by the reporter thread */
+static struct reporter {
+	const char *title;
+	pthread_t tid;
+	bool running;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	bool stop;
+
+	/* a line is on the screen and has not been ended */
+	bool open;
+	/* what begun was when the last line was ended */
+	unsigned ended;
+	uint64_t last_done;
+	int64_t last_ns;
+	/* bytes per second, negative until the first sample */
+	double rate;
+} reporter = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void progress_begin(off_t bytes, size_t files)
 {
-	const double dt = dtt.tv_sec + dtt.tv_nsec * 1.0e-9;
+	pthread_mutex_lock(&counters_lock);
+	if (LOAD(active) == 0) {
+		STORE(total_bytes, 0);
+		STORE(done_bytes, 0);
+		STORE(total_files, 0);
+		STORE(done_files, 0);
+		STORE(start_ns, stats_now_ns());
+	}
+	ADD(active, 1);
+	ADD(begun, 1);
+	pthread_mutex_unlock(&counters_lock);
 
-	if (dtt.tv_sec == 0 && dtt.tv_nsec <= 1)
-		return (size_info){ 0 };
+	progress_expect(bytes, files);
+}
 
-	const size_t d_size = curr - bar->last_val;
+void progress_expect(off_t bytes, size_t files)
+{
+	ADD(total_bytes, bytes);
+	ADD(total_files, files);
+}
 
-	return bytes_to_size(round(d_size / dt));
+void progress_end(void)
+{
+	SUB(active, 1);
 }
 
-int print_bar(const progress_bar_t *const bar, const size_t curr,
-	      const size_info speed)
+void progress_add(size_t bytes, size_t files)
 {
-	struct winsize w;
-	ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+	if (bytes)
+		ADD(done_bytes, bytes);
+	if (files)
+		ADD(done_files, files);
+}
 
-	const size_t static_len = bar->title_len + 2 + 2 + 9 + 13;
-	if (w.ws_col < static_len)
-		return -1;
+void prog_bar_init(progress_bar_t *bar, size_t max, size_t files)
+{
+	*bar = (progress_bar_t){
+		.max_val = max,
+		.files = files,
+	};
+}
 
-	const size_t bar_len = w.ws_col - static_len;
+void prog_bar_advance(progress_bar_t *bar, size_t curr_val)
+{
+	if (curr_val <= bar->last_val)
+		return;
 
-	const double state = (double)curr / bar->max_val;
-	const unsigned done = round(state * bar_len);
+	progress_add(curr_val - bar->last_val, 0);
+	bar->last_val = curr_val;
+}
 
-	for (unsigned i = 0; i < w.ws_col; ++i) {
-		putchar('\b');
+void prog_bar_finish(progress_bar_t *bar)
+{
+	prog_bar_advance(bar, bar->max_val);
+	progress_add(0, bar->files);
+	bar->files = 0;
+}
+
+static void format_duration(char *buf, size_t len, double secs)
+{
+	const unsigned long s = secs < 0 ? 0 : (unsigned long)secs;
+
+	snprintf(buf, len, "%lu:%02lu:%02lu", s / 3600, s / 60 % 60, s % 60);
+}
+
+static void update_rate(uint64_t done, int64_t now)
+{
+	if (!reporter.open || done < reporter.last_done) {
+		/* a new line, the counters were reset when it began */
+		reporter.last_done = 0;
+		reporter.last_ns = LOAD(start_ns);
+		reporter.rate = -1;
 	}
 
-	printf("%s: [", bar->title);
+	const double dt = (now - reporter.last_ns) * 1.0e-9;
+	if (dt <= 0)
+		return;
+
+	const double rate = (done - reporter.last_done) / dt;
+	if (reporter.rate < 0)
+		reporter.rate = rate;
+	else
+		reporter.rate +=
+			(1.0 - exp(-dt / RATE_WINDOW)) * (rate - reporter.rate);
+
+	reporter.last_done = done;
+	reporter.last_ns = now;
+}
+
+static unsigned terminal_width(void)
+{
+	struct winsize w;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) < 0 || w.ws_col == 0)
+		return 80;
 
-	size_t i = 0;
+	return w.ws_col < LINE_LEN ? w.ws_col : LINE_LEN - 1;
+}
+
+/* the last line shows the average rate and how long it all took */
+static void draw(int64_t now, bool end)
+{
+	const uint64_t done = LOAD(done_bytes);
+	const uint64_t total = LOAD(total_bytes);
+	const uint64_t fdone = LOAD(done_files);
+	const uint64_t ftotal = LOAD(total_files);
 
-	for (; i < done; ++i) {
-		putchar('#');
+	update_rate(done, now);
+
+	const double elapsed = (now - LOAD(start_ns)) * 1.0e-9;
+	double state = total ? (double)done / total :
+		       ftotal ? (double)fdone / ftotal :
+		       end    ? 1.0 :
+				0.0;
+	if (state > 1.0)
+		state = 1.0;
+
+	char when[32];
+	double rate = reporter.rate < 0 ? 0 : reporter.rate;
+	if (end) {
+		rate = elapsed > 0 ? done / elapsed : 0;
+		format_duration(when, sizeof(when), elapsed);
+	} else if (rate > 0 && total > done) {
+		format_duration(when, sizeof(when), (total - done) / rate);
+	} else {
+		strcpy(when, "-:--:--");
 	}
-	for (; i < bar_len; ++i) {
-		putchar(' ');
+
+	const size_info d = bytes_to_size(done);
+	const size_info t = bytes_to_size(total);
+	const size_info r = bytes_to_size(round(rate));
+
+	char tail[LINE_LEN];
+	const int tail_len = snprintf(
+		tail, sizeof(tail),
+		"] %5.1lf%%  %.1lf %s / %.1lf %s  %ju/%ju files  %.1lf %s/s  "
+		"%s %s",
+		state * 100.0, d.size, unit(d), t.size, unit(t),
+		(uintmax_t)fdone, (uintmax_t)ftotal, r.size, unit(r),
+		end ? "in" : "ETA", when);
+
+	const unsigned width = terminal_width();
+	const int head_len = strlen(reporter.title) + 3;
+	const int bar_len = (int)width - head_len - tail_len;
+
+	char line[LINE_LEN];
+	int len = snprintf(line, sizeof(line), "%s: ", reporter.title);
+	if (bar_len < 10) {
+		/* too narrow for a bar, the numbers are what matters */
+		snprintf(line + len, sizeof(line) - len, "%s", tail + 2);
+	} else {
+		const int filled = round(state * bar_len);
+
+		line[len++] = '[';
+		memset(line + len, '#', filled);
+		memset(line + len + filled, ' ', bar_len - filled);
+		len += bar_len;
+		snprintf(line + len, sizeof(line) - len, "%s", tail);
 	}
-	printf("] %5.1lf%% %6.1lf %3s/s", state * 100.0, speed.size,
-	       unit(speed));
 
+	flockfile(stdout);
+	printf("\r%s\033[K%s", line, end ? "\n" : "");
 	fflush(stdout);
-	return 0;
-}
+	funlockfile(stdout);
 
-void prog_bar_init(progress_bar_t *bar, const char *const title,
-		   const size_t max, const struct timespec minimum_dt)
-{
-	*bar = (progress_bar_t){
-		.title = title,
-		.title_len = strlen(title),
-		.max_val = max,
-		.minimum_dt = minimum_dt,
-	};
+	reporter.open = !end;
 }
 
-int prog_bar_start(progress_bar_t *prog)
+static void tick(bool last)
 {
-	struct timespec ts;
-	if (clock_gettime(CLOCK_REALTIME, &ts) < 0) {
-		perror("gettime");
-		exit(1);
+	const int64_t now = stats_now_ns();
+
+	if (!last && LOAD(active) > 0) {
+		draw(now, false);
+		return;
 	}
-	prog->prev_ts = ts;
-	return print_bar(prog, 0, (size_info){ 0 });
+
+	/* a transfer may have come and gone between two ticks */
+	pthread_mutex_lock(&counters_lock);
+	if ((last || LOAD(active) == 0) &&
+	    (reporter.open || LOAD(begun) != reporter.ended)) {
+		draw(now, true);
+		reporter.ended = LOAD(begun);
+	}
+	pthread_mutex_unlock(&counters_lock);
 }
 
-int prog_bar_advance(progress_bar_t *prog, const size_t curr_val)
+static void *report(void *arg)
 {
-	struct timespec ts;
-	if (clock_gettime(CLOCK_REALTIME, &ts) < 0) {
-		perror("gettime");
-		exit(1);
+	(void)arg;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	pthread_mutex_lock(&reporter.lock);
+	while (!reporter.stop) {
+		next.tv_nsec += 1000000000 / REPORT_HZ;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+
+		while (!reporter.stop &&
+		       pthread_cond_timedwait(&reporter.wake, &reporter.lock,
+					      &next) == 0)
+			;
+		if (reporter.stop)
+			break;
+
+		pthread_mutex_unlock(&reporter.lock);
+		tick(false);
+		pthread_mutex_lock(&reporter.lock);
 	}
+	pthread_mutex_unlock(&reporter.lock);
 
-	const struct timespec dt = {
-		.tv_sec = ts.tv_sec - prog->prev_ts.tv_sec,
-		.tv_nsec = ts.tv_nsec - prog->prev_ts.tv_nsec,
-	};
+	tick(true);
 
-	if (dt.tv_sec <= prog->minimum_dt.tv_sec &&
-	    dt.tv_nsec < prog->minimum_dt.tv_nsec) {
+	return NULL;
+}
+
+int progress_start_reporter(const char *title)
+{
+	if (!isatty(STDOUT_FILENO))
 		return 0;
-	}
 
-	if (print_bar(prog, curr_val, calculate_speed(prog, curr_val, dt)) < 0)
-		return -1;
+	reporter.title = title;
 
-	prog->prev_ts = ts;
-	prog->last_val = curr_val;
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&reporter.wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&reporter.tid, NULL, report, NULL)) {
+		PERROR("pthread_create");
+		pthread_cond_destroy(&reporter.wake);
+		return -1;
+	}
+	reporter.running = true;
 
 	return 0;
 }
 
-int prog_bar_finish(progress_bar_t *prog)
+void progress_stop_reporter(void)
 {
-	const struct timespec old = prog->minimum_dt;
-	prog->minimum_dt = (struct timespec){ 0 };
-	prog_bar_advance(prog, prog->max_val);
-	prog->minimum_dt = old;
+	if (!reporter.running)
+		return;
+
+	pthread_mutex_lock(&reporter.lock);
+	reporter.stop = true;
+	pthread_cond_signal(&reporter.wake);
+	pthread_mutex_unlock(&reporter.lock);
 
-	return putchar('\n');
+	pthread_join(reporter.tid, NULL);
+	pthread_cond_destroy(&reporter.wake);
+	reporter.running = false;
 }
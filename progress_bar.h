@@ -1,18 +1,36 @@
 #pragma once
+#include <stddef.h>
 #include <sys/types.h>
 
+/*
+ * progress of everything the process transfers, the transfers only add to
+ * atomic counters and a reporter thread draws them as one line
+ */
+
+/* draws only if stdout is a terminal, title goes in front of the line */
+int progress_start_reporter(const char *title);
+/* draws the last line of whatever is still on the screen */
+void progress_stop_reporter(void);
+
+/*
+ * a transfer of bytes in files, both may grow with progress_expect while it
+ * runs, the line is ended once no transfer is left
+ */
+void progress_begin(off_t bytes, size_t files);
+void progress_expect(off_t bytes, size_t files);
+void progress_end(void);
+/* what is done, cheap enough to call for every chunk */
+void progress_add(size_t bytes, size_t files);
+
+/* progress of one file, or of all files of a batched engine */
 typedef struct progress_bar {
-	const char *title;
-	size_t title_len;
 	size_t max_val;
-	struct timespec minimum_dt;
-
 	size_t last_val;
-	struct timespec prev_ts;
+	/* counted as done when the bar finishes */
+	size_t files;
 } progress_bar_t;
 
-void prog_bar_init(progress_bar_t *bar, const char *const title,
-		   const size_t max, const struct timespec minimum_dt);
-int prog_bar_start(progress_bar_t *prog);
-int prog_bar_advance(progress_bar_t *prog, const size_t curr_val);
-int prog_bar_finish(progress_bar_t *bar);
+void prog_bar_init(progress_bar_t *bar, size_t max, size_t files);
+void prog_bar_advance(progress_bar_t *bar, size_t curr_val);
+/* whatever is left of max counts as done, a second finish does nothing */
+void prog_bar_finish(progress_bar_t *bar);
@@ -13,22 +13,61 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "batch.h"
+#include "compact.h"
+#include "compress.h"
 #include "core.h"
+#include "delta.h"
 #include "entry.h"
+#include "event_loop.h"
+#include "journal.h"
 #include "message.h"
 #include "progress_bar.h"
+#include "server.h"
+#include "sparse.h"
+#include "stats.h"
+#include "store.h"
+#include "stripe.h"
+#include "transfer.h"
+#include "verify.h"
 
 typedef struct {
 	int parsed;
 	char *const downloads_dir;
 	in_port_t port;
+	transfer_engine engine;
+	bool accept_all;
+	/* 0 runs a thread per client */
+	unsigned event_loops;
+	/* 0 runs a thread per client */
+	unsigned workers;
+	unsigned queue_len;
+	off_t max_inflight;
+	bool print_stats;
+	const char *stats_socket;
 } args;
 
+/* keys of the options without a short one */
+enum { OPT_STATS = 0x100, OPT_STATS_SOCKET };
+
+static char *downloads_dir;
+static transfer_engine default_engine;
+static bool accept_all = false;
+/* a json summary of every session when it ends */
+static bool print_stats = false;
+
+/* bytes of the transfers that are accepted and not finished yet */
+static pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+static off_t inflight_bytes = 0;
+/* 0 is unlimited */
+static off_t max_inflight_bytes = 0;
+
 bool check_directory_exists(char path[PATH_MAX])
 {
 	DIR *dir = opendir(path);
@@ -43,6 +82,41 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
 	args *a = state->input;
 	switch (key) {
+	case 'e':
+		if (parse_engine(arg, op_read, &a->engine) < 0)
+			argp_usage(state);
+		break;
+	case 'y':
+		a->accept_all = true;
+		break;
+	case 'l':
+		a->event_loops = atoi(arg);
+		if (a->event_loops < 1 || a->event_loops > MAX_EVENT_LOOPS) {
+			fprintf(stderr,
+				"event loops must be between 1 and %d\n",
+				MAX_EVENT_LOOPS);
+			argp_usage(state);
+		}
+		break;
+	case 'w':
+		a->workers = atoi(arg);
+		if (a->workers < 1) {
+			fprintf(stderr, "there has to be at least one worker\n");
+			argp_usage(state);
+		}
+		break;
+	case 'q':
+		a->queue_len = atoi(arg);
+		break;
+	case 'm':
+		a->max_inflight = strtoll(arg, NULL, 10);
+		break;
+	case OPT_STATS:
+		a->print_stats = true;
+		break;
+	case OPT_STATS_SOCKET:
+		a->stats_socket = arg;
+		break;
 	case ARGP_KEY_ARG:
 		switch (a->parsed++) {
 		case 0:
@@ -64,6 +138,11 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 	case ARGP_KEY_END:
 		if (a->parsed < 2)
 			argp_usage(state);
+		/* a loop waiting for an answer would stall all of its clients */
+		if (a->event_loops && !a->accept_all) {
+			fprintf(stderr, "event loops only run with --yes\n");
+			argp_usage(state);
+		}
 		break;
 	default:
 		return ARGP_ERR_UNKNOWN;
@@ -71,36 +150,201 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 	return 0;
 }
 
-void read_args(int argc, char *argv[], uint16_t *port,
-	       char downloads_directory[PATH_MAX])
+void read_args(int argc, char *argv[], args *a)
 {
 	const char *const args_doc = "PORT DOWNLOAD_PATH";
-	const struct argp_option options[] = { 0 };
+	const struct argp_option options[] = {
+		{ "engine", 'e', "ENGINE", 0,
+		  "how file data is received: mmap (default), splice or uring" },
+		{ "yes", 'y', 0, 0, "accept every transfer without asking" },
+		{ "event-loops", 'l', "N", 0,
+		  "drive all clients from N epoll loops "
+		  "instead of a thread per client, needs --yes" },
+		{ "workers", 'w', "N", 0,
+		  "handle clients on a pool of N threads "
+		  "instead of a thread per client" },
+		{ "queue", 'q', "N", 0,
+		  "clients that may wait for a worker before new ones are "
+		  "told to retry later (default: 2 per worker)" },
+		{ "max-inflight", 'm', "BYTES", 0,
+		  "defer transfers while the accepted ones still have this "
+		  "many bytes to receive" },
+		{ "stats", OPT_STATS, 0, 0,
+		  "print a json summary of every session when it ends" },
+		{ "stats-socket", OPT_STATS_SOCKET, "PATH", 0,
+		  "serve the stats of all sessions as json to every connection "
+		  "to a unix socket at PATH" },
+		{ 0 }
+	};
 	const struct argp argp = {
 		.options = options,
 		.args_doc = args_doc,
 		.parser = parse_opt,
 	};
-	args a = { .parsed = 0, .downloads_dir = downloads_directory };
 
-	if (argp_parse(&argp, argc, argv, 0, NULL, &a) < 0) {
+	if (argp_parse(&argp, argc, argv, 0, NULL, a) < 0) {
 		fprintf(stderr, "parsing error :(\n");
 		exit(EXIT_FAILURE);
 	}
-
-	*port = a.port;
 }
 
+/* a transfer striped over several connections */
+typedef struct session {
+	uint64_t id;
+	/* streams that have not finished yet, or not joined */
+	unsigned refs;
+	/* bit per stream that has connected */
+	uint64_t joined;
+	/* a stream failed, the files are not complete */
+	bool failed;
+	/* streams that have not joined by then never will, see put_session */
+	struct timespec join_deadline;
+	/* signalled on every join */
+	pthread_cond_t cond;
+
+	stream_t entries;
+	stripe_plan_t plan;
+
+	struct session *next;
+} session_t;
+
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static session_t *sessions = NULL;
+
 typedef struct client {
 	char *download_dir;
+	transfer_engine engine;
 	int socket;
 	char addr_str[INET_ADDRSTRLEN];
 	peer_info_t *info;
+	off_t total_file_size;
+	/* bytes reserved against max_inflight_bytes */
+	off_t admitted;
+	uint32_t streams;
+	uint32_t flags;
+	uint32_t batch_threshold;
 	stream_t entries;
+	/* set for tf_resume */
+	journal_t *journal;
+	/* set for tf_delta, what the receiver had of every entry */
+	delta_sig_header_t *delta;
+	/* set for tf_verify */
+	verifier_t *verifier;
+
+	/* set for every connection of a striped transfer */
+	session_t *session;
+	uint32_t stream;
+
+	session_stats_t stats;
+	/* counted by the progress reporter since it was accepted */
+	bool progress;
+
+	/* an event loop served it up to here, see hand_off_client */
+	bool handed;
+	/* the last message the loop read, data is NULL if it only read the header */
+	bool has_pending;
+	header_t pending;
+	void *pending_data;
+
+	/* next in the queue of the pool */
+	struct client *next;
 } client_t;
 
 #define TIMEOUT 1000
+/* seconds the streams of a striped transfer have to join */
+#define JOIN_TIMEOUT (DEFAULT_POLL_TIMEOUT / 1000)
+/* what a busy client may still send before it is closed on */
+#define DRAIN_MAX (64 * 1024)
 #define BACKLOG_SIZE 10
+/* seconds a busy server asks clients to wait */
+#define BUSY_RETRY_AFTER 2
+
+bool admit_transfer(off_t size)
+{
+	pthread_mutex_lock(&admission_lock);
+
+	/* a single oversized transfer still gets through on an idle server */
+	const bool admit = max_inflight_bytes == 0 || inflight_bytes == 0 ||
+			   inflight_bytes + size <= max_inflight_bytes;
+	if (admit)
+		inflight_bytes += size;
+
+	pthread_mutex_unlock(&admission_lock);
+
+	return admit;
+}
+
+void grow_transfer(off_t size)
+{
+	pthread_mutex_lock(&admission_lock);
+	inflight_bytes += size;
+	pthread_mutex_unlock(&admission_lock);
+}
+
+void release_transfer(off_t size)
+{
+	pthread_mutex_lock(&admission_lock);
+	inflight_bytes -= size;
+	pthread_mutex_unlock(&admission_lock);
+}
+
+int send_busy(int soc, const char *addr_str)
+{
+	fprintf(stderr, "Server is busy, deferring host %s\n", addr_str);
+
+	header_t h = {
+		.type = mt_busy,
+		.data_size = sizeof(busy_data_t),
+	};
+	busy_data_t busy = { .retry_after = BUSY_RETRY_AFTER };
+
+	return send_msg(soc, &h, &busy);
+}
+
+client_t *new_client(void)
+{
+	client_t *client = malloc(sizeof(client_t));
+	if (client == NULL)
+		return NULL;
+
+	*client = (client_t){
+		.download_dir = downloads_dir,
+		.engine = default_engine,
+	};
+
+	return client;
+}
+
+/* the message an event loop already read comes first */
+static int read_header(client_t *client, header_t *h)
+{
+	if (client->has_pending) {
+		*h = client->pending;
+		client->has_pending = false;
+		return 0;
+	}
+
+	if (perf_soc_op(client->socket, op_read, h, sizeof(header_t), NULL) <
+	    0)
+		return -1;
+
+	return 0;
+}
+
+static int read_data(client_t *client, void *data, size_t len)
+{
+	if (client->pending_data) {
+		memcpy(data, client->pending_data, len);
+		free(client->pending_data);
+		client->pending_data = NULL;
+		return 0;
+	}
+
+	if (perf_soc_op(client->socket, op_read, data, len, NULL) < 0)
+		return -1;
+
+	return 0;
+}
 
 int setup(uint16_t port)
 {
@@ -125,6 +369,157 @@ int setup(uint16_t port)
 	return sock;
 }
 
+/* takes ownership of entries */
+session_t *create_session(stream_t *entries, uint32_t streams)
+{
+	session_t *session = malloc(sizeof(session_t));
+	if (session == NULL) {
+		PERROR("malloc");
+		return NULL;
+	}
+
+	*session = (session_t){
+		.refs = streams,
+		.joined = 1,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.entries = *entries,
+	};
+	clock_gettime(CLOCK_REALTIME, &session->join_deadline);
+	session->join_deadline.tv_sec += JOIN_TIMEOUT;
+
+	if (getrandom(&session->id, sizeof(session->id), 0) < 0) {
+		PERROR("getrandom");
+		goto error;
+	}
+
+	if (plan_stripes(&session->entries, streams, &session->plan) < 0)
+		goto error;
+
+	*entries = (stream_t){ 0 };
+
+	pthread_mutex_lock(&sessions_lock);
+	session->next = sessions;
+	sessions = session;
+	pthread_mutex_unlock(&sessions_lock);
+
+	return session;
+
+error:
+	free(session);
+
+	return NULL;
+}
+
+/* returns NULL if there is no such session or the stream already joined */
+session_t *join_session(uint64_t id, uint32_t stream)
+{
+	pthread_mutex_lock(&sessions_lock);
+
+	session_t *session = sessions;
+	while (session && session->id != id)
+		session = session->next;
+
+	if (session && (stream >= session->plan.streams ||
+			session->joined & (UINT64_C(1) << stream)))
+		session = NULL;
+	if (session) {
+		session->joined |= UINT64_C(1) << stream;
+		pthread_cond_broadcast(&session->cond);
+	}
+
+	pthread_mutex_unlock(&sessions_lock);
+
+	return session;
+}
+
+static unsigned unjoined(const session_t *session)
+{
+	return session->plan.streams - __builtin_popcountll(session->joined);
+}
+
+/*
+ * the last stream to finish frees the session
+ * streams that never join hold a reference too, so when only they are left
+ * the last one that did waits for them until the join deadline and then
+ * drops their references and fails the session
+ */
+void put_session(session_t *session, bool ok)
+{
+	pthread_mutex_lock(&sessions_lock);
+
+	if (!ok)
+		session->failed = true;
+	--session->refs;
+	while (session->refs > 0 && session->refs == unjoined(session)) {
+		if (pthread_cond_timedwait(&session->cond, &sessions_lock,
+					   &session->join_deadline) !=
+		    ETIMEDOUT)
+			continue;
+
+		fprintf(stderr,
+			"%u streams of a striped transfer never joined\n",
+			unjoined(session));
+		session->joined = ~UINT64_C(0);
+		session->refs = 0;
+		session->failed = true;
+	}
+	const bool last = session->refs == 0;
+	if (last) {
+		session_t **curr = &sessions;
+		while (*curr != session)
+			curr = &(*curr)->next;
+		*curr = session->next;
+	}
+
+	pthread_mutex_unlock(&sessions_lock);
+
+	if (!last)
+		return;
+
+	/* the stripes are one transfer, it ends with the last of them */
+	if (!session->failed)
+		set_mtimes(&session->entries);
+	progress_end();
+	destroy_stripe_plan(&session->plan);
+	destroy_stream(&session->entries);
+	free(session);
+}
+
+int recv_join(client_t *client, size_t data_size)
+{
+	join_data_t join;
+	if (data_size != sizeof(join)) {
+		fprintf(stderr, "Invalid join message from host %s\n",
+			client->addr_str);
+		return 1;
+	}
+
+	if (read_data(client, &join, sizeof(join)) < 0)
+		return -1;
+
+	session_t *session = join_session(join.session_id, join.stream);
+	const bool valid = session != NULL;
+
+	header_t res = {
+		.type = valid ? mt_ack : mt_nack,
+		.data_size = 0,
+	};
+	if (perf_soc_op(client->socket, op_write, &res, sizeof(header_t),
+			NULL) < 0)
+		return -1;
+
+	if (!valid) {
+		fprintf(stderr, "Host %s tried to join an unknown session\n",
+			client->addr_str);
+		return 1;
+	}
+
+	client->session = session;
+	client->stream = join.stream;
+
+	return 0;
+}
+
 int recv_info(client_t *client)
 {
 	struct pollfd p = {
@@ -132,7 +527,7 @@ int recv_info(client_t *client)
 		.events = POLLIN,
 	};
 
-	if (poll(&p, 1, TIMEOUT) == 0) {
+	if (!client->has_pending && poll(&p, 1, TIMEOUT) == 0) {
 		fprintf(stderr,
 			"Client from host %s did not send data within timeout\n",
 			client->addr_str);
@@ -142,10 +537,12 @@ int recv_info(client_t *client)
 	header_t header;
 	peer_info_t *info = NULL;
 
-	if (perf_soc_op(client->socket, op_read, &header, sizeof(header_t),
-			NULL) < 0)
+	if (read_header(client, &header) < 0)
 		return -1;
 
+	if (header.type == mt_join)
+		return recv_join(client, header.data_size);
+
 	if (header.type != mt_pinfo) {
 		fprintf(stderr,
 			"Client from host %s didn't send a peer info message\n",
@@ -189,17 +586,54 @@ void accept_client(int soc, client_t *client)
 	socklen_t len = sizeof(addr);
 	if ((client->socket = accept(soc, (struct sockaddr *)&addr, &len)) < 0)
 		ERR_EXIT("accept");
+	set_nodelay(client->socket);
 
 	if (!inet_ntop(AF_INET, &(addr.sin_addr), client->addr_str,
 		       INET_ADDRSTRLEN))
 		PERROR("inet_ntop");
 }
 
+int ask_transfer(const char *username, const char *addr_str,
+		 const request_data_t *request)
+{
+	size_info size = bytes_to_size(request->total_file_size);
+	if (request->flags & tf_streaming) {
+		printf("Do you want to receive %s `%.255s` of unknown size"
+		       " from user %s at host %s [Y/n] ",
+		       get_entry_type_name(request->entry_type),
+		       request->filename, username, addr_str);
+	} else {
+		printf("Do you want to receive %s `%.255s` of size %.2lf %s"
+		       " from user %s at host %s [Y/n] ",
+		       get_entry_type_name(request->entry_type),
+		       request->filename, size.size, unit(size), username,
+		       addr_str);
+	}
+
+	if (accept_all) {
+		printf("y\n");
+		return 1;
+	}
+
+	char *line = NULL;
+	size_t len;
+	if (getline(&line, &len, stdin) < 0) {
+		PERROR("getline");
+		free(line);
+		return -1;
+	}
+
+	char c = line[0];
+	const bool accept = c == 'y' || c == 'Y' || c == '\n';
+	free(line);
+
+	return accept;
+}
+
 int confirm_transfer(client_t *client, char path[PATH_MAX])
 {
 	header_t header;
-	if (perf_soc_op(client->socket, op_read, &header, sizeof(header_t),
-			NULL) < 0)
+	if (read_header(client, &header) < 0)
 		return -1;
 
 	if (header.type != mt_req) {
@@ -209,25 +643,42 @@ int confirm_transfer(client_t *client, char path[PATH_MAX])
 		return 1;
 	}
 
+	if (header.data_size < sizeof(request_data_t) ||
+	    header.data_size > MAX_REQUEST_SIZE) {
+		fprintf(stderr, "Client %s sent a request of %zu bytes\n",
+			client->addr_str, header.data_size);
+		return -1;
+	}
+
 	request_data_t *request = malloc(header.data_size);
-	if (perf_soc_op(client->socket, op_read, request, header.data_size,
-			NULL) < 0)
+	if (request == NULL)
+		ERR_GOTO("malloc");
+	if (read_data(client, request, header.data_size) < 0)
 		goto error;
 
-	size_info size = bytes_to_size(request->total_file_size);
-	printf("Do you want to receive %s `%.255s` of size %.2lf %s"
-	       " from user %s at host %s [Y/n] ",
-	       get_entry_type_name(request->entry_type), request->filename,
-	       size.size, unit(size), client->info->username, client->addr_str);
+	char why[128];
+	if (check_request(request, header.data_size, why, sizeof(why)) < 0) {
+		fprintf(stderr, "Client %s sent an invalid request: %s\n",
+			client->addr_str, why);
+		send_nack(client->socket, why);
+		goto error;
+	}
 
-	char *line = NULL;
-	size_t len;
-	if (getline(&line, &len, stdin) < 0)
-		ERR_GOTO("getline");
+	if (!admit_transfer(request->total_file_size)) {
+		free(request);
+		return send_busy(client->socket, client->addr_str) < 0 ? -1 : 1;
+	}
+	client->admitted = request->total_file_size;
 
-	char c = line[0];
-	const bool accept = c == 'y' || c == 'Y' || c == '\n';
-	free(line);
+	const int accept =
+		ask_transfer(client->info->username, client->addr_str, request);
+	if (accept < 0)
+		goto error;
+
+	client->total_file_size = request->total_file_size;
+	client->streams = request->streams;
+	client->flags = request->flags;
+	client->batch_threshold = request->batch_threshold;
 
 	header_t res = {
 		.type = accept ? mt_ack : mt_nack,
@@ -240,6 +691,15 @@ int confirm_transfer(client_t *client, char path[PATH_MAX])
 
 	free(request);
 
+	if (accept) {
+		/* streamed sizes are only known chunk by chunk */
+		progress_begin(client->flags & tf_streaming ?
+				       0 :
+				       client->total_file_size,
+			       0);
+		client->progress = true;
+	}
+
 	return accept ? 0 : 1;
 
 error:
@@ -248,109 +708,1003 @@ error:
 	return -1;
 }
 
-int recv_metadata(client_t *client)
+/* striped ranges are written positionally, so every file has to exist first */
+int prepare_entries(const stream_t *entries)
 {
-	if (recv_stream(client->socket, &client->entries) < 0)
+	stream_iter_t it;
+	stream_iter_init(&it, entries);
+	entry_t *entry;
+
+	while ((entry = stream_iter_next(&it))) {
+		if (entry->type == et_dir) {
+			if (mkdir(entry->rel_path, entry->permissions) < 0)
+				PERROR("mkdir");
+			continue;
+		}
+
+		const int fd = open_entry(entry, op_write);
+		if (fd < 0)
+			return -1;
+
+		const int ret = ftruncate(fd, entry->size);
+		if (ret < 0)
+			PERROR("ftruncate");
+		close(fd);
+
+		if (ret < 0)
+			return -1;
+		/* no stripe carries empty files */
+		if (entry->size == 0)
+			progress_add(0, 1);
+	}
+
+	return 0;
+}
+
+/* tf_resume: the metadata is answered with how much of every entry is there */
+int send_resume_map(client_t *client)
+{
+	if (!(client->journal = malloc(sizeof(journal_t)))) {
+		PERROR("malloc");
 		return -1;
+	}
+
+	if (open_journal(client->journal, client->download_dir,
+			 &client->entries) < 0) {
+		free(client->journal);
+		client->journal = NULL;
+		return -1;
+	}
+
+	if (client->journal->resumed)
+		printf("Resuming an earlier transfer from host %s\n",
+		       client->addr_str);
+
+	header_t h = {
+		.type = mt_resume,
+		.data_size = client->journal->len * sizeof(off_t),
+	};
+
+	return send_msg(client->socket, &h, client->journal->done);
+}
+
+/* tf_delta: after the ack, every regular entry gets a signature */
+int send_signatures(client_t *client)
+{
+	/* the client reads nothing but signatures until the last of them */
+	frame_writer_t w;
+	frame_init(&w, client->socket);
 
 	header_t ack = { .type = mt_ack, .data_size = 0 };
-	if (perf_soc_op(client->socket, op_write, &ack, sizeof(header_t),
-			NULL) < 0)
+	if (frame_put(&w, &ack, sizeof(header_t)) < 0)
+		return -1;
+
+	if (!(client->delta = calloc(client->entries.metadata.len,
+				     sizeof(delta_sig_header_t)))) {
+		PERROR("calloc");
+		return -1;
+	}
+
+	chdir(client->download_dir);
+
+	stream_iter_t it;
+	stream_iter_init(&it, &client->entries);
+	entry_t *entry;
+
+	for (size_t i = 0; (entry = stream_iter_next(&it)); ++i) {
+		if (entry->type == et_dir)
+			continue;
+
+		delta_sig_t sig;
+		if (make_signature(entry, &sig) < 0)
+			return -1;
+
+		client->delta[i] = sig.header;
+		const int ret = put_signature(&w, &sig);
+		free(sig.blocks);
+
+		if (ret < 0)
+			return -1;
+	}
+
+	return frame_flush(&w);
+}
+
+static int recv_entries(client_t *client)
+{
+	const int ret =
+		client->flags & tf_compact ?
+			recv_compact_entries(client->socket, &client->entries) :
+			recv_stream(client->socket, &client->entries,
+				    sizeof(entry_t));
+	if (ret < 0 || check_entries(&client->entries) < 0)
+		return -1;
+
+	const size_t files = count_files(&client->entries);
+	stats_files(files);
+	progress_expect(0, files);
+
+	return 0;
+}
+
+int recv_metadata(client_t *client)
+{
+	if (recv_entries(client) < 0)
+		return -1;
+
+	if (client->flags & tf_resume)
+		return send_resume_map(client);
+
+	if (client->flags & tf_delta)
+		return send_signatures(client);
+
+	if (client->streams == 1) {
+		header_t ack = { .type = mt_ack, .data_size = 0 };
+		if (perf_soc_op(client->socket, op_write, &ack,
+				sizeof(header_t), NULL) < 0)
+			return -1;
+
+		return 0;
+	}
+
+	chdir(client->download_dir);
+	if (prepare_entries(&client->entries) < 0)
+		return -1;
+
+	if (!(client->session =
+		      create_session(&client->entries, client->streams)))
+		return -1;
+	client->stream = 0;
+
+	header_t h = { .type = mt_session, .data_size = sizeof(session_data_t) };
+	session_data_t data = { .session_id = client->session->id };
+	if (send_msg(client->socket, &h, &data) < 0)
 		return -1;
 
 	return 0;
 }
 
-void recv_data(client_t *client, char path[PATH_MAX])
+int recv_stripe(client_t *client)
+{
+	const stripe_t *stripe = &client->session->plan.stripes[client->stream];
+
+	chdir(client->download_dir);
+
+	for (size_t i = 0; i < stripe->len; ++i) {
+		const stripe_item_t *item = &stripe->items[i];
+
+		const int fd = open(item->entry->rel_path, O_WRONLY);
+		if (fd < 0) {
+			PERROR("open");
+			return -1;
+		}
+
+		const int ret = recv_range(client->socket, fd, item->offset,
+					   item->len, client->engine, NULL);
+		close(fd);
+
+		if (ret < 0)
+			return -1;
+		progress_add(item->len,
+			     item->offset + item->len == item->entry->size);
+	}
+
+	printf("Received stream %u of %u from host %s\n", client->stream + 1,
+	       client->session->plan.streams, client->addr_str);
+
+	return 0;
+}
+
+/* the first done entries are on the disk and digested or can be hashed */
+static void entries_done(client_t *client, size_t done)
+{
+	if (client->verifier)
+		verifier_ready(client->verifier, done);
+}
+
+int recv_data(client_t *client, char path[PATH_MAX])
 {
 	stream_iter_t it;
 	stream_iter_init(&it, &client->entries);
 
 	entry_t *entry;
-	entry_handles_t entry_handles;
 	chdir(path);
 
-	const char *title_format = "Receiving %s";
-	char title[PATH_MAX + 10];
-	struct timespec ts = { 0, 1e8 };
 	progress_bar_t bar;
-	while ((entry = stream_iter_next(&it))) {
+
+	transfer_engine engine = client->engine;
+	int ret = 0;
+	batch_t batch;
+	batch_init(&batch, client->flags & tf_batch ? client->batch_threshold :
+						     0);
+
+	if (engine_is_batched(engine) &&
+	    (batch.threshold || client->flags & (tf_compress | tf_sparse))) {
+		/* batch frames, compressed and sparse entries are read one by one */
+		engine = te_mmap;
+	} else if (engine_is_batched(engine)) {
+		prog_bar_init(&bar, client->total_file_size,
+			      count_files(&client->entries));
+		ret = recv_batched(client->socket, &client->entries, engine,
+				   &bar);
+		entries_done(client, client->entries.metadata.len);
+		return ret;
+	}
+
+	for (size_t i = 0; (entry = stream_iter_next(&it));
+	     entries_done(client, ++i)) {
 		if (entry->type == et_dir) {
 			if (mkdir(entry->rel_path, entry->permissions) < 0)
 				PERROR("mkdir");
 			continue;
 		}
 
-		if (get_entry_handles(entry, &entry_handles, op_write) < 0)
+		if (is_batched(&batch, entry)) {
+			if ((ret = recv_batched_entry(client->socket, entry,
+						      &batch)) < 0)
+				break;
 			continue;
-		if (ftruncate(entry_handles.fd, entry_handles.size) < 0)
-			ERR_GOTO("ftruncate");
+		}
+
+		prog_bar_init(&bar, entry->size, 1);
+
+		if (client->flags & tf_compress)
+			ret = recv_compressed_entry(client->socket, entry,
+						    engine, &bar);
+		else if (client->flags & tf_sparse)
+			ret = recv_sparse_entry(client->socket, entry, engine,
+						&bar);
+		else
+			ret = recv_entry(client->socket, entry, engine, &bar);
+		if (ret < 0)
+			break;
+	}
 
-		snprintf(title, sizeof(title), title_format, entry->rel_path);
-		prog_bar_init(&bar, title, entry_handles.size, ts);
+	destroy_batch(&batch);
 
-		if (perf_soc_op(client->socket, op_read, entry_handles.map,
-				entry_handles.size, &bar) < 0)
-			goto error;
+	return ret < 0 ? -1 : 0;
+}
 
-error:
-		close_entry_handles(&entry_handles);
+/* tf_streaming: every chunk of entries is followed by its data */
+int recv_chunks(client_t *client)
+{
+	header_t h;
+	off_t streamed = 0;
+
+	for (;;) {
+		if (perf_soc_op(client->socket, op_read, &h, sizeof(header_t),
+				NULL) < 0)
+			return -1;
+
+		if (h.type != mt_chunk) {
+			fprintf(stderr, "Client %s sent %u instead of a chunk\n",
+				client->addr_str, h.type);
+			return -1;
+		}
+
+		if (h.data_size == 0)
+			return 0;
+
+		stats_phase_begin(sp_metadata);
+		destroy_stream(&client->entries);
+		if (recv_entries(client) < 0)
+			return -1;
+
+		if (client->entries.metadata.len != h.data_size) {
+			fprintf(stderr, "Client %s sent a malformed chunk\n",
+				client->addr_str);
+			return -1;
+		}
+
+		stream_iter_t it;
+		stream_iter_init(&it, &client->entries);
+		const entry_t *entry;
+
+		/* only known chunk by chunk, the progress bars need it */
+		client->total_file_size = 0;
+		while ((entry = stream_iter_next(&it)))
+			client->total_file_size += entry->size;
+		progress_expect(client->total_file_size, 0);
+
+		/* the request only declared the first chunk */
+		streamed += client->total_file_size;
+		if (streamed > client->admitted) {
+			grow_transfer(streamed - client->admitted);
+			client->admitted = streamed;
+		}
+
+		stats_phase_begin(sp_data);
+		if (recv_data(client, client->download_dir) < 0 ||
+		    set_mtimes(&client->entries) < 0)
+			return -1;
+	}
+}
+
+/* tf_resume: only the part of every entry the journal is missing arrives */
+int recv_resumed(client_t *client)
+{
+	journal_t *journal = client->journal;
+	stream_iter_t it;
+	stream_iter_init(&it, &client->entries);
+	entry_t *entry;
+
+	chdir(client->download_dir);
+
+	progress_bar_t bar;
+	int ret = 0;
+
+	for (size_t i = 0; (entry = stream_iter_next(&it));
+	     entries_done(client, ++i)) {
+		if (entry->type == et_dir) {
+			if (mkdir(entry->rel_path, entry->permissions) < 0 &&
+			    errno != EEXIST)
+				PERROR("mkdir");
+			continue;
+		}
+
+		off_t done = journal->done[i];
+		if (done == entry->size && done > 0) {
+			progress_add(done, 1);
+			continue;
+		}
+
+		/* whatever is there and not done is written over */
+		const int fd = reopen_entry(entry);
+		if (fd < 0)
+			return -1;
+		if (ftruncate(fd, entry->size) < 0) {
+			PERROR("ftruncate");
+			close(fd);
+			return -1;
+		}
+
+		prog_bar_init(&bar, entry->size, 1);
+
+		/* checkpointed in pieces, so big files resume close to the end */
+		while (done < entry->size) {
+			const size_t len = entry->size - done < JOURNAL_SYNC_BYTES ?
+						   entry->size - done :
+						   JOURNAL_SYNC_BYTES;
+
+			if ((ret = recv_range(client->socket, fd, done, len,
+					      client->engine, NULL)) < 0)
+				break;
+
+			done += len;
+			prog_bar_advance(&bar, done);
+
+			if ((ret = journal_add(journal, i, fd, done, len)) < 0)
+				break;
+		}
+
+		prog_bar_finish(&bar);
+		close(fd);
+
+		if (ret < 0)
+			return -1;
+	}
+
+	return finish_journal(journal);
+}
+
+/* tf_delta: entries that were not the same arrive as delta ops */
+int recv_deltas(client_t *client)
+{
+	stream_iter_t it;
+	stream_iter_init(&it, &client->entries);
+	entry_t *entry;
+	size_t same = 0, files = 0;
+
+	chdir(client->download_dir);
+
+	for (size_t i = 0; (entry = stream_iter_next(&it));
+	     entries_done(client, ++i)) {
+		if (entry->type == et_dir) {
+			if (mkdir(entry->rel_path, entry->permissions) < 0 &&
+			    errno != EEXIST)
+				PERROR("mkdir");
+			continue;
+		}
+
+		++files;
+		if (client->delta[i].status == ds_same) {
+			++same;
+			progress_add(entry->size, 1);
+			continue;
+		}
+
+		if (recv_delta(client->socket, entry, &client->delta[i],
+			       client->engine) < 0)
+			return -1;
+		progress_add(entry->size, 1);
+	}
+
+	printf("Received %zu files from host %s, %zu were unchanged\n", files,
+	       client->addr_str, same);
+
+	return 0;
+}
+
+typedef struct dedup {
+	int store;
+	chunk_list_t *lists;
+	/* the chunks the sender has to send, a bit per chunk */
+	uint8_t **missing;
+} dedup_t;
+
+static int read_chunk_lists(client_t *client, dedup_t *d, size_t *total)
+{
+	stream_iter_t it;
+	stream_iter_init(&it, &client->entries);
+	entry_t *entry;
+	header_t h;
+
+	*total = 0;
+	for (size_t i = 0; (entry = stream_iter_next(&it)); ++i) {
+		if (entry->type == et_dir)
+			continue;
+
+		void *data = NULL;
+		if (receive_msg(client->socket, &h, &data) < 0)
+			return -1;
+		d->lists[i] = (chunk_list_t){
+			.len = h.data_size / sizeof(chunk_ref_t),
+			.refs = data,
+		};
+
+		off_t size = 0;
+		for (size_t j = 0; j < d->lists[i].len; ++j) {
+			if (d->lists[i].refs[j].len > CDC_MAX_CHUNK)
+				size = -1;
+			else if (size >= 0)
+				size += d->lists[i].refs[j].len;
+		}
+
+		if (h.type != mt_chunk_list ||
+		    h.data_size % sizeof(chunk_ref_t) || size != entry->size) {
+			fprintf(stderr, "Client %s sent an invalid chunk list\n",
+				client->addr_str);
+			return -1;
+		}
+		*total += d->lists[i].len;
+	}
+
+	return 0;
+}
+
+/* every chunk is only asked for once, at its first use */
+static int send_missing(client_t *client, dedup_t *d, size_t total,
+			size_t *missing)
+{
+	chunk_set_t seen;
+	if (chunk_set_init(&seen, total) < 0)
+		return -1;
+
+	int ret = 0;
+	*missing = 0;
+
+	for (size_t i = 0; i < client->entries.metadata.len; ++i) {
+		const chunk_list_t *list = &d->lists[i];
+		const size_t size = (list->len + 7) / 8;
+
+		if (!list->refs)
+			continue;
+
+		if (!(d->missing[i] = calloc(size + 1, 1))) {
+			PERROR("calloc");
+			ret = -1;
+			break;
+		}
+
+		for (size_t j = 0; j < list->len; ++j) {
+			if (chunk_set_add(&seen, &list->refs[j].id) &&
+			    !store_has(d->store, &list->refs[j].id)) {
+				d->missing[i][j / 8] |= 1 << j % 8;
+				++*missing;
+			}
+		}
+
+		header_t h = { .type = mt_missing, .data_size = size };
+		if ((ret = send_msg(client->socket, &h, d->missing[i])) < 0)
+			break;
+	}
+
+	destroy_chunk_set(&seen);
+
+	return ret;
+}
+
+/* the file is put together from the store, sharing extents where possible */
+static int assemble_entry(const entry_t *entry, const chunk_list_t *list,
+			  int store)
+{
+	const int fd = open_entry(entry, op_write);
+	if (fd < 0)
+		return -1;
+
+	int ret = 0;
+	off_t off = 0;
+
+	for (size_t j = 0; j < list->len && ret == 0; ++j) {
+		const int chunk = store_open(store, &list->refs[j].id);
+		if (chunk < 0) {
+			ret = -1;
+			break;
+		}
+
+		ret = copy_fd_range(chunk, 0, fd, off, list->refs[j].len);
+		off += list->refs[j].len;
+		close(chunk);
+	}
+
+	close(fd);
+
+	return ret;
+}
+
+/* tf_dedup: the chunk lists come first, then only what the store lacks */
+int recv_dedup(client_t *client)
+{
+	const size_t len = client->entries.metadata.len;
+	dedup_t d = {
+		.store = open_store(client->download_dir),
+		.lists = calloc(len, sizeof(chunk_list_t)),
+		.missing = calloc(len, sizeof(uint8_t *)),
+	};
+	uint8_t *buf = malloc(CDC_MAX_CHUNK);
+	int ret = -1;
+	size_t total, missing;
+	off_t received = 0;
+
+	if (d.store < 0 || !d.lists || !d.missing || !buf)
+		goto cleanup;
+
+	if (read_chunk_lists(client, &d, &total) < 0 ||
+	    send_missing(client, &d, total, &missing) < 0)
+		goto cleanup;
+
+	chdir(client->download_dir);
+
+	stream_iter_t it;
+	stream_iter_init(&it, &client->entries);
+	entry_t *entry;
+
+	for (size_t i = 0; (entry = stream_iter_next(&it));
+	     entries_done(client, ++i)) {
+		if (entry->type == et_dir) {
+			if (mkdir(entry->rel_path, entry->permissions) < 0)
+				PERROR("mkdir");
+			continue;
+		}
+
+		const chunk_list_t *list = &d.lists[i];
+		for (size_t j = 0; j < list->len; ++j) {
+			if (!(d.missing[i][j / 8] & 1 << j % 8))
+				continue;
+
+			const chunk_ref_t *ref = &list->refs[j];
+			if (perf_soc_op(client->socket, op_read, buf, ref->len,
+					NULL) < 0)
+				goto cleanup;
+
+			const chunk_id_t id = get_chunk_id(buf, ref->len);
+			if (!chunk_id_eq(&id, &ref->id)) {
+				fprintf(stderr,
+					"Chunk of `%s` from host %s does not "
+					"match its id\n",
+					entry->rel_path, client->addr_str);
+				goto cleanup;
+			}
+
+			if (store_put(d.store, &id, buf, ref->len) < 0)
+				goto cleanup;
+			received += ref->len;
+		}
+
+		if (assemble_entry(entry, list, d.store) < 0)
+			goto cleanup;
+		progress_add(entry->size, 1);
 	}
+
+	size_info size = bytes_to_size(received);
+	printf("Received %zu of %zu chunks (%.2lf %s) from host %s\n", missing,
+	       total, size.size, unit(size), client->addr_str);
+	ret = 0;
+
+cleanup:
+	for (size_t i = 0; i < len && d.lists; ++i) {
+		free(d.lists[i].refs);
+		if (d.missing)
+			free(d.missing[i]);
+	}
+	free(d.lists);
+	free(d.missing);
+	free(buf);
+	if (d.store >= 0)
+		close(d.store);
+
+	return ret;
 }
 
-void cleanup_client(client_t *client)
+void cleanup_client(client_t *client, bool ok)
 {
 	close(client->socket);
 
-	printf("Disconnected client %s from host %s\n", client->info->username,
+	printf("Disconnected client %s from host %s\n",
+	       client->info ? client->info->username : default_user_name,
 	       client->addr_str);
 
+	if (client->session)
+		put_session(client->session, ok);
+	else if (client->progress)
+		progress_end();
+	release_transfer(client->admitted);
+	if (client->journal) {
+		/* whatever arrived in full can still be checkpointed */
+		journal_flush(client->journal);
+		close_journal(client->journal);
+		free(client->journal);
+	}
+	if (client->verifier) {
+		destroy_verifier(client->verifier);
+		free(client->verifier);
+	}
+	free(client->delta);
 	free(client->info);
+	free(client->pending_data);
 	destroy_stream(&client->entries);
 }
 
+void report_session(const session_stats_t *stats)
+{
+	if (!print_stats)
+		return;
+
+	flockfile(stdout);
+	stats_print_session(stdout, stats);
+	putchar('\n');
+	funlockfile(stdout);
+}
+
 void *handle_client(void *arg)
 {
 	client_t *client = arg;
+	bool ok = false;
 
-	if (recv_info(client))
+	if (!client->handed)
+		stats_start(&client->stats, client->addr_str, sp_handshake);
+	stats_attach(&client->stats);
+
+	/* the hello of a handed client or a pooled join was answered already */
+	if (!client->info && !client->session && recv_info(client))
+		goto cleanup;
+
+	if (client->session) {
+		stats_phase_begin(sp_data);
+		ok = recv_stripe(client) == 0;
 		goto cleanup;
+	}
 
 	char path[PATH_MAX];
 
 	if (confirm_transfer(client, path))
 		goto cleanup;
 
+	if (client->flags & tf_streaming) {
+		ok = recv_chunks(client) == 0;
+		goto cleanup;
+	}
+
+	stats_phase_begin(sp_metadata);
 	if (recv_metadata(client) < 0)
 		goto cleanup;
+	stats_phase_begin(sp_data);
+
+	if (client->flags & tf_verify) {
+		if (!(client->verifier = malloc(sizeof(verifier_t))) ||
+		    start_verifier(client->verifier, &client->entries, false) <
+			    0) {
+			free(client->verifier);
+			client->verifier = NULL;
+			goto cleanup;
+		}
+		/* the data is received on this thread */
+		verifier_attach(client->verifier);
+	}
 
-	recv_data(client, client->download_dir);
+	int ret = 0;
+	if (client->session)
+		ret = recv_stripe(client);
+	else if (client->journal)
+		ret = recv_resumed(client);
+	else if (client->delta)
+		ret = recv_deltas(client);
+	else if (client->flags & tf_dedup)
+		ret = recv_dedup(client);
+	else
+		ret = recv_data(client, client->download_dir);
+
+	/* the stripes are done by the last of them, see put_session */
+	if (ret == 0 && !client->session)
+		ret = set_mtimes(&client->entries);
+
+	if (ret == 0 && client->verifier)
+		stats_phase_begin(sp_verify);
+	if (ret == 0 && client->verifier &&
+	    check_digests(client->socket, client->verifier,
+			  client->addr_str) < 0)
+		ret = -1;
+	ok = ret == 0;
 
 cleanup:
-	cleanup_client(client);
+	stats_attach(NULL);
+	stats_finish(&client->stats, ok);
+	report_session(&client->stats);
+
+	cleanup_client(client, ok);
 	free(client);
 
 	return NULL;
 }
 
+int hand_off_client(int soc, const char *addr_str, session_stats_t *stats,
+		    peer_info_t *info, const header_t *header, void *data)
+{
+	client_t *client = new_client();
+	if (client == NULL) {
+		PERROR("malloc");
+		return -1;
+	}
+
+	client->socket = soc;
+	snprintf(client->addr_str, sizeof(client->addr_str), "%s", addr_str);
+	client->info = info;
+	client->handed = true;
+	client->has_pending = true;
+	client->pending = *header;
+	client->pending_data = data;
+
+	/* the thread path reads blocking */
+	const int flags = fcntl(soc, F_GETFL);
+	if (flags < 0 || fcntl(soc, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+		PERROR("fcntl");
+		free(client);
+		return -1;
+	}
+
+	stats_move(&client->stats, stats, client->addr_str);
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, handle_client, client)) {
+		PERROR("pthread_create");
+		stats_move(stats, &client->stats, addr_str);
+		free(client);
+		return -1;
+	}
+	pthread_detach(tid);
+
+	return 0;
+}
+
+/* queue of accepted clients waiting for a worker, bounded except for joins */
+typedef struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+
+	client_t *head;
+	client_t *tail;
+	unsigned cap;
+	unsigned len;
+} pool_t;
+
+void *pool_worker(void *arg)
+{
+	pool_t *pool = arg;
+
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->len == 0)
+			pthread_cond_wait(&pool->not_empty, &pool->lock);
+
+		client_t *client = pool->head;
+		pool->head = client->next;
+		if (!pool->head)
+			pool->tail = NULL;
+		pool->len--;
+		pthread_mutex_unlock(&pool->lock);
+
+		handle_client(client);
+	}
+
+	return NULL;
+}
+
+/* returns false if the queue is full, unless force is set */
+bool pool_push(pool_t *pool, client_t *client, bool force)
+{
+	pthread_mutex_lock(&pool->lock);
+
+	const bool full = !force && pool->len >= pool->cap;
+	if (!full) {
+		client->next = NULL;
+		if (pool->tail)
+			pool->tail->next = client;
+		else
+			pool->head = client;
+		pool->tail = client;
+		pool->len++;
+		pthread_cond_signal(&pool->not_empty);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return !full;
+}
+
+/*
+ * reads len bytes unless the deadline (stats_now_ns) passes first, for the
+ * acceptor, which must not wait on a single peer
+ */
+static int read_within(int soc, void *buf, size_t len, int64_t deadline)
+{
+	for (size_t done = 0; done < len;) {
+		const int64_t left = (deadline - stats_now_ns()) / 1000000;
+		struct pollfd p = {
+			.fd = soc,
+			.events = POLLIN,
+		};
+
+		const int ret = left > 0 ? poll(&p, 1, left) : 0;
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+
+		const ssize_t r = recv(soc, (char *)buf + done, len - done,
+				       MSG_DONTWAIT);
+		stats_syscall();
+		if (r < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (r <= 0)
+			return -1;
+		done += r;
+	}
+
+	return 0;
+}
+
+/*
+ * the streams of a striped transfer on the workers wait until the client
+ * has an ack for every join, so the joins are answered here and then queued
+ * whether the queue is full or not, a join waiting for one of those workers
+ * would hang the session
+ * a peer gets TIMEOUT for its first message, after that it is the worker's
+ * returns 1 for a join, 0 for anything else and -1 if the client is gone
+ */
+static int pool_recv_join(client_t *client)
+{
+	const int64_t deadline = stats_now_ns() + TIMEOUT * 1000000ll;
+
+	if (read_within(client->socket, &client->pending, sizeof(header_t),
+			deadline) < 0)
+		goto timeout;
+	client->has_pending = true;
+
+	if (client->pending.type != mt_join)
+		return 0;
+
+	/* recv_join rejects the wrong sizes without reading anything */
+	if (client->pending.data_size == sizeof(join_data_t)) {
+		if (!(client->pending_data = malloc(sizeof(join_data_t)))) {
+			PERROR("malloc");
+			return -1;
+		}
+		if (read_within(client->socket, client->pending_data,
+				sizeof(join_data_t), deadline) < 0)
+			goto timeout;
+	}
+
+	return recv_info(client) == 0 ? 1 : -1;
+
+timeout:
+	fprintf(stderr, "Client from host %s did not send data within timeout\n",
+		client->addr_str);
+
+	return -1;
+}
+
+void run_pool(int soc, const args *a, pthread_attr_t *attr)
+{
+	pool_t pool = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.not_empty = PTHREAD_COND_INITIALIZER,
+		.cap = a->queue_len ? a->queue_len : 2 * a->workers,
+	};
+
+	for (unsigned i = 0; i < a->workers; ++i) {
+		pthread_t tid;
+		if (pthread_create(&tid, attr, pool_worker, &pool))
+			ERR_EXIT("pthread_create");
+	}
+
+	while (true) {
+		client_t *client = new_client();
+		if (client == NULL)
+			ERR_EXIT("malloc");
+
+		accept_client(soc, client);
+
+		const int join = pool_recv_join(client);
+		if (join < 0) {
+			cleanup_client(client, false);
+			free(client);
+			continue;
+		}
+
+		if (pool_push(&pool, client, join))
+			continue;
+
+		/*
+		 * closing with the hello still unread would reset the
+		 * connection before the peer gets to read the answer
+		 */
+		send_busy(client->socket, client->addr_str);
+		shutdown(client->socket, SHUT_WR);
+		/* a peer that keeps sending only gets so much of the acceptor */
+		const int64_t deadline = stats_now_ns() + TIMEOUT / 10 * 1000000ll;
+		char drain[256];
+		for (size_t left = DRAIN_MAX; left > 0; left -= sizeof(drain)) {
+			if (read_within(client->socket, drain, sizeof(drain),
+					deadline) < 0)
+				break;
+		}
+		close(client->socket);
+		free(client);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	char downloads_directory[PATH_MAX];
-	uint16_t port;
-
-	read_args(argc, argv, &port, downloads_directory);
+	args a = {
+		.parsed = 0,
+		.downloads_dir = downloads_directory,
+		.engine = te_mmap,
+	};
 
-	int soc = setup(port);
+	read_args(argc, argv, &a);
+	probe_engine(&a.engine);
+	downloads_dir = downloads_directory;
+	default_engine = a.engine;
+	accept_all = a.accept_all;
+	max_inflight_bytes = a.max_inflight;
+	print_stats = a.print_stats;
+
+	int soc = setup(a.port);
+
+	if (a.stats_socket && stats_serve(a.stats_socket) < 0)
+		return EXIT_FAILURE;
+	if (progress_start_reporter("Receiving") < 0)
+		return EXIT_FAILURE;
+
+	if (a.event_loops) {
+		const int ret = run_event_loops(soc, a.event_loops,
+						downloads_directory);
+		close(soc);
+		return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
 
 	pthread_attr_t attr;
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
+	if (a.workers)
+		run_pool(soc, &a, &attr);
+
 	while (true) {
-		client_t *client = malloc(sizeof(client_t));
-		*client = (client_t){
-			.download_dir = downloads_directory
-		};
+		client_t *client = new_client();
+		if (client == NULL)
+			ERR_EXIT("malloc");
 
 		accept_client(soc, client);
 
@@ -0,0 +1,37 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "message.h"
+#include "stats.h"
+
+/*
+ * asks on stdin whether to accept the request, unless the server runs
+ * with --yes
+ * returns 1 if accepted, 0 if not and -1 on error
+ */
+int ask_transfer(const char *username, const char *addr_str,
+		 const request_data_t *request);
+
+/*
+ * reserves size bytes against --max-inflight
+ * returns false if the transfer has to be deferred
+ */
+bool admit_transfer(off_t size);
+/*
+ * adds to a reservation without asking, for transfers that only learn
+ * their size as they go
+ */
+void grow_transfer(off_t size);
+void release_transfer(off_t size);
+/* tells the peer to retry later */
+int send_busy(int soc, const char *addr_str);
+/*
+ * serves a connection an event loop cannot on a thread of its own, header is
+ * the last message the loop read and data its data, NULL if it is unread
+ * takes over soc, stats, info and data unless it fails
+ */
+int hand_off_client(int soc, const char *addr_str, session_stats_t *stats,
+		    peer_info_t *info, const header_t *header, void *data);
+/* prints the summary of a session that ended if the server runs with --stats */
+void report_session(const session_stats_t *stats);
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "sparse.h"
+
+static int add_extent(extent_map_t *map, off_t offset, off_t len)
+{
+	if (map->len == map->cap) {
+		const size_t cap = map->cap ? 2 * map->cap : 16;
+		extent_t *extents =
+			realloc(map->extents, cap * sizeof(extent_t));
+		if (!extents) {
+			PERROR("realloc");
+			return -1;
+		}
+		map->extents = extents;
+		map->cap = cap;
+	}
+
+	map->extents[map->len++] = (extent_t){ offset, len };
+
+	return 0;
+}
+
+int map_extents(int fd, off_t size, extent_map_t *map)
+{
+	*map = (extent_map_t){ 0 };
+
+	for (off_t offset = 0; offset < size;) {
+		off_t data = lseek(fd, offset, SEEK_DATA);
+		if (data < 0 && errno == ENXIO)
+			break;
+		if (data < 0 && errno == EINVAL)
+			/* no SEEK_DATA here, no holes either */
+			data = offset;
+		else if (data < 0)
+			ERR_GOTO("lseek");
+		if (data >= size)
+			break;
+
+		off_t hole = map->len + 1 == SPARSE_MAX_EXTENTS ?
+				     size :
+				     lseek(fd, data, SEEK_HOLE);
+		if (hole < 0 && errno == EINVAL)
+			hole = size;
+		else if (hole < 0)
+			ERR_GOTO("lseek");
+		if (hole > size)
+			hole = size;
+
+		if (add_extent(map, data, hole - data) < 0)
+			goto error;
+		offset = hole;
+	}
+
+	return 0;
+
+error:
+	destroy_extent_map(map);
+
+	return -1;
+}
+
+void destroy_extent_map(extent_map_t *map)
+{
+	free(map->extents);
+	*map = (extent_map_t){ 0 };
+}
+
+int send_sparse_entry(int soc, entry_t *entry, transfer_engine engine,
+		      progress_bar_t *prog_bar)
+{
+	const int fd = open_entry(entry, op_read);
+	if (fd < 0)
+		return -1;
+
+	int ret = -1;
+	extent_map_t map;
+	if (map_extents(fd, entry->size, &map) < 0)
+		goto cleanup;
+
+	uint64_t len = map.len;
+	if (perf_soc_op(soc, op_write, &len, sizeof(len), NULL) < 0 ||
+	    (len && perf_soc_op(soc, op_write, map.extents,
+				len * sizeof(extent_t), NULL) < 0))
+		goto cleanup;
+
+	for (size_t i = 0; i < map.len; ++i) {
+		const extent_t *e = &map.extents[i];
+		if (send_range(soc, fd, e->offset, e->len, engine, NULL) < 0)
+			goto cleanup;
+
+		if (prog_bar)
+			prog_bar_advance(prog_bar, e->offset + e->len);
+	}
+
+	if (prog_bar)
+		prog_bar_finish(prog_bar);
+	ret = 0;
+
+cleanup:
+	destroy_extent_map(&map);
+	close(fd);
+
+	return ret;
+}
+
+/* extents have to be in order, apart and inside of the file */
+static int check_extents(const extent_t *extents, size_t len, off_t size)
+{
+	off_t end = 0;
+
+	for (size_t i = 0; i < len; ++i) {
+		if (extents[i].offset < end || extents[i].len <= 0 ||
+		    extents[i].len > size - extents[i].offset)
+			return -1;
+		end = extents[i].offset + extents[i].len;
+	}
+
+	return 0;
+}
+
+int recv_sparse_entry(int soc, entry_t *entry, transfer_engine engine,
+		      progress_bar_t *prog_bar)
+{
+	uint64_t len;
+	if (perf_soc_op(soc, op_read, &len, sizeof(len), NULL) < 0)
+		return -1;
+
+	if (len > SPARSE_MAX_EXTENTS) {
+		fprintf(stderr, "`%s` has too many extents\n", entry->rel_path);
+		return -1;
+	}
+
+	extent_t *extents = malloc(len * sizeof(extent_t) + 1);
+	if (!extents) {
+		PERROR("malloc");
+		return -1;
+	}
+
+	int fd = -1, ret = -1;
+	if (len && perf_soc_op(soc, op_read, extents, len * sizeof(extent_t),
+			       NULL) < 0)
+		goto cleanup;
+
+	if (check_extents(extents, len, entry->size) < 0) {
+		fprintf(stderr, "malformed extents for `%s`\n",
+			entry->rel_path);
+		goto cleanup;
+	}
+
+	if ((fd = open_entry(entry, op_write)) < 0)
+		goto cleanup;
+
+	/* whatever no extent covers stays a hole */
+	if (ftruncate(fd, entry->size) < 0) {
+		PERROR("ftruncate");
+		goto cleanup;
+	}
+
+	for (size_t i = 0; i < len; ++i) {
+		if (recv_range(soc, fd, extents[i].offset, extents[i].len,
+			       engine, NULL) < 0)
+			goto cleanup;
+
+		if (prog_bar)
+			prog_bar_advance(prog_bar,
+					 extents[i].offset + extents[i].len);
+	}
+
+	if (prog_bar)
+		prog_bar_finish(prog_bar);
+	ret = 0;
+
+cleanup:
+	if (fd >= 0)
+		close(fd);
+	free(extents);
+
+	return ret;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "entry.h"
+#include "progress_bar.h"
+#include "transfer.h"
+
+/* past this many extents the rest of the file is sent as one */
+#define SPARSE_MAX_EXTENTS (1 << 16)
+
+/*
+ * tf_sparse: every entry that is not batched is sent as a uint64_t count of
+ * its data extents, the extents in file order, and then the data of each,
+ * everything outside of them is a hole the receiver does not write
+ */
+typedef struct extent {
+	off_t offset;
+	off_t len;
+} extent_t;
+
+typedef struct extent_map {
+	size_t len;
+	size_t cap;
+	extent_t *extents;
+} extent_map_t;
+
+/*
+ * finds the data of the first size bytes of fd with SEEK_DATA/SEEK_HOLE,
+ * filesystems without holes report everything as one extent
+ */
+int map_extents(int fd, off_t size, extent_map_t *map);
+void destroy_extent_map(extent_map_t *map);
+
+/* chdir to entries_t.parent_path before running */
+int send_sparse_entry(int soc, entry_t *entry, transfer_engine engine,
+		      progress_bar_t *prog_bar);
+int recv_sparse_entry(int soc, entry_t *entry, transfer_engine engine,
+		      progress_bar_t *prog_bar);
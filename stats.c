@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "probes.h"
+#include "stats.h"
+
+static const char *const phase_names[STATS_PHASES] = {
+	[sp_scan] = "scan",
+	[sp_handshake] = "handshake",
+	[sp_metadata] = "metadata",
+	[sp_data] = "data",
+	[sp_verify] = "verify",
+};
+
+static __thread session_stats_t *current = NULL;
+
+/* sessions that are still running */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static session_stats_t *running = NULL;
+static size_t running_len = 0;
+
+/* what the sessions that are over added up to */
+static session_stats_t totals;
+static atomic_uint_fast64_t next_id = 1;
+static atomic_uint_fast64_t finished = 0;
+static atomic_uint_fast64_t failed = 0;
+static int64_t process_start_ns = 0;
+
+#define ADD(counter, n) \
+	atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
+#define LOAD(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+int64_t stats_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+void stats_start(session_stats_t *s, const char *peer, stats_phase phase)
+{
+	*s = (session_stats_t){
+		.id = ADD(next_id, 1),
+		.peer = peer,
+		.start_ns = stats_now_ns(),
+		.phase = phase,
+	};
+	s->phase_start_ns = s->start_ns;
+
+	pthread_mutex_lock(&registry_lock);
+	if (process_start_ns == 0)
+		process_start_ns = s->start_ns;
+	s->next = running;
+	if (running)
+		running->prev = s;
+	running = s;
+	running_len++;
+	pthread_mutex_unlock(&registry_lock);
+
+	PROBE2(session__start, s->id, s->peer);
+}
+
+void stats_move(session_stats_t *to, session_stats_t *from, const char *peer)
+{
+	pthread_mutex_lock(&registry_lock);
+	*to = *from;
+	to->peer = peer;
+	if (to->prev)
+		to->prev->next = to;
+	else
+		running = to;
+	if (to->next)
+		to->next->prev = to;
+	pthread_mutex_unlock(&registry_lock);
+}
+
+static void end_phase(session_stats_t *s, int64_t now, stats_phase next)
+{
+	const int64_t ns = now - s->phase_start_ns;
+
+	PROBE4(session__phase, s->id, s->phase, next, ns);
+	ADD(s->phase_ns[s->phase], ns);
+	s->phase_start_ns = now;
+}
+
+void stats_finish(session_stats_t *s, bool ok)
+{
+	end_phase(s, stats_now_ns(), s->phase);
+	s->failed = !ok;
+	s->done = true;
+
+	pthread_mutex_lock(&registry_lock);
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		running = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	running_len--;
+	pthread_mutex_unlock(&registry_lock);
+
+	ADD(totals.bytes_in, LOAD(s->bytes_in));
+	ADD(totals.bytes_out, LOAD(s->bytes_out));
+	ADD(totals.files, LOAD(s->files));
+	ADD(totals.syscalls, LOAD(s->syscalls));
+	ADD(totals.poll_ns, LOAD(s->poll_ns));
+	for (unsigned i = 0; i < STATS_PHASES; ++i)
+		ADD(totals.phase_ns[i], LOAD(s->phase_ns[i]));
+	ADD(*(ok ? &finished : &failed), 1);
+
+	PROBE2(session__done, s->id, ok);
+}
+
+void stats_attach(session_stats_t *s)
+{
+	current = s;
+}
+
+session_stats_t *stats_current(void)
+{
+	return current;
+}
+
+void stats_phase_begin(stats_phase phase)
+{
+	if (!current || current->phase == phase)
+		return;
+
+	end_phase(current, stats_now_ns(), phase);
+	current->phase = phase;
+}
+
+void stats_files(uint64_t files)
+{
+	if (current)
+		ADD(current->files, files);
+}
+
+void stats_syscall(void)
+{
+	if (current)
+		ADD(current->syscalls, 1);
+}
+
+void stats_io(operation_type op, ssize_t bytes)
+{
+	if (!current)
+		return;
+
+	ADD(current->syscalls, 1);
+	if (bytes > 0)
+		ADD(*(op == op_read ? &current->bytes_in : &current->bytes_out),
+		    bytes);
+}
+
+void stats_poll(int64_t ns)
+{
+	if (!current)
+		return;
+
+	ADD(current->syscalls, 1);
+	ADD(current->poll_ns, ns);
+}
+
+static void print_counters(FILE *f, const session_stats_t *s, int64_t now)
+{
+	fprintf(f,
+		"\"bytes_in\": %ju, \"bytes_out\": %ju, \"files\": %ju, "
+		"\"syscalls\": %ju, \"poll_s\": %.6f, \"phases\": {",
+		(uintmax_t)LOAD(s->bytes_in), (uintmax_t)LOAD(s->bytes_out),
+		(uintmax_t)LOAD(s->files), (uintmax_t)LOAD(s->syscalls),
+		LOAD(s->poll_ns) * 1.0e-9);
+
+	/* the running phase is only added up when it ends */
+	const int phase = s->phase;
+	const bool live = s != &totals && !s->done;
+	for (unsigned i = 0; i < STATS_PHASES; ++i) {
+		uint64_t ns = LOAD(s->phase_ns[i]);
+		if (live && i == phase)
+			ns += now - s->phase_start_ns;
+		fprintf(f, "%s\"%s_s\": %.6f", i ? ", " : "", phase_names[i],
+			ns * 1.0e-9);
+	}
+	fputc('}', f);
+}
+
+void stats_print_session(FILE *f, const session_stats_t *s)
+{
+	const int64_t now = s->done ? s->phase_start_ns : stats_now_ns();
+
+	fprintf(f, "{\"id\": %ju, \"peer\": \"%s\", \"state\": \"%s\", ",
+		(uintmax_t)s->id, s->peer ? s->peer : "",
+		!s->done ? "running" :
+		s->failed ? "failed" :
+			    "finished");
+	fprintf(f, "\"elapsed_s\": %.6f, ", (now - s->start_ns) * 1.0e-9);
+	print_counters(f, s, now);
+	fputc('}', f);
+}
+
+void stats_print_all(FILE *f)
+{
+	const int64_t now = stats_now_ns();
+
+	pthread_mutex_lock(&registry_lock);
+
+	fprintf(f,
+		"{\"uptime_s\": %.6f, \"sessions\": {\"running\": %zu, "
+		"\"finished\": %ju, \"failed\": %ju},\n \"totals\": {",
+		process_start_ns ? (now - process_start_ns) * 1.0e-9 : 0.0,
+		running_len, (uintmax_t)LOAD(finished),
+		(uintmax_t)LOAD(failed));
+	print_counters(f, &totals, now);
+	fputs("},\n \"running\": [", f);
+	for (const session_stats_t *s = running; s; s = s->next) {
+		fputs(s == running ? "\n  " : ",\n  ", f);
+		stats_print_session(f, s);
+	}
+	fputs("]}\n", f);
+
+	pthread_mutex_unlock(&registry_lock);
+}
+
+static void *serve(void *arg)
+{
+	const int soc = (intptr_t)arg;
+
+	while (true) {
+		const int peer = accept(soc, NULL, NULL);
+		if (peer < 0) {
+			PERROR("accept");
+			continue;
+		}
+
+		char *doc = NULL;
+		size_t len = 0;
+		FILE *f = open_memstream(&doc, &len);
+		if (f) {
+			stats_print_all(f);
+			fclose(f);
+			/* whoever asked may be gone already */
+			for (size_t sent = 0; sent < len;) {
+				const ssize_t s = send(peer, doc + sent,
+						       len - sent,
+						       MSG_NOSIGNAL);
+				if (s <= 0)
+					break;
+				sent += s;
+			}
+		}
+		free(doc);
+		close(peer);
+	}
+
+	return NULL;
+}
+
+int stats_serve(const char *path)
+{
+	if (process_start_ns == 0)
+		process_start_ns = stats_now_ns();
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "stats socket path %s is too long\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	const int soc = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (soc < 0) {
+		PERROR("socket");
+		return -1;
+	}
+
+	/* left behind by an earlier run */
+	unlink(path);
+	if (bind(soc, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		ERR_GOTO("bind");
+	if (listen(soc, 8) < 0)
+		ERR_GOTO("listen");
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, serve, (void *)(intptr_t)soc)) {
+		PERROR("pthread_create");
+		goto error;
+	}
+	pthread_detach(tid);
+
+	return 0;
+
+error:
+	close(soc);
+	return -1;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "core.h"
+
+typedef enum stats_phase {
+	/* walking the tree, only on the sending side */
+	sp_scan,
+	/* hello, request and the answer to it */
+	sp_handshake,
+	sp_metadata,
+	sp_data,
+	/* waiting for the digests and comparing them, only with tf_verify */
+	sp_verify,
+} stats_phase;
+
+#define STATS_PHASES (sp_verify + 1)
+
+/*
+ * counters of one session, the threads working for it add to them and
+ * anyone may read them while it runs
+ */
+typedef struct session_stats {
+	uint64_t id;
+	/* owned by whoever owns the stats */
+	const char *peer;
+	int64_t start_ns;
+
+	atomic_uint_fast64_t bytes_in;
+	atomic_uint_fast64_t bytes_out;
+	atomic_uint_fast64_t files;
+	atomic_uint_fast64_t syscalls;
+	/* time spent waiting for the socket in poll */
+	atomic_uint_fast64_t poll_ns;
+	atomic_uint_fast64_t phase_ns[STATS_PHASES];
+
+	/* the running phase, only changed by the thread that owns it */
+	atomic_int phase;
+	atomic_int_fast64_t phase_start_ns;
+	atomic_bool done;
+	atomic_bool failed;
+
+	struct session_stats *prev;
+	struct session_stats *next;
+} session_stats_t;
+
+int64_t stats_now_ns(void);
+
+/* registers the session with the process wide stats */
+void stats_start(session_stats_t *s, const char *peer, stats_phase phase);
+/*
+ * a running session continues in to, e.g. when another thread takes it over
+ * from is not registered anymore afterwards and peer replaces its peer
+ */
+void stats_move(session_stats_t *to, session_stats_t *from, const char *peer);
+/* ends the running phase and moves the counters to the totals */
+void stats_finish(session_stats_t *s, bool ok);
+
+/* what the calling thread does is counted for s, NULL stops counting */
+void stats_attach(session_stats_t *s);
+session_stats_t *stats_current(void);
+
+/* everything below goes to the stats of the calling thread, if any */
+void stats_phase_begin(stats_phase phase);
+void stats_files(uint64_t files);
+void stats_syscall(void);
+/* a syscall that moved bytes to or from the peer */
+void stats_io(operation_type op, ssize_t bytes);
+void stats_poll(int64_t ns);
+
+/* a json object, without a newline */
+void stats_print_session(FILE *f, const session_stats_t *s);
+/* the totals of all sessions and every session that is still running */
+void stats_print_all(FILE *f);
+
+/*
+ * serves stats_print_all to every connection to a unix socket at path,
+ * from a thread of its own
+ */
+int stats_serve(const char *path);
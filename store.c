@@ -0,0 +1,146 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "store.h"
+
+/* xx/xxxx... */
+#define CHUNK_NAME_SIZE (2 + 1 + 32 + 1)
+
+static void chunk_name(const chunk_id_t *id, char name[CHUNK_NAME_SIZE])
+{
+	snprintf(name, CHUNK_NAME_SIZE, "%02" PRIx64 "/%016" PRIx64 "%016" PRIx64,
+		 id->h[0] >> 56, id->h[0], id->h[1]);
+}
+
+int open_store(const char *download_dir)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/" STORE_DIR, download_dir);
+
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+		PERROR("mkdir");
+		return -1;
+	}
+
+	const int fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		PERROR("open");
+
+	return fd;
+}
+
+bool store_has(int store, const chunk_id_t *id)
+{
+	char name[CHUNK_NAME_SIZE];
+	chunk_name(id, name);
+
+	return faccessat(store, name, F_OK, 0) == 0;
+}
+
+int store_put(int store, const chunk_id_t *id, const void *data, size_t len)
+{
+	char name[CHUNK_NAME_SIZE];
+	char tmp[CHUNK_NAME_SIZE + 32];
+	chunk_name(id, name);
+	snprintf(tmp, sizeof(tmp), "%s.%d.%lx", name, getpid(),
+		 (unsigned long)pthread_self());
+
+	name[2] = '\0';
+	if (mkdirat(store, name, 0700) < 0 && errno != EEXIST) {
+		PERROR("mkdirat");
+		return -1;
+	}
+	name[2] = '/';
+
+	const int fd = openat(store, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		PERROR("openat");
+		return -1;
+	}
+
+	int ret = 0;
+	for (size_t written = 0; written < len;) {
+		const ssize_t w = write(fd, (const char *)data + written,
+					len - written);
+		if (w < 0) {
+			PERROR("write");
+			ret = -1;
+			break;
+		}
+		written += w;
+	}
+	close(fd);
+
+	/* a chunk only shows up in the index once it is complete */
+	if (ret == 0 && renameat(store, tmp, store, name) < 0) {
+		PERROR("renameat");
+		ret = -1;
+	}
+	if (ret < 0)
+		unlinkat(store, tmp, 0);
+
+	return ret;
+}
+
+int store_open(int store, const chunk_id_t *id)
+{
+	char name[CHUNK_NAME_SIZE];
+	chunk_name(id, name);
+
+	const int fd = openat(store, name, O_RDONLY);
+	if (fd < 0)
+		PERROR("openat");
+
+	return fd;
+}
+
+int chunk_set_init(chunk_set_t *set, size_t expected)
+{
+	size_t size = 64;
+	while (size < 2 * expected)
+		size <<= 1;
+
+	*set = (chunk_set_t){
+		.mask = size - 1,
+		.ids = malloc(size * sizeof(chunk_id_t)),
+		.used = calloc(size, sizeof(bool)),
+	};
+	if (!set->ids || !set->used) {
+		PERROR("malloc");
+		destroy_chunk_set(set);
+		return -1;
+	}
+
+	return 0;
+}
+
+bool chunk_set_add(chunk_set_t *set, const chunk_id_t *id)
+{
+	/* the ids are hashes already */
+	size_t i = id->h[1] & set->mask;
+
+	for (; set->used[i]; i = (i + 1) & set->mask) {
+		if (chunk_id_eq(&set->ids[i], id))
+			return false;
+	}
+
+	set->used[i] = true;
+	set->ids[i] = *id;
+
+	return true;
+}
+
+void destroy_chunk_set(chunk_set_t *set)
+{
+	free(set->ids);
+	free(set->used);
+	*set = (chunk_set_t){ 0 };
+}
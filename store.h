@@ -0,0 +1,32 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cdc.h"
+
+/*
+ * chunks received with tf_dedup are kept under the downloads dir, one file
+ * per chunk named by its id and fanned out over 256 dirs, the directory tree
+ * itself is the index, so it survives restarts and is shared by every
+ * transfer and user
+ */
+#define STORE_DIR ".fs_chunks"
+
+/* returns a fd of the store dir, created in download_dir if needed */
+int open_store(const char *download_dir);
+bool store_has(int store, const chunk_id_t *id);
+/* writes the chunk atomically, concurrent puts of the same chunk are fine */
+int store_put(int store, const chunk_id_t *id, const void *data, size_t len);
+int store_open(int store, const chunk_id_t *id);
+
+/* the chunks one transfer already asked for or found */
+typedef struct chunk_set {
+	size_t mask;
+	chunk_id_t *ids;
+	bool *used;
+} chunk_set_t;
+
+int chunk_set_init(chunk_set_t *set, size_t expected);
+/* returns false if the id was in the set already */
+bool chunk_set_add(chunk_set_t *set, const chunk_id_t *id);
+void destroy_chunk_set(chunk_set_t *set);
@@ -1,143 +1,373 @@
 #include "stream.h"
 #include "core.h"
+#include "probes.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
-void *stream_add_item(stream_t *stream, size_t size)
+/* chunks start small, so the many short streams of pipelining stay cheap */
+#define STREAM_CHUNK_MIN (4 << 10)
+#define STREAM_CHUNK_MAX (1 << 20)
+#define STREAM_MAX_THREADS 64
+
+static stream_chunk_t *new_chunk(size_t cap)
 {
-	const bool resize_metadata =
-		(stream->metadata.len + 1) * sizeof(size_t) >
-		stream->metadata.cap;
-	const bool resize = stream->size + size > stream->cap;
-
-	if (resize_metadata) {
-		const size_t resize = stream->metadata.cap == 0 ?
-					      sizeof(size_t) :
-					      stream->metadata.cap;
-		void *new_mem = realloc(stream->metadata.sizes,
-					stream->metadata.cap + resize);
-		if (new_mem == NULL)
-			ERR_GOTO("realloc");
-		stream->metadata.sizes = new_mem;
-		stream->metadata.cap += resize;
+	stream_chunk_t *chunk = malloc(sizeof(stream_chunk_t) + cap);
+	if (chunk == NULL) {
+		PERROR("malloc");
+		return NULL;
 	}
 
-	if (resize) {
-		const size_t resize = stream->size + size > stream->cap * 2 ?
-					      size :
-					      stream->cap;
-		void *new_mem = realloc(stream->data, stream->cap + resize);
-		if (new_mem == NULL)
-			ERR_GOTO("realloc");
-		stream->data = new_mem;
-		stream->cap += resize;
+	chunk->next = NULL;
+	chunk->cap = cap;
+	chunk->size = 0;
+
+	return chunk;
+}
+
+static int grow(void **mem, size_t *cap, size_t elem_size, size_t needed)
+{
+	if (needed <= *cap)
+		return 0;
+
+	const size_t new_cap = *cap ? 2 * *cap : 16;
+	void *new_mem = realloc(*mem, new_cap * elem_size);
+	if (new_mem == NULL) {
+		PERROR("realloc");
+		return -1;
 	}
+	*mem = new_mem;
+	*cap = new_cap;
+
+	return 0;
+}
+
+void *stream_add_item(stream_t *stream, size_t size)
+{
+	size_t sizes_cap = stream->metadata.cap / sizeof(size_t);
+	if (grow((void **)&stream->metadata.sizes, &sizes_cap, sizeof(size_t),
+		 stream->metadata.len + 1) < 0)
+		return NULL;
+	stream->metadata.cap = sizes_cap * sizeof(size_t);
 
+	if (stream->index &&
+	    grow((void **)&stream->index, &stream->index_cap, sizeof(void *),
+		 stream->metadata.len + 1) < 0)
+		return NULL;
+
+	stream_chunk_t *tail = stream->tail;
+	if (!tail || tail->cap - tail->size < size) {
+		size_t cap = tail ? 2 * tail->cap : STREAM_CHUNK_MIN;
+		if (cap > STREAM_CHUNK_MAX)
+			cap = STREAM_CHUNK_MAX;
+		if (cap < size)
+			cap = size;
+
+		stream_chunk_t *chunk = new_chunk(cap);
+		if (chunk == NULL)
+			return NULL;
+
+		if (tail)
+			tail->next = chunk;
+		else
+			stream->head = chunk;
+		stream->tail = tail = chunk;
+	}
+
+	void *ret = tail->data + tail->size;
+	tail->size += size;
+	stream->size += size;
+
+	if (stream->index)
+		stream->index[stream->metadata.len] = ret;
 	stream->metadata.sizes[stream->metadata.len] = size;
 	stream->metadata.len++;
 
-	void *ret = (void *)((uintptr_t)stream->data + stream->size);
-	stream->size += size;
+	PROBE3(stream__add, stream->metadata.len, stream->size, size);
 
 	return ret;
-
-error:
-	return NULL;
 }
 
 void destroy_stream(stream_t *stream)
 {
+	for (stream_chunk_t *chunk = stream->head, *next; chunk;
+	     chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
 	free(stream->metadata.sizes);
-	free(stream->data);
+	free(stream->index);
+}
+
+int stream_build_index(stream_t *stream)
+{
+	if (stream->index)
+		return 0;
+
+	const size_t cap = stream->metadata.len ? stream->metadata.len : 1;
+	void **index = malloc(cap * sizeof(void *));
+	if (index == NULL) {
+		PERROR("malloc");
+		return -1;
+	}
+
+	stream_iter_t it;
+	stream_iter_init(&it, stream);
+	for (size_t i = 0; i < stream->metadata.len; ++i)
+		index[i] = stream_iter_next(&it);
+
+	stream->index = index;
+	stream->index_cap = cap;
+
+	return 0;
+}
+
+void *stream_get(const stream_t *stream, size_t i)
+{
+	if (i >= stream->metadata.len)
+		return NULL;
+
+	if (stream->index)
+		return stream->index[i];
+
+	stream_iter_t it;
+	stream_iter_init(&it, stream);
+	void *item;
+	do {
+		item = stream_iter_next(&it);
+	} while (it.i <= i);
+
+	return item;
 }
 
 void stream_iter_init(stream_iter_t *it, const stream_t *stream)
 {
 	*it = (stream_iter_t){
 		.stream = stream,
-		.curr = stream->data,
+		.chunk = stream->head,
+		.off = 0,
 		.i = 0,
 	};
 }
 
 void *stream_iter_next(stream_iter_t *it)
 {
-	void *curr = it->curr;
-
 	if (it->i == it->stream->metadata.len)
 		return NULL;
 
-	it->curr = (void *)((uintptr_t)it->curr +
-			    it->stream->metadata.sizes[it->i]);
+	while (it->off == it->chunk->size) {
+		it->chunk = it->chunk->next;
+		it->off = 0;
+	}
+
+	void *curr = (void *)(it->chunk->data + it->off);
+	it->off += it->stream->metadata.sizes[it->i];
 	it->i++;
 
 	return curr;
 }
 
-struct stream_info {
-	size_t len;
-	size_t size;
-};
+typedef struct stream_range {
+	stream_t *stream;
+	size_t begin;
+	size_t end;
+	stream_range_fn fn;
+	void *arg;
+	int ret;
+} stream_range_t;
 
-int send_stream(int soc, stream_t *restrict stream)
+static void *run_range(void *arg)
 {
-	struct stream_info sinfo = {
-		.len = stream->metadata.len,
-		.size = stream->size,
-	};
+	stream_range_t *r = arg;
+	r->ret = r->fn(r->stream, r->begin, r->end, r->arg);
 
-	if (perf_soc_op(soc, op_write, &sinfo, sizeof(struct stream_info),
-			NULL) < 0)
-		return -1;
+	return NULL;
+}
 
-	if (perf_soc_op(soc, op_write, stream->metadata.sizes,
-			sinfo.len * sizeof(size_t), NULL) < 0)
-		return -1;
+int stream_parallel_for(stream_t *stream, unsigned threads,
+			stream_range_fn fn, void *arg)
+{
+	const size_t len = stream->metadata.len;
+
+	if (threads > STREAM_MAX_THREADS)
+		threads = STREAM_MAX_THREADS;
+	if (threads > len)
+		threads = len;
+	if (len == 0)
+		return 0;
 
-	if (perf_soc_op(soc, op_write, stream->data, sinfo.size, NULL) < 0)
+	if (stream_build_index(stream) < 0)
 		return -1;
 
-	return 0;
+	if (threads <= 1)
+		return fn(stream, 0, len, arg) < 0 ? -1 : 0;
+
+	stream_range_t ranges[STREAM_MAX_THREADS];
+	pthread_t tids[STREAM_MAX_THREADS];
+	bool started[STREAM_MAX_THREADS] = { false };
+
+	for (unsigned t = 0; t < threads; ++t) {
+		ranges[t] = (stream_range_t){
+			.stream = stream,
+			.begin = len * t / threads,
+			.end = len * (t + 1) / threads,
+			.fn = fn,
+			.arg = arg,
+		};
+	}
+
+	/* this thread takes the first range and any that could not start */
+	for (unsigned t = 1; t < threads; ++t) {
+		if (pthread_create(&tids[t], NULL, run_range, &ranges[t]) == 0)
+			started[t] = true;
+		else
+			PERROR("pthread_create");
+	}
+
+	run_range(&ranges[0]);
+	int ret = ranges[0].ret;
+
+	for (unsigned t = 1; t < threads; ++t) {
+		if (started[t])
+			pthread_join(tids[t], NULL);
+		else
+			run_range(&ranges[t]);
+		if (ranges[t].ret < 0)
+			ret = -1;
+	}
+
+	return ret < 0 ? -1 : 0;
 }
 
-int recv_stream(int soc, stream_t *restrict stream)
+int stream_alloc(stream_t *stream, const stream_info_t *sinfo,
+		 size_t min_item)
 {
-	struct stream_info sinfo;
-
-	if (perf_soc_op(soc, op_read, &sinfo, sizeof(struct stream_info),
-			NULL) < 0)
+	if (sinfo->size > MAX_STREAM_SIZE ||
+	    sinfo->len > sinfo->size / min_item ||
+	    sinfo->len > SIZE_MAX / sizeof(size_t)) {
+		fprintf(stderr, "invalid stream of %zu items, %zu bytes\n",
+			sinfo->len, sinfo->size);
+		*stream = (stream_t){ 0 };
 		return -1;
+	}
 
 	*stream = (stream_t){
 		.metadata = {
-			.cap = sinfo.len * sizeof(size_t),
-			.len = sinfo.len,
-			.sizes = malloc(sinfo.len * sizeof(size_t)),
+			.cap = sinfo->len * sizeof(size_t),
+			.len = sinfo->len,
+			.sizes = malloc(sinfo->len * sizeof(size_t)),
 		},
-		.cap = sinfo.size,
-		.size = sinfo.size,
-		.data = malloc(sinfo.size),
+		.size = sinfo->size,
+		.head = new_chunk(sinfo->size),
 	};
+	stream->tail = stream->head;
 
-	if (stream->metadata.sizes == NULL || stream->data == NULL)
+	if (stream->metadata.sizes == NULL || stream->head == NULL)
 		ERR_GOTO("malloc");
+	stream->head->size = sinfo->size;
+
+	return 0;
+
+error:
+	destroy_stream(stream);
+	*stream = (stream_t){ 0 };
+
+	return -1;
+}
+
+int stream_check(const stream_t *stream, size_t min_item)
+{
+	size_t total = 0;
+
+	for (size_t i = 0; i < stream->metadata.len; ++i) {
+		const size_t size = stream->metadata.sizes[i];
+		if (size < min_item || size > stream->size - total) {
+			fprintf(stderr, "stream item %zu does not fit\n", i);
+			return -1;
+		}
+		total += size;
+	}
+
+	if (total != stream->size) {
+		fprintf(stderr, "stream items do not cover its data\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int send_stream(int soc, stream_t *restrict stream)
+{
+	stream_info_t sinfo = {
+		.len = stream->metadata.len,
+		.size = stream->size,
+	};
+	int ret = -1;
+
+	frame_writer_t w;
+	frame_init(&w, soc);
+
+	PROBE3(stream__send__start, soc, sinfo.len, sinfo.size);
+
+	if (frame_put(&w, &sinfo, sizeof(stream_info_t)) < 0)
+		goto error;
+
+	if (frame_put(&w, stream->metadata.sizes, sinfo.len * sizeof(size_t)) <
+	    0)
+		goto error;
+
+	for (stream_chunk_t *chunk = stream->head; chunk; chunk = chunk->next) {
+		if (frame_put(&w, chunk->data, chunk->size) < 0)
+			goto error;
+	}
+
+	if (frame_flush(&w) < 0)
+		goto error;
+
+	ret = 0;
+
+error:
+	PROBE4(stream__send__done, soc, sinfo.len, sinfo.size, ret);
+
+	return ret;
+}
+
+int recv_stream(int soc, stream_t *restrict stream, size_t min_item)
+{
+	stream_info_t sinfo = { 0 };
+
+	PROBE1(stream__recv__start, soc);
+
+	if (perf_soc_op(soc, op_read, &sinfo, sizeof(stream_info_t), NULL) <
+	    0)
+		goto fail;
+
+	if (stream_alloc(stream, &sinfo, min_item) < 0)
+		goto fail;
 
 	if (perf_soc_op(soc, op_read, stream->metadata.sizes,
 			sinfo.len * sizeof(size_t), NULL) < 0)
 		goto error;
 
-	if (perf_soc_op(soc, op_read, stream->data, sinfo.size, NULL) < 0)
+	if (stream_check(stream, min_item) < 0)
+		goto error;
+
+	if (perf_soc_op(soc, op_read, stream->head->data, sinfo.size, NULL) <
+	    0)
 		goto error;
 
+	PROBE4(stream__recv__done, soc, sinfo.len, sinfo.size, 0);
+
 	return 0;
 
 error:
-	free(stream->metadata.sizes);
-	free(stream->data);
-
+	destroy_stream(stream);
 	*stream = (stream_t){ 0 };
+fail:
+	PROBE4(stream__recv__done, soc, sinfo.len, sinfo.size, -1);
 
 	return -1;
 }
@@ -1,6 +1,16 @@
 #pragma once
+#include <stdalign.h>
+#include <stddef.h>
 #include <sys/types.h>
 
+/* items are packed into chunks, a chunk is never moved or resized */
+typedef struct stream_chunk {
+	struct stream_chunk *next;
+	size_t cap;
+	size_t size;
+	alignas(max_align_t) char data[];
+} stream_chunk_t;
+
 typedef struct stream {
 	struct offsets {
 		size_t cap;
@@ -8,22 +18,66 @@ typedef struct stream {
 		size_t *sizes;
 	} metadata;
 
-	size_t cap;
+	/* bytes taken by all items */
 	size_t size;
-	void *data;
+	stream_chunk_t *head;
+	stream_chunk_t *tail;
+
+	/* NULL until stream_build_index, then item i is at index[i] */
+	void **index;
+	size_t index_cap;
 } stream_t;
 
+/* the address stays valid until the stream is destroyed */
 void *stream_add_item(stream_t *stream, size_t size);
 void destroy_stream(stream_t *stream);
 
+/* kept up to date by stream_add_item once built */
+int stream_build_index(stream_t *stream);
+/* O(1) with an index, otherwise walks the stream */
+void *stream_get(const stream_t *stream, size_t i);
+
 typedef struct stream_iter {
 	const stream_t *stream;
-	void *curr;
+	const stream_chunk_t *chunk;
+	size_t off;
 	size_t i;
 } stream_iter_t;
 
 void stream_iter_init(stream_iter_t *it, const stream_t *stream);
 void *stream_iter_next(stream_iter_t *it);
 
+/* called with the items [begin, end), returning -1 marks the run failed */
+typedef int (*stream_range_fn)(stream_t *stream, size_t begin, size_t end,
+			       void *arg);
+/*
+ * splits the items into threads ranges of about the same length and runs
+ * fn on each of them in parallel, builds the index if there is none
+ * returns -1 if any of the ranges failed
+ */
+int stream_parallel_for(stream_t *stream, unsigned threads,
+			stream_range_fn fn, void *arg);
+
+/* what send_stream puts on the wire before the sizes and the data */
+typedef struct stream_info {
+	size_t len;
+	size_t size;
+} stream_info_t;
+
+/* the most item data a peer may send as one stream */
+#define MAX_STREAM_SIZE ((size_t)1 << 30)
+
+/*
+ * allocates an empty stream the described sizes and data can be read into,
+ * the data goes into the single chunk stream->head
+ * returns -1 for info no peer could have sent with items of at least
+ * min_item bytes
+ */
+int stream_alloc(stream_t *stream, const stream_info_t *sinfo,
+		 size_t min_item);
+/* the sizes that were read in have to add up to the data */
+int stream_check(const stream_t *stream, size_t min_item);
+
+/* the chunks go out back to back, as if the data was one buffer */
 int send_stream(int soc, stream_t *restrict stream);
-int recv_stream(int soc, stream_t *restrict stream);
+int recv_stream(int soc, stream_t *restrict stream, size_t min_item);
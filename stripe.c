@@ -0,0 +1,101 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "core.h"
+#include "stripe.h"
+
+static int stripe_add(stripe_t *stripe, stripe_item_t item)
+{
+	if (stripe->len == stripe->cap) {
+		const size_t cap = stripe->cap ? stripe->cap * 2 : 16;
+		void *new_mem = realloc(stripe->items, cap * sizeof(item));
+		if (new_mem == NULL) {
+			PERROR("realloc");
+			return -1;
+		}
+		stripe->items = new_mem;
+		stripe->cap = cap;
+	}
+
+	stripe->items[stripe->len++] = item;
+	stripe->total_size += item.len;
+
+	return 0;
+}
+
+/* least loaded stream, ties go to the lowest index */
+static stripe_t *lightest_stripe(stripe_plan_t *plan)
+{
+	stripe_t *min = &plan->stripes[0];
+
+	for (unsigned i = 1; i < plan->streams; ++i) {
+		if (plan->stripes[i].total_size < min->total_size)
+			min = &plan->stripes[i];
+	}
+
+	return min;
+}
+
+int plan_stripes(stream_t *entries, unsigned streams, stripe_plan_t *plan)
+{
+	assert(streams > 0 && streams <= MAX_STREAMS);
+
+	entry_table_t table = { 0 };
+	*plan = (stripe_plan_t){
+		.streams = streams,
+		.stripes = calloc(streams, sizeof(stripe_t)),
+	};
+	if (plan->stripes == NULL)
+		ERR_GOTO("calloc");
+
+	if (entry_table_from_stream(&table, entries) < 0 ||
+	    stream_build_index(entries) < 0)
+		goto error;
+
+	for (size_t i = 0; i < table.len; ++i) {
+		const off_t size = table.sizes[i];
+
+		/* the receiver creates every file up front */
+		if (table.types[i] == et_dir || size == 0)
+			continue;
+
+		off_t range = size;
+		if (size > STRIPE_SPLIT_SIZE) {
+			range = (size + streams - 1) / streams;
+			if (range < STRIPE_MIN_RANGE)
+				range = STRIPE_MIN_RANGE;
+		}
+
+		for (off_t off = 0; off < size; off += range) {
+			const stripe_item_t item = {
+				.entry = stream_get(entries, i),
+				.offset = off,
+				.len = size - off < range ? size - off : range,
+			};
+
+			if (stripe_add(lightest_stripe(plan), item) < 0)
+				goto error;
+		}
+	}
+
+	destroy_entry_table(&table);
+
+	return 0;
+
+error:
+	destroy_entry_table(&table);
+	destroy_stripe_plan(plan);
+
+	return -1;
+}
+
+void destroy_stripe_plan(stripe_plan_t *plan)
+{
+	if (plan->stripes) {
+		for (unsigned i = 0; i < plan->streams; ++i)
+			free(plan->stripes[i].items);
+	}
+	free(plan->stripes);
+
+	*plan = (stripe_plan_t){ 0 };
+}
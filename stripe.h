@@ -0,0 +1,38 @@
+#pragma once
+#include <sys/types.h>
+
+#include "entry.h"
+#include "stream.h"
+
+#define MAX_STREAMS 64
+/* files bigger than this get split into ranges across the streams */
+#define STRIPE_SPLIT_SIZE (64l << 20)
+#define STRIPE_MIN_RANGE (16l << 20)
+
+typedef struct stripe_item {
+	entry_t *entry;
+	off_t offset;
+	off_t len;
+} stripe_item_t;
+
+typedef struct stripe {
+	size_t len;
+	size_t cap;
+	stripe_item_t *items;
+
+	off_t total_size;
+} stripe_t;
+
+/*
+ * the plan only depends on the entries and the stream count, so the
+ * sender and the receiver compute the same one independently
+ * it is made from an entry_table_t, the items point into entries, which
+ * gets an index for that
+ */
+typedef struct stripe_plan {
+	unsigned streams;
+	stripe_t *stripes;
+} stripe_plan_t;
+
+int plan_stripes(stream_t *entries, unsigned streams, stripe_plan_t *plan);
+void destroy_stripe_plan(stripe_plan_t *plan);
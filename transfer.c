@@ -0,0 +1,573 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "entry.h"
+#include "stats.h"
+#include "transfer.h"
+#include "uring.h"
+#include "verify.h"
+#include "zerocopy.h"
+
+#define URING_ENTRIES 256
+#define URING_CHUNK (256 * 1024)
+#define URING_BUFS 4
+
+#define RANGE_BUF_SIZE (1 << 20)
+
+static const struct engine_info {
+	const char *name;
+	bool can_send;
+	bool can_recv;
+} engines[] = {
+	[te_mmap] = { "mmap", true, true },
+	[te_sendfile] = { "sendfile", true, false },
+	[te_splice] = { "splice", false, true },
+	[te_uring] = { "uring", true, true },
+};
+
+#define ENGINES_LEN (sizeof(engines) / sizeof(engines[0]))
+
+int parse_engine(const char *name, operation_type operation,
+		 transfer_engine *engine)
+{
+	for (size_t i = 0; i < ENGINES_LEN; ++i) {
+		if (strcmp(engines[i].name, name) != 0)
+			continue;
+
+		const bool usable = operation == op_write ? engines[i].can_send :
+							    engines[i].can_recv;
+		if (!usable)
+			break;
+
+		*engine = i;
+		return 0;
+	}
+
+	fprintf(stderr, "`%s` is not a valid %s engine\n", name,
+		operation == op_write ? "sending" : "receiving");
+
+	return -1;
+}
+
+const char *get_engine_name(transfer_engine engine)
+{
+	return engine < ENGINES_LEN ? engines[engine].name : "(???)";
+}
+
+void probe_engine(transfer_engine *engine)
+{
+	if (*engine != te_uring)
+		return;
+
+	uring_t ring;
+	if (uring_init(&ring, URING_ENTRIES) < 0) {
+		PERROR("io_uring_setup");
+		fprintf(stderr, "falling back to the %s engine\n",
+			get_engine_name(te_mmap));
+		*engine = te_mmap;
+		return;
+	}
+
+	uring_destroy(&ring);
+}
+
+bool engine_is_batched(transfer_engine engine)
+{
+	return engine == te_uring;
+}
+
+int send_mapping(int soc, const void *map, size_t len,
+		 progress_bar_t *prog_bar)
+{
+	if (zerocopy_worth(soc, len))
+		return zerocopy_send(soc, map, len, prog_bar);
+
+	return perf_soc_op(soc, op_write, (void *)map, len, prog_bar) < 0 ? -1 :
+									    0;
+}
+
+static int mmap_op(int soc, entry_t *entry, operation_type operation,
+		   progress_bar_t *prog_bar)
+{
+	entry_handles_t handles;
+	if (get_entry_handles(entry, &handles, operation) < 0)
+		return -1;
+
+	int ret = 0;
+	if (operation == op_write && ftruncate(handles.fd, handles.size) < 0) {
+		PERROR("ftruncate");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (operation == op_read)
+		ret = send_mapping(soc, handles.map, handles.size, prog_bar);
+	else if (perf_soc_op(soc, op_read, handles.map, handles.size,
+			     prog_bar) < 0)
+		ret = -1;
+	if (ret == 0)
+		verify_feed(0, handles.map, handles.size);
+
+cleanup:
+	close_entry_handles(&handles);
+
+	return ret;
+}
+
+static int file_op(int soc, entry_t *entry, operation_type operation,
+		   progress_bar_t *prog_bar)
+{
+	const int fd = open_entry(entry, operation);
+	if (fd < 0)
+		return -1;
+
+	const ssize_t ret =
+		perf_file_op(soc, operation == op_read ? op_write : op_read,
+			     fd, 0, entry->size, entry->size ? prog_bar : NULL);
+	close(fd);
+	/* nothing went through the socket, the file is still done */
+	if (ret >= 0 && !entry->size && prog_bar)
+		prog_bar_finish(prog_bar);
+
+	return ret < 0 ? -1 : 0;
+}
+
+int send_entry(int soc, entry_t *entry, transfer_engine engine,
+	       progress_bar_t *prog_bar)
+{
+	switch (engine) {
+	case te_mmap:
+		return mmap_op(soc, entry, op_read, prog_bar);
+	case te_sendfile:
+		return file_op(soc, entry, op_read, prog_bar);
+	case te_splice:
+	case te_uring:
+		break;
+	}
+
+	assert(false);
+	return -1;
+}
+
+int recv_entry(int soc, entry_t *entry, transfer_engine engine,
+	       progress_bar_t *prog_bar)
+{
+	switch (engine) {
+	case te_mmap:
+		return mmap_op(soc, entry, op_write, prog_bar);
+	case te_splice:
+		return file_op(soc, entry, op_write, prog_bar);
+	case te_sendfile:
+	case te_uring:
+		break;
+	}
+
+	assert(false);
+	return -1;
+}
+
+int send_range(int soc, int fd, off_t offset, size_t len,
+	       transfer_engine engine, progress_bar_t *prog_bar)
+{
+	if (engine == te_sendfile) {
+		const ssize_t ret =
+			perf_file_op(soc, op_write, fd, offset, len, prog_bar);
+		return ret < 0 ? -1 : 0;
+	}
+
+	/* mmap offsets have to be page aligned */
+	const off_t aligned = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+	const size_t map_len = len + (offset - aligned);
+
+	void *map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, aligned);
+	if (map == MAP_FAILED) {
+		PERROR("mmap");
+		return -1;
+	}
+
+	const void *data = (void *)((uintptr_t)map + (offset - aligned));
+	const int ret = send_mapping(soc, data, len, prog_bar);
+	if (ret == 0)
+		verify_feed(offset, data, len);
+	munmap(map, map_len);
+
+	return ret;
+}
+
+int recv_range(int soc, int fd, off_t offset, size_t len,
+	       transfer_engine engine, progress_bar_t *prog_bar)
+{
+	if (engine == te_splice) {
+		const ssize_t ret =
+			perf_file_op(soc, op_read, fd, offset, len, prog_bar);
+		return ret < 0 ? -1 : 0;
+	}
+
+	const size_t buf_size = len < RANGE_BUF_SIZE ? len : RANGE_BUF_SIZE;
+	char *buf = malloc(buf_size);
+	if (buf == NULL) {
+		PERROR("malloc");
+		return -1;
+	}
+
+	int ret = 0;
+	for (size_t done = 0; done < len;) {
+		const size_t chunk =
+			len - done < buf_size ? len - done : buf_size;
+
+		if (perf_soc_op(soc, op_read, buf, chunk, NULL) < 0) {
+			ret = -1;
+			break;
+		}
+
+		for (size_t written = 0; written < chunk;) {
+			const ssize_t w = pwrite(fd, buf + written,
+						 chunk - written,
+						 offset + done + written);
+			stats_syscall();
+			if (w < 0) {
+				PERROR("pwrite");
+				ret = -1;
+				goto cleanup;
+			}
+			written += w;
+		}
+		verify_feed(offset + done, buf, chunk);
+
+		done += chunk;
+		if (prog_bar)
+			prog_bar_advance(prog_bar, done);
+	}
+
+cleanup:
+	if (prog_bar)
+		prog_bar_finish(prog_bar);
+	free(buf);
+
+	return ret;
+}
+
+typedef enum uring_op {
+	uo_mkdir,
+	uo_open,
+	uo_read,
+	uo_write,
+	uo_send,
+	uo_recv,
+	uo_close,
+} uring_op;
+
+static const char *const uring_op_names[] = {
+	[uo_mkdir] = "mkdirat", [uo_open] = "openat", [uo_read] = "read",
+	[uo_write] = "write",	[uo_send] = "send",   [uo_recv] = "recv",
+	[uo_close] = "close",
+};
+
+/*
+ * every batch is a single chain of linked sqes, so the socket sees the
+ * chunks in order and a failed request cancels everything after it
+ * files are opened into the one direct descriptor slot and closed again
+ * inside the chain, so small files cost no syscalls of their own
+ */
+typedef struct uring_xfer {
+	uring_t ring;
+	int soc;
+
+	void *bufs;
+	unsigned next_buf;
+
+	struct io_uring_sqe *last;
+	unsigned queued;
+	size_t queued_bytes;
+
+	size_t done;
+	progress_bar_t *prog_bar;
+} uring_xfer_t;
+
+static int uring_xfer_init(uring_xfer_t *x, int soc, progress_bar_t *prog_bar)
+{
+	*x = (uring_xfer_t){
+		.soc = soc,
+		.prog_bar = prog_bar,
+	};
+
+	if (uring_init(&x->ring, URING_ENTRIES) < 0)
+		ERR_GOTO("io_uring_setup");
+
+	x->bufs = mmap(NULL, URING_BUFS * URING_CHUNK, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (x->bufs == MAP_FAILED) {
+		x->bufs = NULL;
+		ERR_GOTO("mmap");
+	}
+
+	const struct iovec iov = {
+		.iov_base = x->bufs,
+		.iov_len = URING_BUFS * URING_CHUNK,
+	};
+	if (uring_register_buffers(&x->ring, &iov, 1) < 0)
+		ERR_GOTO("io_uring_register buffers");
+	if (uring_register_files_sparse(&x->ring, 1) < 0)
+		ERR_GOTO("io_uring_register files");
+
+	return 0;
+
+error:
+	if (x->bufs)
+		munmap(x->bufs, URING_BUFS * URING_CHUNK);
+	uring_destroy(&x->ring);
+
+	return -1;
+}
+
+static void uring_xfer_destroy(uring_xfer_t *x)
+{
+	if (x->prog_bar)
+		prog_bar_finish(x->prog_bar);
+
+	munmap(x->bufs, URING_BUFS * URING_CHUNK);
+	uring_destroy(&x->ring);
+}
+
+static int uring_xfer_flush(uring_xfer_t *x)
+{
+	if (x->queued == 0)
+		return 0;
+
+	/* a chain must not continue into the next submission */
+	x->last->flags &= ~(IOSQE_IO_LINK | IOSQE_IO_HARDLINK);
+
+	int ret = 0;
+	unsigned reaped = 0;
+	struct io_uring_cqe cqe;
+
+	while (reaped < x->queued) {
+		if (uring_submit_and_wait(&x->ring, DEFAULT_POLL_TIMEOUT) < 0) {
+			if (errno == ETIME)
+				fprintf(stderr, "io_uring transfer timed out\n");
+			else
+				PERROR("io_uring_enter");
+			return -1;
+		}
+
+		while (uring_pop_cqe(&x->ring, &cqe)) {
+			reaped++;
+
+			const uring_op op = cqe.user_data >> 32;
+			const int32_t expected = (uint32_t)cqe.user_data;
+
+			if (cqe.res == -ECANCELED && ret < 0)
+				continue;
+
+			if (cqe.res < 0) {
+				fprintf(stderr, "io_uring %s: %s\n",
+					uring_op_names[op], strerror(-cqe.res));
+				/* hardlinked mkdirs do not break the chain */
+				if (op != uo_mkdir)
+					ret = -1;
+			} else if (cqe.res != expected) {
+				fprintf(stderr, "io_uring %s: short transfer\n",
+					uring_op_names[op]);
+				ret = -1;
+			}
+		}
+	}
+
+	x->queued = 0;
+	x->done += x->queued_bytes;
+	x->queued_bytes = 0;
+
+	if (x->prog_bar && ret == 0)
+		prog_bar_advance(x->prog_bar, x->done);
+
+	return ret;
+}
+
+static struct io_uring_sqe *uring_xfer_sqe(uring_xfer_t *x, uring_op op,
+					   uint32_t expected)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = uring_get_sqe(&x->ring))) {
+		if (uring_xfer_flush(x) < 0)
+			return NULL;
+		sqe = uring_get_sqe(&x->ring);
+	}
+
+	sqe->flags = op == uo_mkdir ? IOSQE_IO_HARDLINK : IOSQE_IO_LINK;
+	sqe->user_data = (uint64_t)op << 32 | expected;
+
+	x->last = sqe;
+	x->queued++;
+
+	return sqe;
+}
+
+static int uring_queue_mkdir(uring_xfer_t *x, const entry_t *entry)
+{
+	struct io_uring_sqe *sqe = uring_xfer_sqe(x, uo_mkdir, 0);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_MKDIRAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)entry->rel_path;
+	sqe->len = entry->permissions;
+
+	return 0;
+}
+
+static int uring_queue_open(uring_xfer_t *x, const entry_t *entry,
+			    operation_type operation)
+{
+	struct io_uring_sqe *sqe = uring_xfer_sqe(x, uo_open, 0);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)entry->rel_path;
+	sqe->open_flags = operation == op_read ? O_RDONLY :
+						 O_WRONLY | O_CREAT | O_EXCL;
+	sqe->len = entry->permissions;
+	sqe->file_index = 1;
+
+	return 0;
+}
+
+static int uring_queue_close(uring_xfer_t *x)
+{
+	struct io_uring_sqe *sqe = uring_xfer_sqe(x, uo_close, 0);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = 1;
+
+	return 0;
+}
+
+/* queues the file side and the socket side of one chunk */
+static int uring_queue_chunk(uring_xfer_t *x, operation_type operation,
+			     off_t offset, uint32_t len)
+{
+	void *buf = (void *)((uintptr_t)x->bufs + x->next_buf * URING_CHUNK);
+	x->next_buf = (x->next_buf + 1) % URING_BUFS;
+
+	struct io_uring_sqe *file_sqe, *soc_sqe;
+
+	/* both halves have to be filled in before either is submitted */
+	if (uring_sq_space_left(&x->ring) < 2 && uring_xfer_flush(x) < 0)
+		return -1;
+
+	if (operation == op_read) {
+		if (!(file_sqe = uring_xfer_sqe(x, uo_read, len)))
+			return -1;
+		file_sqe->opcode = IORING_OP_READ_FIXED;
+
+		if (!(soc_sqe = uring_xfer_sqe(x, uo_send, len)))
+			return -1;
+		soc_sqe->opcode = IORING_OP_SEND;
+	} else {
+		if (!(soc_sqe = uring_xfer_sqe(x, uo_recv, len)))
+			return -1;
+		soc_sqe->opcode = IORING_OP_RECV;
+
+		if (!(file_sqe = uring_xfer_sqe(x, uo_write, len)))
+			return -1;
+		file_sqe->opcode = IORING_OP_WRITE_FIXED;
+	}
+
+	file_sqe->fd = 0;
+	file_sqe->flags |= IOSQE_FIXED_FILE;
+	file_sqe->addr = (uintptr_t)buf;
+	file_sqe->len = len;
+	file_sqe->off = offset;
+	file_sqe->buf_index = 0;
+
+	soc_sqe->fd = x->soc;
+	soc_sqe->addr = (uintptr_t)buf;
+	soc_sqe->len = len;
+	soc_sqe->msg_flags = MSG_WAITALL;
+
+	x->queued_bytes += len;
+
+	return 0;
+}
+
+static int uring_queue_file(uring_xfer_t *x, const entry_t *entry,
+			    operation_type operation)
+{
+	/* nothing to send, but the receiver still has to create it */
+	if (entry->size == 0 && operation == op_read)
+		return 0;
+
+	if (uring_queue_open(x, entry, operation) < 0)
+		return -1;
+
+	for (off_t off = 0; off < entry->size; off += URING_CHUNK) {
+		const off_t left = entry->size - off;
+		const uint32_t len = left < URING_CHUNK ? left : URING_CHUNK;
+
+		if (uring_queue_chunk(x, operation, off, len) < 0)
+			return -1;
+	}
+
+	return uring_queue_close(x);
+}
+
+static int uring_batched(int soc, const stream_t *entries,
+			 operation_type operation, progress_bar_t *prog_bar)
+{
+	uring_xfer_t x;
+	if (uring_xfer_init(&x, soc, prog_bar) < 0)
+		return -1;
+
+	int ret = 0;
+	stream_iter_t it;
+	stream_iter_init(&it, entries);
+	entry_t *entry;
+
+	while ((entry = stream_iter_next(&it))) {
+		if (entry->type == et_dir) {
+			if (operation == op_write &&
+			    (ret = uring_queue_mkdir(&x, entry)) < 0)
+				goto cleanup;
+			continue;
+		}
+
+		if ((ret = uring_queue_file(&x, entry, operation)) < 0)
+			goto cleanup;
+	}
+
+	ret = uring_xfer_flush(&x);
+
+cleanup:
+	uring_xfer_destroy(&x);
+
+	return ret;
+}
+
+int send_batched(int soc, const stream_t *entries, transfer_engine engine,
+		 progress_bar_t *prog_bar)
+{
+	assert(engine == te_uring);
+
+	return uring_batched(soc, entries, op_read, prog_bar);
+}
+
+int recv_batched(int soc, const stream_t *entries, transfer_engine engine,
+		 progress_bar_t *prog_bar)
+{
+	assert(engine == te_uring);
+
+	return uring_batched(soc, entries, op_write, prog_bar);
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdbool.h>
+
+#include "core.h"
+#include "entry.h"
+#include "progress_bar.h"
+
+typedef enum transfer_engine {
+	/* mmap the file and send/recv through the mapping */
+	te_mmap,
+	/* sendfile(2) straight from the file fd, sending only */
+	te_sendfile,
+	/* splice(2) from the socket through a pipe into the file, receiving only */
+	te_splice,
+	/* batched io_uring chains over the whole entry list */
+	te_uring,
+} transfer_engine;
+
+/* returns -1 if name is not an engine usable for operation */
+int parse_engine(const char *name, operation_type operation,
+		 transfer_engine *engine);
+const char *get_engine_name(transfer_engine engine);
+/* checks the engine works on this system, falls back to te_mmap if not */
+void probe_engine(transfer_engine *engine);
+/* batched engines move all entries at once instead of one by one */
+bool engine_is_batched(transfer_engine engine);
+
+/* chdir to entries_t.parent_path before running */
+int send_entry(int soc, entry_t *entry, transfer_engine engine,
+	       progress_bar_t *prog_bar);
+int recv_entry(int soc, entry_t *entry, transfer_engine engine,
+	       progress_bar_t *prog_bar);
+
+/*
+ * sends a mapping of a file, with MSG_ZEROCOPY if it is big enough for that
+ * to pay off, the mapping can go away as soon as it returns
+ */
+int send_mapping(int soc, const void *map, size_t len,
+		 progress_bar_t *prog_bar);
+
+/*
+ * move len bytes of an already open file starting at offset
+ * receiving writes positionally, so ranges of one file can arrive in any order
+ */
+int send_range(int soc, int fd, off_t offset, size_t len,
+	       transfer_engine engine, progress_bar_t *prog_bar);
+int recv_range(int soc, int fd, off_t offset, size_t len,
+	       transfer_engine engine, progress_bar_t *prog_bar);
+
+/* for batched engines, prog_bar should cover entries_t.total_file_size */
+int send_batched(int soc, const stream_t *entries, transfer_engine engine,
+		 progress_bar_t *prog_bar);
+/* also creates the directories */
+int recv_batched(int soc, const stream_t *entries, transfer_engine engine,
+		 progress_bar_t *prog_bar);
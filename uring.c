@@ -0,0 +1,189 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "uring.h"
+
+#define RING_PTR(base, off) ((void *)((uintptr_t)(base) + (off)))
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+		     unsigned flags, void *arg, size_t arg_size)
+{
+	stats_syscall();
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       arg, arg_size);
+}
+
+static int sys_register(int fd, unsigned opcode, const void *arg,
+			unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(uring_t *ring, unsigned entries)
+{
+	struct io_uring_params p = { 0 };
+	*ring = (uring_t){ .fd = -1 };
+
+	if ((ring->fd = sys_setup(entries, &p)) < 0)
+		return -1;
+
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		errno = ENOSYS;
+		goto error;
+	}
+
+	ring->sq.ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq.ring_size =
+		p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sq.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq.ring = mmap(NULL, ring->sq.ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq.ring == MAP_FAILED)
+		goto error;
+
+	ring->cq.ring = mmap(NULL, ring->cq.ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_CQ_RING);
+	if (ring->cq.ring == MAP_FAILED)
+		goto error;
+
+	ring->sq.sqes = mmap(NULL, ring->sq.sqes_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQES);
+	if (ring->sq.sqes == MAP_FAILED)
+		goto error;
+
+	ring->sq.head = RING_PTR(ring->sq.ring, p.sq_off.head);
+	ring->sq.tail = RING_PTR(ring->sq.ring, p.sq_off.tail);
+	ring->sq.mask = RING_PTR(ring->sq.ring, p.sq_off.ring_mask);
+	ring->sq.array = RING_PTR(ring->sq.ring, p.sq_off.array);
+	ring->sq.entries = p.sq_entries;
+
+	ring->cq.head = RING_PTR(ring->cq.ring, p.cq_off.head);
+	ring->cq.tail = RING_PTR(ring->cq.ring, p.cq_off.tail);
+	ring->cq.mask = RING_PTR(ring->cq.ring, p.cq_off.ring_mask);
+	ring->cq.cqes = RING_PTR(ring->cq.ring, p.cq_off.cqes);
+
+	return 0;
+
+error:
+	uring_destroy(ring);
+
+	return -1;
+}
+
+void uring_destroy(uring_t *ring)
+{
+	const int err = errno;
+
+	if (ring->sq.sqes && ring->sq.sqes != MAP_FAILED)
+		munmap(ring->sq.sqes, ring->sq.sqes_size);
+	if (ring->cq.ring && ring->cq.ring != MAP_FAILED)
+		munmap(ring->cq.ring, ring->cq.ring_size);
+	if (ring->sq.ring && ring->sq.ring != MAP_FAILED)
+		munmap(ring->sq.ring, ring->sq.ring_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	*ring = (uring_t){ .fd = -1 };
+	errno = err;
+}
+
+int uring_register_buffers(uring_t *ring, const struct iovec *iovs,
+			   unsigned len)
+{
+	return sys_register(ring->fd, IORING_REGISTER_BUFFERS, iovs, len);
+}
+
+int uring_register_files_sparse(uring_t *ring, unsigned len)
+{
+	int fds[len];
+	for (unsigned i = 0; i < len; ++i)
+		fds[i] = -1;
+
+	return sys_register(ring->fd, IORING_REGISTER_FILES, fds, len);
+}
+
+unsigned uring_sq_space_left(const uring_t *ring)
+{
+	const unsigned head =
+		atomic_load_explicit((_Atomic unsigned *)ring->sq.head,
+				     memory_order_acquire);
+
+	return ring->sq.entries - (*ring->sq.tail + ring->sq.pending - head);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+	if (uring_sq_space_left(ring) == 0)
+		return NULL;
+
+	const unsigned idx =
+		(*ring->sq.tail + ring->sq.pending) & *ring->sq.mask;
+	ring->sq.pending++;
+
+	struct io_uring_sqe *sqe = &ring->sq.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq.array[idx] = idx;
+
+	return sqe;
+}
+
+int uring_submit_and_wait(uring_t *ring, int timeout_ms)
+{
+	const unsigned to_submit = ring->sq.pending;
+
+	atomic_store_explicit((_Atomic unsigned *)ring->sq.tail,
+			      *ring->sq.tail + to_submit, memory_order_release);
+	ring->sq.pending = 0;
+
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (timeout_ms % 1000) * 1000000L,
+	};
+	struct io_uring_getevents_arg arg = {
+		.sigmask = 0,
+		.sigmask_sz = _NSIG / 8,
+		.ts = (uintptr_t)&ts,
+	};
+
+	int ret;
+	do {
+		ret = sys_enter(ring->fd, to_submit, 1,
+				IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+				&arg, sizeof(arg));
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -1 : 0;
+}
+
+bool uring_pop_cqe(uring_t *ring, struct io_uring_cqe *cqe)
+{
+	const unsigned head = *ring->cq.head;
+	const unsigned tail = atomic_load_explicit(
+		(_Atomic unsigned *)ring->cq.tail, memory_order_acquire);
+
+	if (head == tail)
+		return false;
+
+	*cqe = ring->cq.cqes[head & *ring->cq.mask];
+	atomic_store_explicit((_Atomic unsigned *)ring->cq.head, head + 1,
+			      memory_order_release);
+
+	return true;
+}
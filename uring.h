@@ -0,0 +1,57 @@
+#pragma once
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* minimal io_uring wrapper over the raw syscalls, no liburing needed */
+typedef struct uring {
+	int fd;
+
+	struct uring_sq {
+		unsigned *head;
+		unsigned *tail;
+		unsigned *mask;
+		unsigned *array;
+		unsigned entries;
+		struct io_uring_sqe *sqes;
+
+		/* sqes filled in but not handed to the kernel yet */
+		unsigned pending;
+
+		void *ring;
+		size_t ring_size;
+		size_t sqes_size;
+	} sq;
+
+	struct uring_cq {
+		unsigned *head;
+		unsigned *tail;
+		unsigned *mask;
+		struct io_uring_cqe *cqes;
+
+		void *ring;
+		size_t ring_size;
+	} cq;
+} uring_t;
+
+/* returns -1 with errno set if io_uring is unavailable */
+int uring_init(uring_t *ring, unsigned entries);
+void uring_destroy(uring_t *ring);
+
+int uring_register_buffers(uring_t *ring, const struct iovec *iovs,
+			   unsigned len);
+/* registers len empty slots for direct descriptors */
+int uring_register_files_sparse(uring_t *ring, unsigned len);
+
+/* returns NULL if the submission queue is full */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+unsigned uring_sq_space_left(const uring_t *ring);
+
+/*
+ * submits all pending sqes and waits for at least one completion
+ * returns -1 with errno set to ETIME if nothing completed within timeout_ms
+ */
+int uring_submit_and_wait(uring_t *ring, int timeout_ms);
+/* returns false if the completion queue is empty */
+bool uring_pop_cqe(uring_t *ring, struct io_uring_cqe *cqe);
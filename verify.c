@@ -0,0 +1,297 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "hash.h"
+#include "message.h"
+#include "verify.h"
+
+/* mapped a slice at a time, so huge files do not pin the page cache */
+#define VERIFY_SLICE (64l << 20)
+
+/* what the data paths of this thread moved of the current entry */
+static __thread struct feed {
+	verifier_t *verifier;
+	digest_t digest;
+	/* a range was skipped or came out of order */
+	bool broken;
+} feed;
+
+static void feed_reset(void)
+{
+	digest_init(&feed.digest);
+	feed.broken = false;
+}
+
+static int hash_file(const entry_t *entry, uint64_t *result)
+{
+	digest_t digest;
+	digest_init(&digest);
+
+	const int fd = open(entry->rel_path, O_RDONLY);
+	if (fd < 0) {
+		PERROR("open");
+		return -1;
+	}
+
+	int ret = 0;
+	for (off_t off = 0; off < entry->size; off += VERIFY_SLICE) {
+		const size_t len = entry->size - off < VERIFY_SLICE ?
+					   entry->size - off :
+					   VERIFY_SLICE;
+
+		void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, off);
+		if (map == MAP_FAILED) {
+			PERROR("mmap");
+			ret = -1;
+			break;
+		}
+		madvise(map, len, MADV_SEQUENTIAL);
+
+		digest_update(&digest, map, len);
+		munmap(map, len);
+	}
+
+	close(fd);
+	*result = digest_final(&digest);
+
+	return ret;
+}
+
+static void *verify_worker(void *arg)
+{
+	verifier_t *v = arg;
+
+	pthread_mutex_lock(&v->lock);
+	for (;;) {
+		while (v->next >= v->ready && v->next < v->len)
+			pthread_cond_wait(&v->cond, &v->lock);
+		if (v->next >= v->len)
+			break;
+
+		const size_t i = v->next++;
+		if (v->fed[i])
+			continue;
+		pthread_mutex_unlock(&v->lock);
+
+		uint64_t digest = 0;
+		const int ret = v->entries[i]->type == et_reg ?
+					hash_file(v->entries[i], &digest) :
+					0;
+
+		pthread_mutex_lock(&v->lock);
+		v->digests[i] = digest;
+		if (ret < 0)
+			v->failed = true;
+	}
+	pthread_mutex_unlock(&v->lock);
+
+	return NULL;
+}
+
+int start_verifier(verifier_t *v, const stream_t *entries, bool all_ready)
+{
+	*v = (verifier_t){
+		.len = entries->metadata.len,
+		.entries = malloc(entries->metadata.len * sizeof(entry_t *)),
+		.digests = calloc(entries->metadata.len, sizeof(uint64_t)),
+		.fed = calloc(entries->metadata.len, sizeof(bool)),
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.ready = all_ready ? entries->metadata.len : 0,
+	};
+	if (!v->entries || !v->digests || !v->fed) {
+		PERROR("malloc");
+		goto error;
+	}
+
+	stream_iter_t it;
+	stream_iter_init(&it, entries);
+	for (size_t i = 0; i < v->len; ++i)
+		v->entries[i] = stream_iter_next(&it);
+
+	for (; v->threads < VERIFY_THREADS; ++v->threads) {
+		if (pthread_create(&v->tids[v->threads], NULL, verify_worker,
+				   v)) {
+			PERROR("pthread_create");
+			break;
+		}
+	}
+	if (v->threads == 0)
+		goto error;
+
+	return 0;
+
+error:
+	destroy_verifier(v);
+
+	return -1;
+}
+
+void verifier_ready(verifier_t *v, size_t ready)
+{
+	pthread_mutex_lock(&v->lock);
+	if (feed.verifier == v && ready == v->ready + 1 && !feed.broken) {
+		const entry_t *entry = v->entries[ready - 1];
+		if (entry->type == et_reg &&
+		    feed.digest.len == (uint64_t)entry->size) {
+			v->digests[ready - 1] = digest_final(&feed.digest);
+			v->fed[ready - 1] = true;
+		}
+	}
+	if (ready > v->ready) {
+		v->ready = ready;
+		pthread_cond_broadcast(&v->cond);
+	}
+	pthread_mutex_unlock(&v->lock);
+
+	if (feed.verifier == v)
+		feed_reset();
+}
+
+void verifier_attach(verifier_t *v)
+{
+	feed.verifier = v;
+	feed_reset();
+}
+
+void verify_feed(off_t off, const void *data, size_t len)
+{
+	if (!feed.verifier || feed.broken || len == 0)
+		return;
+
+	if ((uint64_t)off != feed.digest.len) {
+		feed.broken = true;
+		return;
+	}
+	digest_update(&feed.digest, data, len);
+}
+
+int finish_verifier(verifier_t *v)
+{
+	verifier_ready(v, v->len);
+	if (feed.verifier == v)
+		feed.verifier = NULL;
+
+	for (unsigned i = 0; i < v->threads; ++i)
+		pthread_join(v->tids[i], NULL);
+	v->threads = 0;
+
+	return v->failed ? -1 : 0;
+}
+
+void destroy_verifier(verifier_t *v)
+{
+	if (v->threads) {
+		/* the transfer failed, whatever was not picked up is skipped */
+		pthread_mutex_lock(&v->lock);
+		v->next = v->len;
+		pthread_cond_broadcast(&v->cond);
+		pthread_mutex_unlock(&v->lock);
+
+		finish_verifier(v);
+	}
+
+	if (feed.verifier == v)
+		feed.verifier = NULL;
+
+	free(v->entries);
+	free(v->digests);
+	free(v->fed);
+	*v = (verifier_t){ 0 };
+}
+
+int send_digests(int soc, verifier_t *v)
+{
+	if (finish_verifier(v) < 0)
+		fprintf(stderr, "some files could not be hashed\n");
+
+	header_t h = {
+		.type = mt_digests,
+		.data_size = v->len * sizeof(uint64_t),
+	};
+
+	return send_msg(soc, &h, v->digests);
+}
+
+ssize_t check_digests(int soc, verifier_t *v, const char *addr_str)
+{
+	header_t h;
+	uint64_t *theirs = NULL;
+	uint32_t *mismatches = NULL;
+	ssize_t ret = -1;
+
+	/* receive_msg frees the buffer itself when it fails */
+	if (receive_msg(soc, &h, (void **)&theirs) < 0)
+		return -1;
+	if (h.type != mt_digests || h.data_size != v->len * sizeof(uint64_t)) {
+		fprintf(stderr, "Host %s sent invalid digests\n", addr_str);
+		goto cleanup;
+	}
+
+	if (finish_verifier(v) < 0)
+		fprintf(stderr, "Some files from host %s could not be hashed\n",
+			addr_str);
+
+	if (!(mismatches = malloc(v->len * sizeof(uint32_t) + 1))) {
+		PERROR("malloc");
+		goto cleanup;
+	}
+
+	size_t n = 0;
+	for (size_t i = 0; i < v->len; ++i) {
+		if (theirs[i] == v->digests[i])
+			continue;
+
+		fprintf(stderr, "Checksum mismatch for `%s` from host %s\n",
+			v->entries[i]->rel_path, addr_str);
+		mismatches[n++] = i;
+	}
+
+	header_t res = {
+		.type = mt_mismatches,
+		.data_size = n * sizeof(uint32_t),
+	};
+	if (send_msg(soc, &res, mismatches) < 0)
+		goto cleanup;
+
+	if (n == 0)
+		printf("Verified %zu entries from host %s\n", v->len,
+		       addr_str);
+	ret = n;
+
+cleanup:
+	free(theirs);
+	free(mismatches);
+
+	return ret;
+}
+
+ssize_t recv_mismatches(int soc, verifier_t *v)
+{
+	header_t h;
+	uint32_t *mismatches = NULL;
+
+	if (receive_msg(soc, &h, (void **)&mismatches) < 0)
+		return -1;
+
+	if (h.type != mt_mismatches || h.data_size % sizeof(uint32_t)) {
+		free(mismatches);
+		return -1;
+	}
+
+	const size_t n = h.data_size / sizeof(uint32_t);
+	for (size_t i = 0; i < n; ++i) {
+		if (mismatches[i] < v->len)
+			fprintf(stderr, "`%s` arrived corrupted\n",
+				v->entries[mismatches[i]]->rel_path);
+	}
+
+	free(mismatches);
+
+	return n;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "entry.h"
+#include "hash.h"
+#include "stream.h"
+
+#define VERIFY_THREADS 2
+
+/*
+ * the digests of a transfer, hashed from the bytes as the data paths move
+ * them where they can, see verifier_attach
+ * the other files are hashed on its own threads while the transfer goes on,
+ * entries are only picked up once they are marked ready
+ * the threads open the files relative to the cwd of the process
+ */
+typedef struct verifier {
+	size_t len;
+	entry_t **entries;
+	/* 0 for directories */
+	uint64_t *digests;
+	/* digested on the way through, the threads skip them */
+	bool *fed;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* entries [0, ready) are complete on the disk */
+	size_t ready;
+	size_t next;
+	bool failed;
+
+	unsigned threads;
+	pthread_t tids[VERIFY_THREADS];
+} verifier_t;
+
+/* marks everything ready right away, for senders that do not feed it */
+int start_verifier(verifier_t *verifier, const stream_t *entries,
+		   bool all_ready);
+/*
+ * the entries are done in order, so when a single entry more is ready the
+ * bytes fed for it on the attached thread are its digest, if they covered it
+ * whole and in order
+ */
+void verifier_ready(verifier_t *verifier, size_t ready);
+/*
+ * the thread that moves the data from now on feeds the entry after the last
+ * ready one, until finish_verifier or destroy_verifier
+ */
+void verifier_attach(verifier_t *verifier);
+/* called by the data paths with bytes of the current entry at off */
+void verify_feed(off_t off, const void *data, size_t len);
+/* waits for every digest, returns -1 if a file could not be hashed */
+int finish_verifier(verifier_t *verifier);
+/* entries that are not being hashed yet are dropped */
+void destroy_verifier(verifier_t *verifier);
+
+/* digests of both sides, sent by the sender once all data is out */
+int send_digests(int soc, verifier_t *verifier);
+/*
+ * compares the sender's digests with the receiver's and answers with the
+ * indices of the entries that differ, returns how many there were
+ */
+ssize_t check_digests(int soc, verifier_t *verifier, const char *addr_str);
+/* the sender's end of check_digests, returns how many entries differ */
+ssize_t recv_mismatches(int soc, verifier_t *verifier);
@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+#include <errno.h>
+/* linux/errqueue.h needs struct timespec */
+#include <time.h>
+#include <linux/errqueue.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "core.h"
+#include "probes.h"
+#include "stats.h"
+#include "zerocopy.h"
+
+/* set once zerocopy turned out not to work or not to pay off */
+static atomic_bool disabled = false;
+
+typedef struct zc_send {
+	int soc;
+	/* sends made with MSG_ZEROCOPY and how many of them completed */
+	uint32_t sends;
+	uint32_t completed;
+	/* the kernel fell back to copying for some of them */
+	bool copied;
+} zc_send_t;
+
+bool zerocopy_worth(int soc, size_t len)
+{
+	if (len < ZEROCOPY_MIN_SIZE || atomic_load(&disabled))
+		return false;
+
+	const int one = 1;
+	if (setsockopt(soc, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+		atomic_store(&disabled, true);
+		return false;
+	}
+	stats_syscall();
+
+	return true;
+}
+
+/* reads every completion that is queued, waits for one first if wait is set */
+static int reap(zc_send_t *zc, bool wait)
+{
+	while (true) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err)) +
+			     CMSG_SPACE(sizeof(struct sockaddr_storage))];
+		struct msghdr msg = {
+			.msg_control = control,
+			.msg_controllen = sizeof(control),
+		};
+
+		/* the error queue never blocks, it is empty with EAGAIN */
+		const ssize_t r = recvmsg(zc->soc, &msg, MSG_ERRQUEUE);
+		stats_syscall();
+		if (r < 0 && errno != EAGAIN && errno != EINTR) {
+			PERROR("recvmsg");
+			return -1;
+		}
+
+		if (r < 0) {
+			if (!wait)
+				return 0;
+
+			/* a non empty error queue is reported as POLLERR */
+			struct pollfd p = { .fd = zc->soc };
+			const int64_t start = stats_now_ns();
+			const int ret = poll(&p, 1, DEFAULT_POLL_TIMEOUT);
+			stats_poll(stats_now_ns() - start);
+			if (ret == 0) {
+				fprintf(stderr, "zerocopy completions timed out\n");
+				return -1;
+			} else if (ret < 0 && errno != EINTR) {
+				PERROR("poll");
+				return -1;
+			}
+			continue;
+		}
+
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+		     cm = CMSG_NXTHDR(&msg, cm)) {
+			const struct sock_extended_err *err =
+				(const void *)CMSG_DATA(cm);
+
+			if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				fprintf(stderr, "send failed: %s\n",
+					strerror(err->ee_errno));
+				return -1;
+			}
+
+			/* ee_info to ee_data, both ends included */
+			zc->completed += err->ee_data - err->ee_info + 1;
+			if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				zc->copied = true;
+		}
+		wait = false;
+	}
+}
+
+int zerocopy_send(int soc, const void *buf, size_t len,
+		  progress_bar_t *prog_bar)
+{
+	zc_send_t zc = { .soc = soc };
+	int ret = 0;
+
+	for (size_t sent = 0; sent < len;) {
+		if (zc.sends - zc.completed >= ZEROCOPY_MAX_INFLIGHT &&
+		    (ret = reap(&zc, true)) < 0)
+			break;
+
+		const size_t chunk =
+			len - sent < ZEROCOPY_CHUNK ? len - sent : ZEROCOPY_CHUNK;
+		const ssize_t s = send(soc, (const char *)buf + sent, chunk,
+				       MSG_ZEROCOPY);
+		stats_io(op_write, s);
+
+		if (s < 0 && errno == ENOBUFS && zc.sends != zc.completed) {
+			/* out of pinned memory until something completes */
+			if ((ret = reap(&zc, true)) < 0)
+				break;
+			continue;
+		} else if (s < 0 && errno == ENOBUFS) {
+			/* nothing to wait for, the limit is too low for it */
+			atomic_store(&disabled, true);
+			if (perf_soc_op(soc, op_write, (char *)buf + sent,
+					len - sent, NULL) < 0)
+				ret = -1;
+			sent = len;
+		} else if (s < 0 && errno != EINTR) {
+			PERROR("send");
+			ret = -1;
+			break;
+		} else if (s > 0) {
+			zc.sends++;
+			sent += s;
+		}
+
+		if (prog_bar)
+			prog_bar_advance(prog_bar, sent);
+	}
+
+	/* the pages are the caller's again only once every send completed */
+	while (ret == 0 && zc.completed != zc.sends)
+		ret = reap(&zc, true);
+
+	if (zc.copied)
+		atomic_store(&disabled, true);
+	if (ret == 0 && prog_bar)
+		prog_bar_finish(prog_bar);
+
+	PROBE4(zerocopy__done, soc, len, zc.sends, zc.copied);
+
+	return ret;
+}
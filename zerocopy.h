@@ -0,0 +1,30 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "progress_bar.h"
+
+/*
+ * below this pinning the pages and reaping the completions costs more than
+ * the copy MSG_ZEROCOPY saves
+ */
+#define ZEROCOPY_MIN_SIZE (16 << 20)
+/* bytes per send, each send is one completion to reap */
+#define ZEROCOPY_CHUNK (1 << 20)
+/* sends the kernel may hold pages of, they count against RLIMIT_MEMLOCK */
+#define ZEROCOPY_MAX_INFLIGHT 4
+
+/*
+ * whether len bytes should go out through zerocopy_send, enables SO_ZEROCOPY
+ * on soc if so
+ * turns itself off for good once the socket does not support it or the
+ * kernel reports it copied the data anyway, e.g. over loopback
+ */
+bool zerocopy_worth(int soc, size_t len);
+
+/*
+ * sends buf with MSG_ZEROCOPY and only returns once the kernel let go of
+ * every page of it, so buf can be unmapped or reused right after
+ */
+int zerocopy_send(int soc, const void *buf, size_t len,
+		  progress_bar_t *prog_bar);